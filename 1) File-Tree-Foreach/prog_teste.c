@@ -2,98 +2,357 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "file_tree_foreach.h"
 
-// Max number of files that can be found in one search
-#define MAX_FILES 500
-// Max number of characters for the filenames
-#define MAX_FILE_NAME_SIZE 100
+// Bytes of each block of the arena the filenames are copied to (longer names get a block of their own)
+#define NAMES_BLOCK_SIZE (64 * 1024)
+// Filenames sorted by each thread before the sorted runs are merged (fewer are sorted by a single thread)
+#define SORT_MIN_RUN 4096
 
-// Global array that will hold the filenames of all the files found matching the pattern
-char *filenames[MAX_FILES];
+// Block of the arena the filenames are copied to
+typedef struct namesBlock {
+    struct namesBlock *next;
+    size_t size, used;
+    char data[];
+} NamesBlock;
+
+// Files found by a search, handed to every batch of the walk (batches come from several threads at once)
+typedef struct search {
+    const char *pattern;
+    pthread_mutex_t lock;
+    // Names of the files found matching the pattern (pointing into [blocks])
+    char **filenames;
+    size_t count, capacity;
+    NamesBlock *blocks;
+    // Set by --top: only the [top] first names are kept, in a max-heap, the others are only counted
+    size_t top;
+    size_t found;
+} Search;
+
+// Part of a parallel merge sort run by one thread
+typedef struct sortTask {
+    char **filenames, **buffer;
+    size_t first, middle, last;
+} SortTask;
 
 /* -- Private Functions -- */
-static void saveFileName(const char *filename, void *context);
-static void sortFileNames(const char *context);
-static size_t arraySize();
+static int saveFileNames(const FileTreeEntry *directory, const FileTreeEntry *entries, size_t count, void *user);
+static int keepTopFileName(Search *search, const char *name);
+static char *copyFileName(Search *search, const char *name);
+static void sortFileNames(char **filenames, size_t count);
+static void *sortRun(void *arg);
+static void *mergeRuns(void *arg);
+static void heapSiftDown(char **heap, size_t count, size_t index);
+static void showFileNames(Search *search);
+static void freeFileNames(Search *search);
+static int compareFileNames(const void *a, const void *b);
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    long top = 0;
+    if (argc == 5 && strcmp(argv[3], "--top") == 0)
+        top = atol(argv[4]);
+    if ((argc != 3 && argc != 5) || (argc == 5 && top <= 0))
     {
-        fprintf(stderr, "Usage: %s <start dir> <pattern>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <start dir> <pattern> [--top N]\n", argv[0]);
         return -1;
     }
     // Search through the filesystem for files matching the pattern the user requested starting at a location user-defined as well
-    file_tree_foreach(argv[1], saveFileName, argv[2]);
+    Search search;
+    memset(&search, 0, sizeof(search));
+    search.pattern = argv[2];
+    search.top = top;
+    pthread_mutex_init(&search.lock, NULL);
+    FileTreeOptions options = { argv[2], FILE_TREE_QUIET, 0 };
+    if (file_tree_walk_parallel(argv[1], &options, saveFileNames, &search, 0) < 0)
+    {
+        fprintf(stderr, "Could not search %s\n", argv[1]);
+        freeFileNames(&search);
+        return -1;
+    }
     // Sort the files from the search and display the results to the user
-    sortFileNames(argv[2]);
+    showFileNames(&search);
+    freeFileNames(&search);
+    return 0;
 }
 
 /**
-* Save a filename
-* @param filename Name of the file to save
-* @param context The context in which the file was found
+* Save the filenames of a batch of files found
+* @param directory Directory the files were found in
+* @param entries Files found
+* @param count Number of [entries]
+* @param user The search the files were found by
+* @returns FILE_TREE_STOP once there is no memory left, FILE_TREE_CONTINUE until then
 */
-static void saveFileName(const char *filename, void *context)
+static int saveFileNames(const FileTreeEntry *directory, const FileTreeEntry *entries, size_t count, void *user)
 {
-    size_t next_index = arraySize();
-    // Important to allocate memory for the new string
-    char *string = malloc(strlen(filename) + 1);
-    // Copy to the new allocated space
-    strcpy(string, filename);
-    // Save address of the pointer to the string in filenames array
-    filenames[next_index] = string;
+    Search *search = (Search *)user;
+    int result = FILE_TREE_CONTINUE;
+    pthread_mutex_lock(&search->lock);
+    for (size_t i = 0; i < count && result == FILE_TREE_CONTINUE; i++)
+    {
+        const char *name = entries[i].path + entries[i].name_offset;
+        search->found++;
+        if (search->top > 0)
+        {
+            if (keepTopFileName(search, name) < 0)
+                result = FILE_TREE_STOP;
+            continue;
+        }
+        if (search->count == search->capacity)
+        {
+            size_t capacity = search->capacity == 0 ? 1024 : search->capacity * 2;
+            char **filenames = (char **)realloc(search->filenames, capacity * sizeof(char *));
+            if (filenames == NULL)
+            {
+                result = FILE_TREE_STOP;
+                break;
+            }
+            search->filenames = filenames;
+            search->capacity = capacity;
+        }
+        // Important to keep a copy of the name, the entries are reused by the next batch
+        char *string = copyFileName(search, name);
+        if (string == NULL)
+            result = FILE_TREE_STOP;
+        else
+            search->filenames[search->count++] = string;
+    }
+    pthread_mutex_unlock(&search->lock);
+    return result;
 }
 
 /**
-* Sort File Names
-* Sort the names of the files found alphabetically using BubbleSort
-* @param context The context in which the filenames were found
+* Keep a name if it is one of the [top] first ones found so far (search locked)
+* The heap keeps the last of the names kept on top, a name coming after it is dropped right away
+* @returns 0 or -1 if there was no memory
+*/
+static int keepTopFileName(Search *search, const char *name)
+{
+    if (search->capacity == 0)
+    {
+        search->filenames = (char **)malloc(search->top * sizeof(char *));
+        if (search->filenames == NULL)
+            return -1;
+        search->capacity = search->top;
+    }
+    if (search->count == search->top && strcmp(name, search->filenames[0]) >= 0)
+        return 0;
+
+    // Heap names are on the heap, the ones replaced are freed
+    char *string = strdup(name);
+    if (string == NULL)
+        return -1;
+    if (search->count < search->top)
+    {
+        // Sift up
+        size_t index = search->count++;
+        while (index > 0 && strcmp(search->filenames[(index - 1) / 2], string) < 0)
+        {
+            search->filenames[index] = search->filenames[(index - 1) / 2];
+            index = (index - 1) / 2;
+        }
+        search->filenames[index] = string;
+        return 0;
+    }
+    free(search->filenames[0]);
+    search->filenames[0] = string;
+    heapSiftDown(search->filenames, search->count, 0);
+    return 0;
+}
+
+/**
+* Copy a name to the arena of the search (search locked)
+* @returns the copy or NULL if there was no memory
 */
-static void sortFileNames(const char *context)
+static char *copyFileName(Search *search, const char *name)
 {
-    size_t files_number = arraySize();
+    size_t size = strlen(name) + 1;
+    NamesBlock *block = search->blocks;
+    if (block == NULL || block->size - block->used < size)
+    {
+        size_t block_size = size > NAMES_BLOCK_SIZE ? size : NAMES_BLOCK_SIZE;
+        block = (NamesBlock *)malloc(sizeof(NamesBlock) + block_size);
+        if (block == NULL)
+            return NULL;
+        block->size = block_size;
+        block->used = 0;
+        block->next = search->blocks;
+        search->blocks = block;
+    }
+    char *copy = block->data + block->used;
+    memcpy(copy, name, size);
+    block->used += size;
+    return copy;
+}
 
-    if (files_number == 0)
+/**
+* Sort File Names
+* Sort the names alphabetically with a parallel merge sort: each thread sorts a run, then the runs are merged
+* two by two (the merges of a round run at the same time)
+* @param filenames Names to sort
+* @param count Number of [filenames]
+*/
+static void sortFileNames(char **filenames, size_t count)
+{
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t run_count = processors > 1 ? (size_t)processors : 1;
+    while (run_count > 1 && count / run_count < SORT_MIN_RUN)
+        run_count /= 2;
+    char **buffer = run_count > 1 ? (char **)malloc(count * sizeof(char *)) : NULL;
+    if (buffer == NULL)
     {
-        printf("| -- SEARCH RESULTS -- |\n\n-Results no: %ld\n-Sorted: alphabetically\n-Pattern: \"%s\"\n\n", files_number, context);
+        qsort(filenames, count, sizeof(char *), compareFileNames);
         return;
     }
 
-    // Sort the filenames using bubble sort
-    for (int i = 0; i < files_number; i++)
+    // Runs bounds, [run_count] + 1 of them
+    size_t bounds[run_count + 1];
+    for (size_t i = 0; i <= run_count; i++)
+        bounds[i] = count * i / run_count;
+
+    pthread_t threads[run_count];
+    SortTask tasks[run_count];
+    int started[run_count];
+    for (size_t i = 0; i < run_count; i++)
+    {
+        SortTask task = { filenames, buffer, bounds[i], bounds[i], bounds[i + 1] };
+        tasks[i] = task;
+        // The run is sorted by this thread when no other can be started
+        started[i] = pthread_create(&threads[i], NULL, sortRun, &tasks[i]) == 0;
+        if (!started[i])
+            sortRun(&tasks[i]);
+    }
+    for (size_t i = 0; i < run_count; i++)
+        if (started[i])
+            pthread_join(threads[i], NULL);
+
+    // Each round merges the runs two by two, halving their number
+    for (size_t width = 1; width < run_count; width *= 2)
     {
-        for (int j = i + 1; j < files_number; j++)
+        size_t task_count = 0;
+        for (size_t i = 0; i + width < run_count; i += 2 * width)
         {
-            if (strcmp(filenames[i], filenames[j]) > 0)
-            {
-                char *temp = filenames[i];
-                filenames[i] = filenames[j];
-                filenames[j] = temp;
-            }
+            size_t last = i + 2 * width < run_count ? bounds[i + 2 * width] : bounds[run_count];
+            SortTask task = { filenames, buffer, bounds[i], bounds[i + width], last };
+            tasks[task_count] = task;
+            started[task_count] = pthread_create(&threads[task_count], NULL, mergeRuns, &tasks[task_count]) == 0;
+            if (!started[task_count])
+                mergeRuns(&tasks[task_count]);
+            task_count++;
         }
+        for (size_t i = 0; i < task_count; i++)
+            if (started[i])
+                pthread_join(threads[i], NULL);
     }
+    free(buffer);
+}
+
+/**
+* Sort thread: sorts the names from [first] to [last]
+*/
+static void *sortRun(void *arg)
+{
+    SortTask *task = (SortTask *)arg;
+    qsort(task->filenames + task->first, task->last - task->first, sizeof(char *), compareFileNames);
+    return NULL;
+}
 
-    // Display sorted results
-    printf("| -- SEARCH RESULTS -- |\n\n-Results no: %ld\n-Sorted: alphabetically\n-Pattern: \"%s\"\n\n", files_number, context);
-    for (int i = 0; i < files_number; i++)
+/**
+* Merge thread: merges the sorted runs [first, middle) and [middle, last) through the buffer
+*/
+static void *mergeRuns(void *arg)
+{
+    SortTask *task = (SortTask *)arg;
+    char **filenames = task->filenames, **buffer = task->buffer;
+    size_t i = task->first, j = task->middle, k = task->first;
+    while (i < task->middle && j < task->last)
+        buffer[k++] = strcmp(filenames[i], filenames[j]) <= 0 ? filenames[i++] : filenames[j++];
+    while (i < task->middle)
+        buffer[k++] = filenames[i++];
+    while (j < task->last)
+        buffer[k++] = filenames[j++];
+    memcpy(filenames + task->first, buffer + task->first, (task->last - task->first) * sizeof(char *));
+    return NULL;
+}
+
+/**
+* Move the name at [index] down the max-heap until its children come before it
+*/
+static void heapSiftDown(char **heap, size_t count, size_t index)
+{
+    char *name = heap[index];
+    while (2 * index + 1 < count)
     {
-        printf("%d) %s\n", i + 1, filenames[i]);
+        size_t child = 2 * index + 1;
+        if (child + 1 < count && strcmp(heap[child + 1], heap[child]) > 0)
+            child++;
+        if (strcmp(heap[child], name) <= 0)
+            break;
+        heap[index] = heap[child];
+        index = child;
     }
-    return;
+    heap[index] = name;
 }
 
 /**
-* Array Size
-* Returns the number of element inside the filenames array
+* Show File Names
+* Sort the names of the files found alphabetically and display them
+* @param search The search the filenames were found by
 */
-static size_t arraySize()
+static void showFileNames(Search *search)
+{
+    if (search->top > 0)
+    {
+        // Heap sort: the last name of the heap goes to the end, the heap shrinks by one
+        for (size_t count = search->count; count > 1; count--)
+        {
+            char *last = search->filenames[0];
+            search->filenames[0] = search->filenames[count - 1];
+            search->filenames[count - 1] = last;
+            heapSiftDown(search->filenames, count - 1, 0);
+        }
+    }
+    else
+    {
+        sortFileNames(search->filenames, search->count);
+    }
+
+    // Display sorted results (the output is written in large blocks, there may be millions of lines)
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    printf("| -- SEARCH RESULTS -- |\n\n-Results no: %zu\n-Sorted: alphabetically\n-Pattern: \"%s\"\n", search->found, search->pattern);
+    if (search->top > 0)
+        printf("-Showing: the first %zu\n", search->count);
+    printf("\n");
+    for (size_t i = 0; i < search->count; i++)
+    {
+        printf("%zu) %s\n", i + 1, search->filenames[i]);
+    }
+}
+
+/**
+* Free the names kept by a search
+*/
+static void freeFileNames(Search *search)
+{
+    if (search->top > 0)
+    {
+        for (size_t i = 0; i < search->count; i++)
+            free(search->filenames[i]);
+    }
+    while (search->blocks != NULL)
+    {
+        NamesBlock *next = search->blocks->next;
+        free(search->blocks);
+        search->blocks = next;
+    }
+    free(search->filenames);
+    pthread_mutex_destroy(&search->lock);
+}
+
+static int compareFileNames(const void *a, const void *b)
 {
-    size_t items_num = 0;
-    for (; items_num < MAX_FILES; items_num++)
-        if (*(filenames + items_num) == 0)
-            return items_num;
-    return items_num;
+    return strcmp(*(char *const *)a, *(char *const *)b);
 }
@@ -1,90 +1,1295 @@
+#define _GNU_SOURCE
 #include <dirent.h>
 #include <errno.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include "file_tree_foreach.h"
 
+// Bytes of directory entries fetched by each getdents64 call
+#ifndef FILE_TREE_DENTS_SIZE
+#define FILE_TREE_DENTS_SIZE (64 * 1024)
+#endif
+// Directories a deque holds before it has to grow
+#define TREE_DEQUE_INITIAL_CAPACITY 64
+// Victims a worker tries before going to sleep
+#define TREE_STEAL_ATTEMPTS 4
+
+// Directories waiting to be read by a worker. The owner pushes and pops at the tail (depth first, few
+// directories queued at once) while the other workers steal from the head (the oldest, biggest subtrees)
+typedef struct tree_deque {
+    pthread_mutex_t lock;
+    char **dirpaths;
+    size_t head, count, capacity;
+} TreeDeque;
+
+// What a walk reports and where it goes, compiled once from its options
+typedef struct tree_rules {
+    int flags;
+    FileTreePattern *pattern;
+    // Names of the directories pruned (NULL for none)
+    FileTreePattern *exclude;
+    size_t max_depth;
+    uint64_t min_size, max_size;
+} TreeRules;
+
+// State shared by the workers of a walk
+typedef struct tree_pool {
+    int thread_count;
+    TreeDeque *deques;
+    FileTreeBatchFunction batch;
+    void *user;
+    size_t batch_size;
+    TreeRules rules;
+    // Path the walk started at, the walk fails when it cannot be read (only compared, it is freed once read)
+    const char *root;
+    size_t root_length;
+    // The root ends in '/' ("/", "dir/"): the separator of its first level is part of it
+    int root_separator;
+    atomic_int root_failed;
+    // Set when a callback returns FILE_TREE_STOP, the directories still queued are dropped
+    atomic_int stopped;
+    // Directories queued or being read, the walk is over when it drops to 0
+    atomic_size_t pending;
+    // Directories sitting in the deques
+    atomic_size_t queued;
+    // Workers with nothing to do sleep on [idle] until a directory is queued or the walk is over
+    atomic_int sleepers;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+} TreePool;
+
+typedef struct tree_worker {
+    TreePool *pool;
+    int index;
+    unsigned int seed;
+    // Reused by every directory the worker reads
+    char *buffer;
+    // Batch being filled: the paths of its entries are packed in [paths] (at [path_offsets] until handed out)
+    FileTreeEntry *entries;
+    size_t *path_offsets;
+    size_t entry_count, entry_capacity;
+    char *paths;
+    size_t paths_used, paths_capacity;
+    // Subdirectories of the directory being read, queued once its last batch was handed out
+    char **subdirpaths;
+    size_t subdir_count, subdir_capacity;
+} TreeWorker;
+
+// Adapts the callback of file_tree_foreach_parallel to the batches of the pool
+typedef struct tree_foreach_call {
+    void (*doit)(const char *, void *);
+    void *context;
+} TreeForeachCall;
+
+// Entries of an open directory, read in large batches straight from the kernel
+typedef struct tree_reader {
+    int fd;
+#ifdef __linux__
+    char *buffer;
+    size_t used, offset;
+    // Offset of the entry after the last one read (d_off), to resume from
+    int64_t position;
+#else
+    DIR *dir;
+    // Entries read so far, to resume from
+    int64_t position;
+#endif
+} TreeReader;
+
+// A directory on the stack of an iterator
+typedef struct tree_frame {
+    TreeReader reader;
+    // Whether [reader] is open, a frame closed to stay within the descriptor budget resumes at [position]
+    int open;
+    int64_t position;
+    char *buffer;
+    // Length of the path of the directory, a prefix of the path of the iterator
+    size_t path_length;
+    // Identity of the directory, to detect loops and directories replaced while closed
+    dev_t dev;
+    ino_t ino;
+} TreeFrame;
+
+struct file_tree_iterator {
+    TreeRules rules;
+    size_t fd_budget;
+    // Directories being read, the start of the walk first
+    TreeFrame *frames;
+    size_t depth, frame_capacity;
+    size_t open_count;
+    // Path of the last entry returned
+    char *path;
+    size_t path_capacity;
+    size_t name_offset;
+    // Depth of the last entry returned and whether it is a directory to walk into on the next call
+    size_t entry_depth;
+    int descend;
+};
+
+#ifdef __linux__
+// Record layout of getdents64
+typedef struct tree_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} TreeDirent64;
+#endif
+
+/* -- Private Functions -- */
+static int tree_is_directory(int dirfd, const char *name, unsigned char type, int follow);
+static int tree_rules_init(TreeRules *rules, const FileTreeOptions *options);
+static void tree_rules_destroy(TreeRules *rules);
+static int tree_rules_hidden(const TreeRules *rules, const char *name);
+static int tree_rules_excluded(const TreeRules *rules, const char *name);
+static int tree_rules_stat(const TreeRules *rules, int directory);
+static int tree_rules_size(const TreeRules *rules, const struct stat *statbuf);
+static int tree_iterator_push(FileTreeIterator *iterator, int fd, const struct stat *statbuf);
+static void tree_iterator_pop(FileTreeIterator *iterator);
+static int tree_iterator_descend(FileTreeIterator *iterator);
+static int tree_iterator_path(FileTreeIterator *iterator, const TreeFrame *frame, const char *name);
+static int tree_frame_reopen(FileTreeIterator *iterator, TreeFrame *frame, int fd);
+static void tree_frame_close(FileTreeIterator *iterator, TreeFrame *frame);
+static void tree_iterator_budget(FileTreeIterator *iterator);
+static int tree_reader_open(TreeReader *reader, int fd, char *buffer);
+static int tree_reader_next(TreeReader *reader, const char **name, unsigned char *type, uint64_t *inode);
+static int tree_reader_seek(TreeReader *reader, int64_t position);
+static void tree_reader_close(TreeReader *reader);
+static int tree_pool_walk(const char *dirpath, const FileTreeOptions *options, FileTreeBatchFunction batch, void *user, int thread_count, int threaded);
+static int tree_foreach_batch(const FileTreeEntry *directory, const FileTreeEntry *entries, size_t count, void *user);
+static void *tree_worker_run(void *arg);
+static void tree_read_directory(TreeWorker *worker, char *dirpath);
+static int tree_batch_add(TreeWorker *worker, int dirfd, const char *dirpath, size_t dirpath_length, const char *name, unsigned char *type, uint64_t inode);
+static int tree_batch_hand(TreeWorker *worker, const FileTreeEntry *directory, int action);
+static int tree_subdirectory_add(TreeWorker *worker, const char *dirpath, size_t dirpath_length, const char *name);
+static void tree_queue_directory(TreeWorker *worker, char *dirpath);
+static char *tree_steal(TreeWorker *worker);
+static int64_t tree_stat_mtime(const struct stat *statbuf);
+static int deque_push(TreeDeque *deque, char *dirpath);
+static char *deque_pop(TreeDeque *deque);
+static char *deque_steal(TreeDeque *deque);
+
 /**
-* String Match
-* @param pattern Pattern to match
-* @param candidate String where the [pattern] will be verified
-* @returns '1' if [candidate] string matches a certain [pattern] or '0' if not
+* Tree File Search
+* Searches through the file system starting at [dirpath] searching for files
+* which match a certain [context]. If they do, the function [doit] is called passing in
+* the file name.
+* The tree is walked by an iterator (see file_tree_open): symbolic links to directories are followed,
+* a link making a loop is skipped and the walk stops FILE_TREE_MAX_DEPTH levels below [dirpath]
+* @param dirpath Path where the depth search will begin 
+* @param doit Function to be called everytime a filename matches [context]
+* @param context Pattern to search for while searching through the files system
 */
-static int string_match(const char *pattern, const char *candidate)
+void file_tree_foreach(const char *dirpath, void (*doit)(const char *, void *), void *context)
 {
-    if (*pattern == '\0')
+    // The iterator returns every directory, their names are matched here
+    FileTreePattern *pattern = file_tree_pattern_compile(context, 0);
+    FileTreeOptions options = { (const char *)context, FILE_TREE_FOLLOW, 0, 0, 0 };
+    FileTreeIterator *iterator = pattern != NULL ? file_tree_open(dirpath, &options) : NULL;
+    if (iterator == NULL)
+    {
+        fprintf(stderr, "open(%s): %s\n", dirpath, strerror(errno));
+        file_tree_pattern_destroy(pattern);
+        return;
+    }
+
+    FileTreeEntry entry;
+    while (file_tree_next(iterator, &entry))
     {
-        return *candidate == '\0';
+        const char *name = entry.path + entry.name_offset;
+        if (entry.type != DT_DIR || file_tree_pattern_match(pattern, name, strlen(name)))
+            doit(name, context);
     }
-    else if (*pattern == '*')
+    file_tree_close(iterator);
+    file_tree_pattern_destroy(pattern);
+}
+
+/**
+* Tell if a directory entry is a directory, stat'ing it only when its type is not enough to know
+* @param dirfd Directory holding the entry
+* @param type Type reported with the entry (DT_*)
+* @param follow Whether a symbolic link to a directory counts as a directory
+* @returns 1 if the entry is a directory or 0 if not
+*/
+static int tree_is_directory(int dirfd, const char *name, unsigned char type, int follow)
+{
+    if (type == DT_DIR)
+        return 1;
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow))
+        return 0;
+
+    struct stat statbuf;
+    if (fstatat(dirfd, name, &statbuf, follow ? 0 : AT_SYMLINK_NOFOLLOW) == -1)
+        return 0;
+    return S_ISDIR(statbuf.st_mode);
+}
+
+/* ----------------------------------- ITERATOR ----------------------------------- */
+
+/**
+* File Tree Open
+* Starts a depth first walk of the tree under [dirpath], pulled one entry at a time with file_tree_next.
+* The directories being read are kept on a heap stack instead of the call stack, and the ones farthest
+* from the current directory are closed when more than [fd_budget] of them would be open (they are
+* reopened and resumed where they were when the walk climbs back to them). A directory met again below
+* itself, through a symbolic link or a bind mount, is not walked into, and neither are the directories
+* [max_depth] levels below [dirpath]
+* @param dirpath Path where the walk will begin
+* @param options Pattern the names of the entries must match (directories are always returned, unless pruned
+* by the exclude patterns or FILE_TREE_SKIP_HIDDEN), FILE_TREE_* flags, depth limit, descriptor budget and
+* size bounds of the files
+* @returns pointer to the iterator or NULL if [dirpath] could not be opened or there was no memory (errno is set)
+*/
+FileTreeIterator *file_tree_open(const char *dirpath, const FileTreeOptions *options)
+{
+    FileTreeIterator *iterator = (FileTreeIterator *)calloc(1, sizeof(FileTreeIterator));
+    if (iterator == NULL)
+        return NULL;
+    iterator->fd_budget = options->fd_budget > 0 ? options->fd_budget : FILE_TREE_FD_BUDGET;
+    int compiled = tree_rules_init(&iterator->rules, options) == 0;
+    iterator->path = strdup(dirpath);
+    int result = -1;
+    if (compiled && iterator->path != NULL)
     {
-        for (const char *c = candidate; *c != '\0'; c++)
+        int fd = open(dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        struct stat statbuf;
+        if (fd != -1 && fstat(fd, &statbuf) == -1)
         {
-            if (string_match(pattern + 1, c))
-                return 1;
+            int error = errno;
+            close(fd);
+            errno = error;
         }
-        return string_match(pattern + 1, candidate);
+        else if (fd != -1)
+            result = tree_iterator_push(iterator, fd, &statbuf);
     }
-    else if (*pattern != '?' && *pattern != *candidate)
+    if (result < 0)
     {
-        return 0;
+        int error = errno;
+        file_tree_close(iterator);
+        errno = error;
+        return NULL;
+    }
+    iterator->path_capacity = strlen(dirpath) + 1;
+    iterator->frames[0].path_length = iterator->path_capacity - 1;
+    return iterator;
+}
+
+/**
+* File Tree Next
+* @param entry Receives the next entry of the walk. Its path is valid until the next call
+* @returns 1 if there was an entry or 0 at the end of the walk
+*/
+int file_tree_next(FileTreeIterator *iterator, FileTreeEntry *entry)
+{
+    if (iterator->descend)
+    {
+        iterator->descend = 0;
+        tree_iterator_descend(iterator);
+    }
+
+    const TreeRules *rules = &iterator->rules;
+    int follow = rules->flags & FILE_TREE_FOLLOW;
+    while (iterator->depth > 0)
+    {
+        TreeFrame *frame = &iterator->frames[iterator->depth - 1];
+        const char *name;
+        unsigned char type;
+        uint64_t inode;
+        if ((!frame->open && tree_frame_reopen(iterator, frame, -1) < 0) || !tree_reader_next(&frame->reader, &name, &type, &inode))
+        {
+            tree_iterator_pop(iterator);
+            continue;
+        }
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || tree_rules_hidden(rules, name))
+            continue;
+
+        // Excluded directories are neither returned nor opened
+        int directory = tree_is_directory(frame->reader.fd, name, type, follow);
+        if (directory ? tree_rules_excluded(rules, name) : !file_tree_pattern_match(rules->pattern, name, strlen(name)))
+            continue;
+        struct stat statbuf;
+        int stat_entry = tree_rules_stat(rules, directory);
+        if (stat_entry && fstatat(frame->reader.fd, name, &statbuf, directory && follow ? 0 : AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+        if (stat_entry && !directory && !tree_rules_size(rules, &statbuf))
+            continue;
+        if (tree_iterator_path(iterator, frame, name) < 0)
+            continue;
+
+        memset(entry, 0, sizeof(FileTreeEntry));
+        entry->path = iterator->path;
+        entry->name_offset = iterator->name_offset;
+        entry->type = directory ? DT_DIR : type;
+        entry->inode = inode;
+        if (stat_entry)
+        {
+            entry->type = directory ? DT_DIR : IFTODT(statbuf.st_mode);
+            entry->inode = statbuf.st_ino;
+            entry->size = statbuf.st_size;
+            entry->mtime = tree_stat_mtime(&statbuf);
+        }
+        iterator->entry_depth = iterator->depth;
+        // A mount point is returned, but the other filesystem is not walked
+        iterator->descend = directory && iterator->depth < rules->max_depth &&
+            (!(rules->flags & FILE_TREE_ONE_FILE_SYSTEM) || statbuf.st_dev == frame->dev);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+* File Tree Depth
+* @returns depth of the last entry returned by file_tree_next (the entries of the start of the walk are at 1)
+*/
+size_t file_tree_depth(const FileTreeIterator *iterator)
+{
+    return iterator->entry_depth;
+}
+
+/**
+* File Tree Skip Subtree
+* Right after file_tree_next returned a directory, the walk does not go into it.
+* After any other entry, the rest of the directory holding it is skipped
+*/
+void file_tree_skip_subtree(FileTreeIterator *iterator)
+{
+    if (iterator->descend)
+        iterator->descend = 0;
+    else if (iterator->depth > 0)
+        tree_iterator_pop(iterator);
+}
+
+/**
+* File Tree Close
+* @param iterator Iterator to close with every directory it holds open (may be NULL)
+*/
+void file_tree_close(FileTreeIterator *iterator)
+{
+    if (iterator == NULL)
+        return;
+    while (iterator->depth > 0)
+        tree_iterator_pop(iterator);
+    tree_rules_destroy(&iterator->rules);
+    free(iterator->frames);
+    free(iterator->path);
+    free(iterator);
+}
+
+/**
+* Walk into the directory file_tree_next returned last
+* @returns 0 or -1 if it could not be opened, makes a loop or there was no memory
+*/
+static int tree_iterator_descend(FileTreeIterator *iterator)
+{
+    TreeFrame *parent = &iterator->frames[iterator->depth - 1];
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (iterator->rules.flags & FILE_TREE_FOLLOW ? 0 : O_NOFOLLOW);
+    struct stat statbuf;
+    int fd = openat(parent->reader.fd, iterator->path + iterator->name_offset, flags);
+    if (fd == -1 || fstat(fd, &statbuf) == -1)
+    {
+        if (!(iterator->rules.flags & FILE_TREE_QUIET))
+            fprintf(stderr, "open(%s): %s\n", iterator->path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    for (size_t i = 0; i < iterator->depth; i++)
+    {
+        if (iterator->frames[i].dev == statbuf.st_dev && iterator->frames[i].ino == statbuf.st_ino)
+        {
+            if (!(iterator->rules.flags & FILE_TREE_QUIET))
+                fprintf(stderr, "Skipping %s: it loops back to %.*s\n", iterator->path, (int)iterator->frames[i].path_length, iterator->path);
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (tree_iterator_push(iterator, fd, &statbuf) < 0)
+    {
+        if (!(iterator->rules.flags & FILE_TREE_QUIET))
+            fprintf(stderr, "read(%s): %s\n", iterator->path, strerror(ENOMEM));
+        return -1;
+    }
+    iterator->frames[iterator->depth - 1].path_length = strlen(iterator->path);
+    return 0;
+}
+
+/**
+* Push a directory on the stack of an iterator, closing the farthest ones to stay within the budget
+* @param fd Descriptor of the directory (owned by the iterator from now on, even on failure)
+* @returns 0 or -1 if there was no memory
+*/
+static int tree_iterator_push(FileTreeIterator *iterator, int fd, const struct stat *statbuf)
+{
+    if (iterator->depth == iterator->frame_capacity)
+    {
+        size_t capacity = iterator->frame_capacity == 0 ? 16 : iterator->frame_capacity * 2;
+        TreeFrame *frames = realloc(iterator->frames, capacity * sizeof(TreeFrame));
+        if (frames == NULL)
+        {
+            close(fd);
+            return -1;
+        }
+        iterator->frames = frames;
+        iterator->frame_capacity = capacity;
+    }
+    TreeFrame *frame = &iterator->frames[iterator->depth];
+    memset(frame, 0, sizeof(TreeFrame));
+    frame->buffer = malloc(FILE_TREE_DENTS_SIZE);
+    if (frame->buffer == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    tree_iterator_budget(iterator);
+    if (tree_reader_open(&frame->reader, fd, frame->buffer) == -1)
+    {
+        free(frame->buffer);
+        return -1;
+    }
+    frame->open = 1;
+    frame->dev = statbuf->st_dev;
+    frame->ino = statbuf->st_ino;
+    iterator->open_count++;
+    iterator->depth++;
+    return 0;
+}
+
+/**
+* Pop the directory on top of the stack of an iterator
+*/
+static void tree_iterator_pop(FileTreeIterator *iterator)
+{
+    TreeFrame *frame = &iterator->frames[iterator->depth - 1];
+    // A closed parent is reached through ".." rather than its path, which may be too long to open
+    int parent_fd = -1;
+    if (iterator->depth > 1 && !iterator->frames[iterator->depth - 2].open && frame->open)
+        parent_fd = openat(frame->reader.fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (frame->open)
+        tree_frame_close(iterator, frame);
+    iterator->depth--;
+    if (parent_fd != -1)
+        tree_frame_reopen(iterator, &iterator->frames[iterator->depth - 1], parent_fd);
+}
+
+/**
+* Close the open directories farthest from the top of the stack until one more fits in the budget
+*/
+static void tree_iterator_budget(FileTreeIterator *iterator)
+{
+    for (size_t i = 0; i < iterator->depth && iterator->open_count >= iterator->fd_budget; i++)
+        if (iterator->frames[i].open)
+            tree_frame_close(iterator, &iterator->frames[i]);
+}
+
+/**
+* Close the directory of a frame, remembering where its reading was
+*/
+static void tree_frame_close(FileTreeIterator *iterator, TreeFrame *frame)
+{
+    frame->position = frame->reader.position;
+    tree_reader_close(&frame->reader);
+    free(frame->buffer);
+    frame->buffer = NULL;
+    frame->open = 0;
+    iterator->open_count--;
+}
+
+/**
+* Open a closed directory again and resume its reading
+* @param fd Descriptor that may be the directory (its ".." entry was followed) or -1 to open its path
+* @returns 0 or -1 if it could not be opened or is not the same directory anymore
+*/
+static int tree_frame_reopen(FileTreeIterator *iterator, TreeFrame *frame, int fd)
+{
+    struct stat statbuf;
+    if (fd != -1)
+    {
+        // Through a followed link, ".." is not the directory the walk came from
+        if (fstat(fd, &statbuf) == -1 || statbuf.st_dev != frame->dev || statbuf.st_ino != frame->ino)
+        {
+            close(fd);
+            return -1;
+        }
     }
     else
     {
-        return string_match(pattern + 1, candidate + 1);
+        // The path of the iterator goes through the directory, it is cut there for a moment
+        char cut = iterator->path[frame->path_length];
+        iterator->path[frame->path_length] = '\0';
+        fd = open(iterator->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        int same = fd != -1 && fstat(fd, &statbuf) == 0 && statbuf.st_dev == frame->dev && statbuf.st_ino == frame->ino;
+        if (!same && !(iterator->rules.flags & FILE_TREE_QUIET))
+            fprintf(stderr, "open(%s): %s\n", iterator->path, fd == -1 ? strerror(errno) : "replaced during the walk");
+        iterator->path[frame->path_length] = cut;
+        if (!same)
+        {
+            if (fd != -1)
+                close(fd);
+            return -1;
+        }
+    }
+
+    frame->buffer = malloc(FILE_TREE_DENTS_SIZE);
+    if (frame->buffer == NULL)
+    {
+        close(fd);
+        return -1;
     }
+    tree_iterator_budget(iterator);
+    if (tree_reader_open(&frame->reader, fd, frame->buffer) == -1)
+    {
+        free(frame->buffer);
+        frame->buffer = NULL;
+        return -1;
+    }
+    frame->open = 1;
+    iterator->open_count++;
+    return tree_reader_seek(&frame->reader, frame->position);
 }
 
 /**
-* Tree File Search
-* Recursively searches through the file system starting at [dirpath] searching for files
-* which match a certain [context]. If they do, the function [doit] is called passing in
-* the file name
-* @param dirpath Path where the depth search will begin 
-* @param doit Function to be called everytime a filename matches [context]
-* @param context Pattern to search for while searching through the files system
+* Build the path of an entry of [frame] in the path of the iterator
+* @returns 0 or -1 if the path could not grow
 */
-void file_tree_foreach(const char *dirpath, void (*doit)(const char *, void *), void *context)
+static int tree_iterator_path(FileTreeIterator *iterator, const TreeFrame *frame, const char *name)
 {
-    DIR *dir;
-    dir = opendir(dirpath);
-    if (dir == NULL)
+    // "/" is not followed by a second separator
+    size_t separator = frame->path_length > 0 && iterator->path[frame->path_length - 1] != '/';
+    size_t name_length = strlen(name);
+    size_t length = frame->path_length + separator + name_length + 1;
+    if (length > iterator->path_capacity)
     {
-        fprintf(stderr, "opendir(%s): %s\n", dirpath, strerror(errno));
-        return;
+        char *path = realloc(iterator->path, length * 2);
+        if (path == NULL)
+            return -1;
+        iterator->path = path;
+        iterator->path_capacity = length * 2;
+    }
+    iterator->path[frame->path_length] = '/';
+    iterator->name_offset = frame->path_length + separator;
+    memcpy(iterator->path + iterator->name_offset, name, name_length + 1);
+    return 0;
+}
+
+/* ----------------------------------- PARALLEL WALK ----------------------------------- */
+
+/**
+* Parallel Tree File Search
+* Same search as file_tree_foreach, spread over a pool of threads. Every worker reads directories from
+* its own deque and steals from the others when it runs dry, so a walk bound by the latency of the
+* metadata calls (network filesystems, cold caches) keeps [thread_count] of them in flight.
+* Symbolic links are not followed, so a link cycle cannot make the walk endless
+* @param dirpath Path where the search will begin
+* @param doit Function called with the path of every file whose name matches [context]. It is called
+* concurrently from the workers, in no particular order, and must be thread safe
+* @param context Pattern to search for
+* @param thread_count Number of workers, 0 for one per online processor
+* @returns 0 when the whole tree was walked or -1 if [dirpath] could not be read or the pool could not be started
+*/
+int file_tree_foreach_parallel(const char *dirpath, void (*doit)(const char *, void *), void *context, int thread_count)
+{
+    FileTreeOptions options = { (const char *)context, 0, 0, 0, 0 };
+    TreeForeachCall call = { doit, context };
+    return tree_pool_walk(dirpath, &options, tree_foreach_batch, &call, thread_count, 1) < 0 ? -1 : 0;
+}
+
+/**
+* Hand every path of a batch to the callback of file_tree_foreach_parallel
+*/
+static int tree_foreach_batch(const FileTreeEntry *directory, const FileTreeEntry *entries, size_t count, void *user)
+{
+    TreeForeachCall *call = (TreeForeachCall *)user;
+    for (size_t i = 0; i < count; i++)
+        call->doit(entries[i].path, call->context);
+    return FILE_TREE_CONTINUE;
+}
+
+/* ----------------------------------- BATCHED WALK ----------------------------------- */
+
+/**
+* Tree Walk
+* Walks the tree under [dirpath] on the calling thread, handing the entries whose name matches the pattern
+* of [options] to [batch] a batch at a time, with the metadata getdents64 gives for free (type, inode) and,
+* with FILE_TREE_STAT, the one fstatat gives (size, modification time). The subdirectories of a directory
+* are walked after its last batch was handed out, so the callback can still prune them.
+* Symbolic links are not followed, so a link cycle cannot make the walk endless
+* @param dirpath Path where the walk will begin
+* @param options Pattern, FILE_TREE_* flags, size of the batches and rules pruning the walk (exclude patterns,
+* depth limit, size bounds of the files)
+* @param batch Function called with the batches (see FileTreeBatchFunction)
+* @param user Passed to every call of [batch]
+* @returns 0 when the whole tree was walked, FILE_TREE_STOP if [batch] ended the walk or -1 if [dirpath]
+* could not be read or there was no memory
+*/
+int file_tree_walk(const char *dirpath, const FileTreeOptions *options, FileTreeBatchFunction batch, void *user)
+{
+    return tree_pool_walk(dirpath, options, batch, user, 1, 0);
+}
+
+/**
+* Parallel Tree Walk
+* Same walk as file_tree_walk, spread over a pool of [thread_count] threads (0 for one per online processor)
+* that read directories from their own deques and steal from the others when they run dry.
+* [batch] is called concurrently from the workers, in no particular order, and must be thread safe.
+* Each batch still holds the entries of a single directory
+* @returns 0 when the whole tree was walked, FILE_TREE_STOP if [batch] ended the walk or -1 if [dirpath]
+* could not be read or the pool could not be started
+*/
+int file_tree_walk_parallel(const char *dirpath, const FileTreeOptions *options, FileTreeBatchFunction batch, void *user, int thread_count)
+{
+    return tree_pool_walk(dirpath, options, batch, user, thread_count, 1);
+}
+
+/**
+* Walk [dirpath] with a pool of workers
+* @param threaded '1' to run the workers on their own threads or '0' to run a single one on the calling thread
+*/
+static int tree_pool_walk(const char *dirpath, const FileTreeOptions *options, FileTreeBatchFunction batch, void *user, int thread_count, int threaded)
+{
+    if (thread_count <= 0)
+    {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = processors > 0 ? (int)processors : 1;
+    }
+
+    TreePool pool;
+    memset(&pool, 0, sizeof(TreePool));
+    pool.thread_count = thread_count;
+    pool.batch = batch;
+    pool.user = user;
+    pool.batch_size = options->batch_size;
+    int compiled = tree_rules_init(&pool.rules, options) == 0;
+    pool.deques = (TreeDeque *)calloc(thread_count, sizeof(TreeDeque));
+    TreeWorker *workers = (TreeWorker *)calloc(thread_count, sizeof(TreeWorker));
+    pthread_t *threads = (pthread_t *)calloc(thread_count, sizeof(pthread_t));
+    char *root = strdup(dirpath);
+    if (!compiled || pool.deques == NULL || workers == NULL || threads == NULL || root == NULL)
+    {
+        tree_rules_destroy(&pool.rules);
+        free(pool.deques);
+        free(workers);
+        free(threads);
+        free(root);
+        return -1;
+    }
+    pool.root = root;
+    pool.root_length = strlen(root);
+    pool.root_separator = pool.root_length > 0 && root[pool.root_length - 1] == '/';
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle, NULL);
+    int result = 0;
+    for (int i = 0; i < thread_count; i++)
+    {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        workers[i].pool = &pool;
+        workers[i].index = i;
+        workers[i].seed = i + 1;
+        workers[i].buffer = malloc(FILE_TREE_DENTS_SIZE);
+        if (workers[i].buffer == NULL)
+            result = -1;
+    }
+
+    // The first worker starts with the root, the others steal their way into the tree
+    atomic_store(&pool.pending, 1);
+    if (result < 0 || deque_push(&pool.deques[0], root) < 0)
+    {
+        free(root);
+        result = -1;
     }
     else
     {
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL)
+        atomic_store(&pool.queued, 1);
+    }
+
+    int started = 0;
+    for (; threaded && result == 0 && started < thread_count; started++)
+    {
+        if (pthread_create(&threads[started], NULL, tree_worker_run, &workers[started]) != 0)
+            break;
+    }
+    // The walk still completes with fewer workers, as long as there is one
+    if (started == 0 && result == 0)
+    {
+        tree_worker_run(&workers[0]);
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < thread_count; i++)
+    {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].dirpaths);
+        free(workers[i].buffer);
+        free(workers[i].entries);
+        free(workers[i].path_offsets);
+        free(workers[i].paths);
+        free(workers[i].subdirpaths);
+    }
+    pthread_mutex_destroy(&pool.idle_lock);
+    pthread_cond_destroy(&pool.idle);
+    tree_rules_destroy(&pool.rules);
+    free(pool.deques);
+    free(workers);
+    free(threads);
+    if (result == 0 && atomic_load(&pool.root_failed))
+        result = -1;
+    else if (result == 0 && atomic_load(&pool.stopped))
+        result = FILE_TREE_STOP;
+    return result;
+}
+
+/**
+* Worker loop: read directories from the own deque, then from the others, until none is pending
+*/
+static void *tree_worker_run(void *arg)
+{
+    TreeWorker *worker = (TreeWorker *)arg;
+    TreePool *pool = worker->pool;
+    while (1)
+    {
+        char *dirpath = deque_pop(&pool->deques[worker->index]);
+        if (dirpath == NULL)
+            dirpath = tree_steal(worker);
+        if (dirpath != NULL)
         {
-            struct stat statbuf;
-            char filepath[strlen(dirpath) + 1 + strlen(entry->d_name) + 1];
-            strcpy(filepath, dirpath);
-            strcat(filepath, "/");
-            strcat(filepath, entry->d_name);
-
-            char *filename = strrchr(filepath, '/') + 1;
-            if (string_match(context, filename))
+            atomic_fetch_sub(&pool->queued, 1);
+            // A stopped walk drains the deques without reading anything
+            if (!atomic_load(&pool->stopped))
+                tree_read_directory(worker, dirpath);
+            free(dirpath);
+            // The last directory read ends the walk
+            if (atomic_fetch_sub(&pool->pending, 1) == 1)
             {
-                doit(filename, context);
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->idle);
+                pthread_mutex_unlock(&pool->idle_lock);
             }
+            continue;
+        }
 
-            int result = stat(filepath, &statbuf);
-            if (result == -1)
-            {
-                fprintf(stderr, "stat(%s,...): %s\n", filepath, strerror(errno));
+        // Announced as a sleeper before checking, a worker queueing a directory right now will wake it
+        pthread_mutex_lock(&pool->idle_lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&pool->pending) > 0 && atomic_load(&pool->queued) == 0)
+            pthread_cond_wait(&pool->idle, &pool->idle_lock);
+        atomic_fetch_sub(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->idle_lock);
+        if (atomic_load(&pool->pending) == 0)
+            return NULL;
+    }
+}
+
+/**
+* Read one directory: hand its matching entries to the callback in batches, then queue its subdirectories
+* on the own deque unless the callback pruned them
+* @param dirpath Path of the directory (owned by the caller)
+*/
+static void tree_read_directory(TreeWorker *worker, char *dirpath)
+{
+    TreePool *pool = worker->pool;
+    int dirfd = open(dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat statbuf;
+    TreeReader reader;
+    if (dirfd != -1 && fstat(dirfd, &statbuf) == -1)
+    {
+        close(dirfd);
+        dirfd = -1;
+    }
+    if (dirfd == -1 || tree_reader_open(&reader, dirfd, worker->buffer) == -1)
+    {
+        if (dirpath == pool->root)
+            atomic_store(&pool->root_failed, 1);
+        if (!(pool->rules.flags & FILE_TREE_QUIET))
+            fprintf(stderr, "open(%s): %s\n", dirpath, strerror(errno));
+        return;
+    }
+
+    // Each level below the root adds one separator to the path
+    const TreeRules *rules = &pool->rules;
+    const char *c = dirpath + pool->root_length;
+    size_t depth = *c != '\0' && pool->root_separator;
+    for (; *c != '\0'; c++)
+        depth += *c == '/';
+    int walk_subdirectories = depth + 1 < rules->max_depth;
+
+    const char *slash = strrchr(dirpath, '/');
+    FileTreeEntry directory = { dirpath, slash != NULL ? slash - dirpath + 1 : 0, DT_DIR, statbuf.st_ino, statbuf.st_size, tree_stat_mtime(&statbuf) };
+    worker->entry_count = 0;
+    worker->paths_used = 0;
+    worker->subdir_count = 0;
+
+    // Paths are only built for the entries that need one: matches and subdirectories
+    size_t dirpath_length = strlen(dirpath);
+    int action = FILE_TREE_CONTINUE;
+    int handed = 0;
+    const char *name;
+    unsigned char type;
+    uint64_t inode;
+    while (action != FILE_TREE_STOP && tree_reader_next(&reader, &name, &type, &inode))
+    {
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || tree_rules_hidden(rules, name))
+            continue;
+
+        if (file_tree_pattern_match(rules->pattern, name, strlen(name)))
+        {
+            // An entry that vanished since it was listed is not reported
+            if (tree_batch_add(worker, dirfd, dirpath, dirpath_length, name, &type, inode) < 0)
                 continue;
-            }
-            if (S_ISDIR(statbuf.st_mode) &&
-                strcmp(entry->d_name, ".") != 0 &&
-                strcmp(entry->d_name, "..") != 0)
+            if (worker->entry_count == pool->batch_size)
             {
-                file_tree_foreach(filepath, doit, context);
+                action = tree_batch_hand(worker, &directory, action);
+                handed = 1;
             }
         }
-        closedir(dir);
+
+        // Pruned subdirectories are never opened
+        if (action == FILE_TREE_CONTINUE && walk_subdirectories && tree_is_directory(dirfd, name, type, 0) &&
+            !tree_rules_excluded(rules, name))
+        {
+            struct stat substat;
+            if (!(rules->flags & FILE_TREE_ONE_FILE_SYSTEM) ||
+                (fstatat(dirfd, name, &substat, AT_SYMLINK_NOFOLLOW) == 0 && substat.st_dev == statbuf.st_dev))
+                tree_subdirectory_add(worker, dirpath, dirpath_length, name);
+        }
+    }
+    tree_reader_close(&reader);
+
+    if (action != FILE_TREE_STOP && (worker->entry_count > 0 || (!handed && (rules->flags & FILE_TREE_DIRECTORIES))))
+        action = tree_batch_hand(worker, &directory, action);
+    if (action == FILE_TREE_STOP)
+        atomic_store(&pool->stopped, 1);
+
+    for (size_t i = 0; i < worker->subdir_count; i++)
+    {
+        if (action == FILE_TREE_CONTINUE)
+            tree_queue_directory(worker, worker->subdirpaths[i]);
+        else
+            free(worker->subdirpaths[i]);
+    }
+    worker->subdir_count = 0;
+}
+
+/**
+* Add an entry to the batch of a worker, stat'ing it first with FILE_TREE_STAT or size bounds
+* @param type Type of the entry, replaced by the one the stat tells
+* @returns 0 or -1 if the entry could not be stat'ed, is out of the size bounds or there was no memory
+*/
+static int tree_batch_add(TreeWorker *worker, int dirfd, const char *dirpath, size_t dirpath_length, const char *name, unsigned char *type, uint64_t inode)
+{
+    const TreeRules *rules = &worker->pool->rules;
+    struct stat statbuf;
+    int stat_entry = tree_rules_stat(rules, 0);
+    if (stat_entry && (fstatat(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1 || !tree_rules_size(rules, &statbuf)))
+        return -1;
+
+    if (worker->entry_count == worker->entry_capacity)
+    {
+        size_t capacity = worker->entry_capacity == 0 ? 64 : worker->entry_capacity * 2;
+        FileTreeEntry *entries = realloc(worker->entries, capacity * sizeof(FileTreeEntry));
+        if (entries != NULL)
+            worker->entries = entries;
+        size_t *path_offsets = realloc(worker->path_offsets, capacity * sizeof(size_t));
+        if (path_offsets != NULL)
+            worker->path_offsets = path_offsets;
+        if (entries == NULL || path_offsets == NULL)
+            return -1;
+        worker->entry_capacity = capacity;
+    }
+    // "/" is not followed by a second separator
+    size_t separator = dirpath_length > 0 && dirpath[dirpath_length - 1] != '/';
+    size_t name_length = strlen(name);
+    size_t length = dirpath_length + separator + name_length + 1;
+    if (worker->paths_used + length > worker->paths_capacity)
+    {
+        size_t capacity = (worker->paths_used + length) * 2;
+        char *paths = realloc(worker->paths, capacity);
+        if (paths == NULL)
+            return -1;
+        worker->paths = paths;
+        worker->paths_capacity = capacity;
+    }
+
+    char *path = worker->paths + worker->paths_used;
+    memcpy(path, dirpath, dirpath_length);
+    path[dirpath_length] = '/';
+    memcpy(path + dirpath_length + separator, name, name_length + 1);
+
+    FileTreeEntry *entry = &worker->entries[worker->entry_count];
+    memset(entry, 0, sizeof(FileTreeEntry));
+    entry->name_offset = dirpath_length + separator;
+    entry->type = *type;
+    entry->inode = inode;
+    if (stat_entry)
+    {
+        *type = entry->type = IFTODT(statbuf.st_mode);
+        entry->size = statbuf.st_size;
+        entry->mtime = tree_stat_mtime(&statbuf);
+    }
+    worker->path_offsets[worker->entry_count++] = worker->paths_used;
+    worker->paths_used += length;
+    return 0;
+}
+
+/**
+* Hand the batch of a worker to the callback and empty it
+* @param action What the previous batches of the directory asked for
+* @returns what the walk does next with the directory (a prune is kept by the next batches)
+*/
+static int tree_batch_hand(TreeWorker *worker, const FileTreeEntry *directory, int action)
+{
+    TreePool *pool = worker->pool;
+    // The paths buffer does not move while the batch is handed out
+    for (size_t i = 0; i < worker->entry_count; i++)
+        worker->entries[i].path = worker->paths + worker->path_offsets[i];
+    int result = pool->batch(directory, worker->entries, worker->entry_count, pool->user);
+    worker->entry_count = 0;
+    worker->paths_used = 0;
+    if (result == FILE_TREE_STOP || (result == FILE_TREE_PRUNE && action == FILE_TREE_CONTINUE))
+        return result;
+    return action;
+}
+
+/**
+* Remember "[dirpath]/[name]" to be queued once the directory is read
+* @returns 0 or -1 if there was no memory
+*/
+static int tree_subdirectory_add(TreeWorker *worker, const char *dirpath, size_t dirpath_length, const char *name)
+{
+    if (worker->subdir_count == worker->subdir_capacity)
+    {
+        size_t capacity = worker->subdir_capacity == 0 ? 16 : worker->subdir_capacity * 2;
+        char **subdirpaths = realloc(worker->subdirpaths, capacity * sizeof(char *));
+        if (subdirpaths == NULL)
+            return -1;
+        worker->subdirpaths = subdirpaths;
+        worker->subdir_capacity = capacity;
+    }
+    size_t separator = dirpath_length > 0 && dirpath[dirpath_length - 1] != '/';
+    size_t name_length = strlen(name);
+    char *path = malloc(dirpath_length + separator + name_length + 1);
+    if (path == NULL)
+        return -1;
+    memcpy(path, dirpath, dirpath_length);
+    path[dirpath_length] = '/';
+    memcpy(path + dirpath_length + separator, name, name_length + 1);
+    worker->subdirpaths[worker->subdir_count++] = path;
+    return 0;
+}
+
+/**
+* Queue a directory on the deque of the worker and wake a sleeping worker to steal it
+* @param dirpath Path of the directory (ownership goes to the pool)
+*/
+static void tree_queue_directory(TreeWorker *worker, char *dirpath)
+{
+    TreePool *pool = worker->pool;
+    atomic_fetch_add(&pool->pending, 1);
+    if (deque_push(&pool->deques[worker->index], dirpath) < 0)
+    {
+        fprintf(stderr, "Out of memory, skipping %s\n", dirpath);
+        free(dirpath);
+        atomic_fetch_sub(&pool->pending, 1);
+        return;
+    }
+    atomic_fetch_add(&pool->queued, 1);
+    if (atomic_load(&pool->sleepers) > 0)
+    {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+/**
+* Steal a directory from the head of the deque of another worker, starting at a random victim
+* @returns path of the directory or NULL if no deque had one
+*/
+static char *tree_steal(TreeWorker *worker)
+{
+    TreePool *pool = worker->pool;
+    if (pool->thread_count == 1)
+        return NULL;
+    for (int attempt = 0; attempt < TREE_STEAL_ATTEMPTS && atomic_load(&pool->queued) > 0; attempt++)
+    {
+        int first = rand_r(&worker->seed) % pool->thread_count;
+        for (int i = 0; i < pool->thread_count; i++)
+        {
+            int victim = (first + i) % pool->thread_count;
+            if (victim == worker->index)
+                continue;
+            char *dirpath = deque_steal(&pool->deques[victim]);
+            if (dirpath != NULL)
+                return dirpath;
+        }
+    }
+    return NULL;
+}
+
+/**
+* Modification time of a stat in nanoseconds since the epoch
+*/
+static int64_t tree_stat_mtime(const struct stat *statbuf)
+{
+    return (int64_t)statbuf->st_mtim.tv_sec * 1000000000 + statbuf->st_mtim.tv_nsec;
+}
+
+/* ----------------------------------- RULES ----------------------------------- */
+
+/**
+* Compile the rules of a walk
+* @returns 0 or -1 if there was no memory
+*/
+static int tree_rules_init(TreeRules *rules, const FileTreeOptions *options)
+{
+    memset(rules, 0, sizeof(TreeRules));
+    rules->flags = options->flags;
+    rules->max_depth = options->max_depth > 0 ? options->max_depth : FILE_TREE_MAX_DEPTH;
+    rules->min_size = options->min_size;
+    rules->max_size = options->max_size;
+    // Without a pattern every entry is reported
+    int caseless = options->flags & FILE_TREE_MATCH_CASELESS;
+    rules->pattern = file_tree_pattern_compile(options->pattern != NULL ? options->pattern : "*", caseless);
+    if (options->exclude != NULL && *options->exclude != '\0')
+        rules->exclude = file_tree_pattern_compile(options->exclude, caseless);
+    if (rules->pattern == NULL || (options->exclude != NULL && *options->exclude != '\0' && rules->exclude == NULL))
+    {
+        tree_rules_destroy(rules);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+* Free the compiled rules of a walk
+*/
+static void tree_rules_destroy(TreeRules *rules)
+{
+    file_tree_pattern_destroy(rules->pattern);
+    file_tree_pattern_destroy(rules->exclude);
+    rules->pattern = NULL;
+    rules->exclude = NULL;
+}
+
+/**
+* @returns 1 if an entry is left out for its name starting with '.' or 0 if not
+*/
+static int tree_rules_hidden(const TreeRules *rules, const char *name)
+{
+    return (rules->flags & FILE_TREE_SKIP_HIDDEN) && name[0] == '.';
+}
+
+/**
+* @returns 1 if a directory is pruned for its name or 0 if not
+*/
+static int tree_rules_excluded(const TreeRules *rules, const char *name)
+{
+    return rules->exclude != NULL && file_tree_pattern_match(rules->exclude, name, strlen(name));
+}
+
+/**
+* @returns 1 if an entry has to be stat'ed, for the caller or for the rules to be checked, or 0 if not
+*/
+static int tree_rules_stat(const TreeRules *rules, int directory)
+{
+    if (rules->flags & FILE_TREE_STAT)
+        return 1;
+    if (directory)
+        return (rules->flags & FILE_TREE_ONE_FILE_SYSTEM) != 0;
+    return rules->min_size > 0 || rules->max_size > 0;
+}
+
+/**
+* @returns 1 if a stat'ed entry is within the size bounds (only regular files have any) or 0 if not
+*/
+static int tree_rules_size(const TreeRules *rules, const struct stat *statbuf)
+{
+    if (!S_ISREG(statbuf->st_mode))
+        return 1;
+    return (rules->min_size == 0 || (uint64_t)statbuf->st_size >= rules->min_size) &&
+        (rules->max_size == 0 || (uint64_t)statbuf->st_size <= rules->max_size);
+}
+
+/* ----------------------------------- DIRECTORY READER ----------------------------------- */
+
+/**
+* Start reading the entries of a directory
+* @param fd Descriptor of the directory (owned by the reader from now on, even on failure)
+* @param buffer FILE_TREE_DENTS_SIZE bytes the entries are read into (owned by the caller)
+* @returns 0 or -1 on failure (errno is set)
+*/
+static int tree_reader_open(TreeReader *reader, int fd, char *buffer)
+{
+    reader->fd = fd;
+    reader->position = 0;
+#ifdef __linux__
+    reader->used = 0;
+    reader->offset = 0;
+    reader->buffer = buffer;
+#else
+    reader->dir = fdopendir(fd);
+    if (reader->dir == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/**
+* Next entry of a directory
+* @param name Receives the name of the entry (valid until the next call)
+* @param type Receives the type of the entry (DT_*, DT_UNKNOWN when the filesystem does not say)
+* @param inode Receives the inode number of the entry
+* @returns 1 if there was an entry or 0 at the end of the directory
+*/
+static int tree_reader_next(TreeReader *reader, const char **name, unsigned char *type, uint64_t *inode)
+{
+#ifdef __linux__
+    if (reader->offset >= reader->used)
+    {
+        long read_size = syscall(SYS_getdents64, reader->fd, reader->buffer, FILE_TREE_DENTS_SIZE);
+        if (read_size <= 0)
+            return 0;
+        reader->used = read_size;
+        reader->offset = 0;
+    }
+    TreeDirent64 *entry = (TreeDirent64 *)(reader->buffer + reader->offset);
+    reader->offset += entry->d_reclen;
+    reader->position = entry->d_off;
+    *name = entry->d_name;
+    *type = entry->d_type;
+    *inode = entry->d_ino;
+    return 1;
+#else
+    struct dirent *entry = readdir(reader->dir);
+    if (entry == NULL)
+        return 0;
+    reader->position++;
+    *name = entry->d_name;
+    *type = entry->d_type;
+    *inode = entry->d_ino;
+    return 1;
+#endif
+}
+
+/**
+* Resume a reader opened again where a previous reader of the same directory was
+* @param position Position of the previous reader once it was closed
+* @returns 0 or -1 on failure
+*/
+static int tree_reader_seek(TreeReader *reader, int64_t position)
+{
+#ifdef __linux__
+    // Offsets of getdents64 are cookies the filesystem accepts back
+    if (lseek(reader->fd, position, SEEK_SET) == -1)
+        return -1;
+    reader->position = position;
+    reader->used = 0;
+    reader->offset = 0;
+    return 0;
+#else
+    // Only the count of entries read is portable
+    const char *name;
+    unsigned char type;
+    uint64_t inode;
+    while (reader->position < position)
+        if (!tree_reader_next(reader, &name, &type, &inode))
+            return -1;
+    return 0;
+#endif
+}
+
+/**
+* Close a directory reader and its descriptor
+*/
+static void tree_reader_close(TreeReader *reader)
+{
+#ifdef __linux__
+    close(reader->fd);
+#else
+    closedir(reader->dir);
+#endif
+}
+
+/* ----------------------------------- DEQUE FUNCTIONS ----------------------------------- */
+
+/**
+* Push a directory at the tail of a deque (grows the deque when it is full)
+* @returns 0 or -1 if the deque could not grow
+*/
+static int deque_push(TreeDeque *deque, char *dirpath)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity)
+    {
+        size_t capacity = deque->capacity == 0 ? TREE_DEQUE_INITIAL_CAPACITY : deque->capacity * 2;
+        char **dirpaths = (char **)malloc(capacity * sizeof(char *));
+        if (dirpaths == NULL)
+        {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+        // Unwrap the ring into the new array
+        for (size_t i = 0; i < deque->count; i++)
+            dirpaths[i] = deque->dirpaths[(deque->head + i) % deque->capacity];
+        free(deque->dirpaths);
+        deque->dirpaths = dirpaths;
+        deque->capacity = capacity;
+        deque->head = 0;
+    }
+    deque->dirpaths[(deque->head + deque->count) % deque->capacity] = dirpath;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+/**
+* Pop the newest directory from the tail of a deque (owner side)
+*/
+static char *deque_pop(TreeDeque *deque)
+{
+    char *dirpath = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0)
+    {
+        deque->count--;
+        dirpath = deque->dirpaths[(deque->head + deque->count) % deque->capacity];
     }
-}
\ No newline at end of file
+    pthread_mutex_unlock(&deque->lock);
+    return dirpath;
+}
+
+/**
+* Take the oldest directory from the head of a deque (thief side)
+*/
+static char *deque_steal(TreeDeque *deque)
+{
+    char *dirpath = NULL;
+    // A busy deque is skipped rather than waited for
+    if (pthread_mutex_trylock(&deque->lock) != 0)
+        return NULL;
+    if (deque->count > 0)
+    {
+        dirpath = deque->dirpaths[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return dirpath;
+}
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "file_tree_foreach.h"
+
+/*
+* Wildcard patterns compiled once and matched without backtracking.
+* Every alternative is split at its stars: the text before the first star is anchored at the start of
+* the name, the text after the last star at its end, and the segments in between are found one after
+* the other at their leftmost position. Taking the leftmost position is always safe because each star
+* can absorb whatever the next segment skipped, so no position is ever tried twice.
+*/
+
+/* -- Private Functions -- */
+static int glob_match(const FileTreeGlob *glob, const char *name, size_t length, int caseless);
+static int segment_equal(const char *segment, const char *name, size_t length, int caseless);
+static int suffix_equal(const char *suffix, const char *name, size_t length, int caseless);
+
+/**
+* File Tree Pattern Compile
+* @param patterns Wildcard patterns separated by '|' ('*' matches any run of characters, '?' any single one).
+* Ex: "*.wav|*.wave"
+* @param flags FILE_TREE_MATCH_CASELESS to ignore the case of ASCII letters
+* @returns pointer to the compiled pattern or NULL if there was no memory
+*/
+FileTreePattern *file_tree_pattern_compile(const char *patterns, int flags)
+{
+    FileTreePattern *pattern = (FileTreePattern *)calloc(1, sizeof(FileTreePattern));
+    if (pattern == NULL)
+        return NULL;
+    pattern->flags = flags;
+    pattern->text = strdup(patterns);
+
+    int count = 1;
+    for (const char *c = patterns; *c != '\0'; c++)
+        if (*c == '|')
+            count++;
+    pattern->globs = (FileTreeGlob *)calloc(count, sizeof(FileTreeGlob));
+    if (pattern->text == NULL || pattern->globs == NULL)
+    {
+        file_tree_pattern_destroy(pattern);
+        return NULL;
+    }
+
+    char *text = pattern->text;
+    for (int i = 0; i < count; i++)
+    {
+        char *end = strchr(text, '|');
+        if (end != NULL)
+            *end = '\0';
+
+        FileTreeGlob *glob = &pattern->globs[i];
+        glob->text = text;
+        glob->length = strlen(text);
+        glob->prefix = glob->length;
+        glob->suffix = 0;
+        int wildcards = 0;
+        for (size_t c = 0; c < glob->length; c++)
+        {
+            if (flags & FILE_TREE_MATCH_CASELESS)
+                text[c] = tolower((unsigned char)text[c]);
+            if (text[c] == '*')
+            {
+                if (glob->prefix == glob->length)
+                    glob->prefix = c;
+                glob->suffix = c + 1;
+            }
+            else
+            {
+                glob->min_length++;
+                wildcards += text[c] == '?';
+            }
+        }
+
+        if (glob->prefix == glob->length)
+            glob->kind = wildcards == 0 ? FILE_TREE_GLOB_LITERAL : FILE_TREE_GLOB_GENERAL;
+        else if (glob->prefix == 0 && glob->suffix == 1 && wildcards == 0)
+            glob->kind = FILE_TREE_GLOB_SUFFIX;
+        else
+            glob->kind = FILE_TREE_GLOB_GENERAL;
+
+        pattern->count++;
+        text = end != NULL ? end + 1 : text + glob->length;
+    }
+    return pattern;
+}
+
+/**
+* File Tree Pattern Match
+* @param pattern Compiled pattern
+* @param name Name to check
+* @param length Length of [name]
+* @returns '1' if [name] matches one of the alternatives of [pattern] or '0' if not
+*/
+int file_tree_pattern_match(const FileTreePattern *pattern, const char *name, size_t length)
+{
+    int caseless = pattern->flags & FILE_TREE_MATCH_CASELESS;
+    for (int i = 0; i < pattern->count; i++)
+    {
+        const FileTreeGlob *glob = &pattern->globs[i];
+        switch (glob->kind)
+        {
+            case FILE_TREE_GLOB_SUFFIX:
+                // "*.wav": one comparison of the tail of the name
+                if (length >= glob->min_length && suffix_equal(glob->text + 1, name + length - glob->min_length, glob->min_length, caseless))
+                    return 1;
+                break;
+            case FILE_TREE_GLOB_LITERAL:
+                if (length == glob->length && suffix_equal(glob->text, name, length, caseless))
+                    return 1;
+                break;
+            default:
+                if (glob_match(glob, name, length, caseless))
+                    return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+* File Tree Pattern Destroy
+* @param pattern Compiled pattern to free (may be NULL)
+*/
+void file_tree_pattern_destroy(FileTreePattern *pattern)
+{
+    if (pattern == NULL)
+        return;
+    free(pattern->globs);
+    free(pattern->text);
+    free(pattern);
+}
+
+/* ----------------------------------- AUXILIARY FUNCTIONS ----------------------------------- */
+
+/**
+* Match one alternative holding '?' or '*'
+*/
+static int glob_match(const FileTreeGlob *glob, const char *name, size_t length, int caseless)
+{
+    if (length < glob->min_length)
+        return 0;
+    // Without a star the name has exactly the length of the pattern
+    if (glob->prefix == glob->length)
+        return length == glob->length && segment_equal(glob->text, name, length, caseless);
+
+    size_t suffix_length = glob->length - glob->suffix;
+    if (!segment_equal(glob->text, name, glob->prefix, caseless) ||
+        !segment_equal(glob->text + glob->suffix, name + length - suffix_length, suffix_length, caseless))
+        return 0;
+
+    // Segments between the first and the last star, each at its leftmost position after the previous one
+    size_t position = glob->prefix;
+    size_t end = length - suffix_length;
+    size_t c = glob->prefix;
+    while (c < glob->suffix)
+    {
+        while (c < glob->suffix && glob->text[c] == '*')
+            c++;
+        size_t segment = c;
+        while (c < glob->suffix && glob->text[c] != '*')
+            c++;
+        size_t segment_length = c - segment;
+        if (segment_length == 0)
+            continue;
+
+        while (position + segment_length <= end && !segment_equal(glob->text + segment, name + position, segment_length, caseless))
+            position++;
+        if (position + segment_length > end)
+            return 0;
+        position += segment_length;
+    }
+    return 1;
+}
+
+/**
+* Compare [length] characters of a segment without stars ('?' matches any character)
+*/
+static int segment_equal(const char *segment, const char *name, size_t length, int caseless)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = caseless ? tolower((unsigned char)name[i]) : name[i];
+        if (segment[i] != '?' && segment[i] != c)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+* Compare [length] characters of a segment without wildcards
+*/
+static int suffix_equal(const char *suffix, const char *name, size_t length, int caseless)
+{
+    if (!caseless)
+        return memcmp(suffix, name, length) == 0;
+    for (size_t i = 0; i < length; i++)
+        if (suffix[i] != tolower((unsigned char)name[i]))
+            return 0;
+    return 1;
+}
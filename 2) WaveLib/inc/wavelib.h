@@ -1,17 +1,192 @@
 #ifndef WAVELIB
 #define WAVELIB
 
+#include <stddef.h>
+#include <stdint.h>
+
+// Audio format codes (WAVE_FORMAT_EXTENSIBLE files report the code of their SubFormat instead)
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+// Max number of chunks kept in the chunk index of a wave file
+#define WAVE_MAX_CHUNKS 32
+
+// Chunk index entry (offset and size of the chunk payload, 64 bit for RF64 files)
+typedef struct wave_chunk {
+    char id[4];
+    uint64_t offset;
+    uint64_t size;
+} WaveChunk;
+
+// Header fields decoded once by wave_load
+typedef struct wave_header {
+    uint16_t audio_format;
+    uint16_t number_of_channels;
+    uint32_t sample_rate;
+    uint32_t byte_rate;
+    uint16_t block_align;
+    uint16_t bits_per_sample;
+    uint16_t valid_bits_per_sample;
+    uint32_t channel_mask;
+    uint64_t data_offset;
+    uint64_t data_size;
+    int chunk_count;
+    WaveChunk chunks[WAVE_MAX_CHUNKS];
+} WaveHeader;
+
+// Bytes at the start of a file enough to probe most wave files without another read (see wave_probe)
+#ifndef WAVE_PROBE_SIZE
+#define WAVE_PROBE_SIZE 4096
+#endif
+
+// Size of each of the two windows a stream reads the file through
+#ifndef WAVE_STREAM_WINDOW_SIZE
+#define WAVE_STREAM_WINDOW_SIZE (256 * 1024)
+#endif
+
+typedef struct wave_stream_window {
+    uint8_t *buffer;
+    uint64_t first_frame;
+    size_t frames;
+} WaveStreamWindow;
+
+// Bounded-memory reader (one persistent file descriptor and two windows filled with positioned reads)
+typedef struct wave_stream {
+    int fd;
+    WaveHeader header;
+    uint64_t frame_count;
+    uint64_t frame_index;
+    size_t window_frames;
+    WaveStreamWindow windows[2];
+    int current;
+} WaveStream;
+
 typedef struct wave {
     const char *filepath;
-    size_t data_size;
+    WaveHeader header;
+    uint64_t data_size;
     uint8_t *data;
+    // Read-only file mapping backing [data] (NULL when the samples were copied to the heap)
+    uint8_t *map;
+    size_t map_size;
+    // Stream serving the samples of waves loaded with wave_load_streamed ([data] is NULL)
+    WaveStream *stream;
 } Wave;
 
 Wave *wave_load(const char* filename);
+Wave *wave_load_mapped(const char *filename);
+Wave *wave_load_streamed(const char *filename);
 void wave_destroy(Wave *wave);
 int wave_get_bits_per_sample(Wave* wave);
 int wave_get_number_of_channels(Wave *wave);
 int wave_get_sample_rate(Wave *wave);
-size_t wave_get_samples(Wave *wave, size_t frame_index, uint8_t *buffer, size_t frame_count);
+uint64_t wave_get_frame_count(Wave *wave);
+const WaveChunk *wave_get_chunk(Wave *wave, const char *id);
+size_t wave_get_samples(Wave *wave, uint64_t frame_index, uint8_t *buffer, size_t frame_count);
+size_t wave_get_samples_view(Wave *wave, uint64_t frame_index, size_t frame_count, const uint8_t **view);
+void wave_prefetch(Wave *wave, uint64_t frame_index, size_t frame_count);
+int wave_probe(int fd, uint64_t file_size, const uint8_t *head, size_t head_size, WaveHeader *header);
+
+/* ---------- SAMPLE FORMAT CONVERSION ---------- */
+
+// Sample formats the conversion kernels understand
+typedef enum wave_sample_format {
+    WAVE_SAMPLE_UNKNOWN = 0,
+    WAVE_SAMPLE_U8,
+    WAVE_SAMPLE_S16_LE,
+    WAVE_SAMPLE_S24_3LE,
+    WAVE_SAMPLE_S32_LE,
+    WAVE_SAMPLE_FLOAT_LE
+} WaveSampleFormat;
+
+// Converts [sample_count] samples at [src] to S16_LE at [dst] ([src] and [dst] may be the same buffer)
+typedef void (*WaveConvertFunction)(const uint8_t *src, int16_t *dst, size_t sample_count);
+
+WaveSampleFormat wave_get_sample_format(Wave *wave);
+int wave_sample_format_size(WaveSampleFormat format);
+WaveConvertFunction wave_convert_select(WaveSampleFormat format);
+const char *wave_convert_isa();
+
+/* ---------- SAMPLE RATE CONVERSION ---------- */
+
+// Resampler quality presets (taps per phase / stopband attenuation)
+typedef enum wave_resample_quality {
+    WAVE_RESAMPLE_FAST,     // 16 taps, 60 dB
+    WAVE_RESAMPLE_MEDIUM,   // 48 taps, 90 dB
+    WAVE_RESAMPLE_BEST      // 96 taps, 120 dB
+} WaveResampleQuality;
+
+// Polyphase windowed-sinc resampler for interleaved S16 frames
+typedef struct wave_resampler {
+    int channels;
+    int in_rate, out_rate;
+    // Rate ratio reduced to up/down
+    int up, down;
+    int phases;
+    int taps;
+    // Coefficients per phase, padded with zeros to a multiple of 8
+    int row_size;
+    float *coefficients;
+    // De-interleaved input history of each channel
+    float **history;
+    size_t capacity;
+    size_t history_frames;
+    // Next output instant: history frame [position] plus [fraction]/[up]
+    size_t position;
+    int fraction;
+    float (*dot)(const float *a, const float *b, int n);
+} WaveResampler;
+
+WaveResampler *wave_resampler_create(int channels, int in_rate, int out_rate, WaveResampleQuality quality);
+void wave_resampler_reset(WaveResampler *resampler);
+size_t wave_resampler_output_frames(WaveResampler *resampler, size_t in_frames);
+size_t wave_resampler_process(WaveResampler *resampler, const int16_t *in, size_t in_frames, int16_t *out);
+size_t wave_resampler_flush(WaveResampler *resampler, int16_t *out);
+void wave_resampler_destroy(WaveResampler *resampler);
+
+/* ---------- STREAMING ---------- */
+
+WaveStream *wave_stream_open(const char *filename);
+size_t wave_stream_read_frames(WaveStream *stream, uint8_t *buffer, size_t frame_count);
+int wave_stream_seek(WaveStream *stream, uint64_t frame_index);
+void wave_stream_close(WaveStream *stream);
+
+/* ---------- WRITING ---------- */
+
+// Size of the buffer a writer fills before each write (a multiple of WAVE_WRITER_ALIGNMENT)
+#ifndef WAVE_WRITER_BUFFER_SIZE
+#define WAVE_WRITER_BUFFER_SIZE (8 * 1024 * 1024)
+#endif
+// Alignment of the buffer, of the file offsets and of the write sizes when writing with O_DIRECT
+#define WAVE_WRITER_ALIGNMENT 4096
+
+// wave_writer_open flags
+#define WAVE_WRITER_DIRECT 0x1
+
+// Streaming writer (frames go through one reusable buffer, the sizes are patched in the header on close)
+typedef struct wave_writer {
+    int fd;
+    // Opened with O_DIRECT (only whole aligned blocks are written until the tail on close)
+    int direct;
+    int failed;
+    uint16_t audio_format;
+    uint16_t number_of_channels;
+    uint32_t sample_rate;
+    uint16_t bits_per_sample;
+    uint16_t block_align;
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t buffer_used;
+    // File offset of the first byte of the buffer
+    uint64_t file_offset;
+    uint64_t data_size;
+} WaveWriter;
+
+WaveWriter *wave_writer_open(const char *filename, uint16_t audio_format, int channels, int sample_rate, int bits_per_sample, int flags);
+uint8_t *wave_writer_reserve(WaveWriter *writer, size_t *frame_count);
+void wave_writer_commit(WaveWriter *writer, size_t frame_count);
+size_t wave_writer_append_frames(WaveWriter *writer, const uint8_t *frames, size_t frame_count);
+int wave_writer_close(WaveWriter *writer);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WAVE_CONVERT_X86
+#endif
+
+#include "wavelib.h"
+
+/*
+* Every kernel converts [sample_count] samples from [src] to signed 16 bit little-endian samples at [dst].
+* [src] and [dst] may be the same buffer: narrowing formats are converted front to back and U8 (the only
+* widening one) back to front, so a sample is always read before its bytes are overwritten.
+*/
+
+// Functions used internally (private functions)
+static void convert_u8_scalar(const uint8_t *src, int16_t *dst, size_t sample_count);
+static void convert_s24_3le_scalar(const uint8_t *src, int16_t *dst, size_t sample_count);
+static void convert_s32_le_scalar(const uint8_t *src, int16_t *dst, size_t sample_count);
+static void convert_float_le_scalar(const uint8_t *src, int16_t *dst, size_t sample_count);
+static int16_t float_to_s16(float value);
+
+/* ----------------------------------- CONVERSION FUNCTIONS ----------------------------------- */
+
+/**
+ * Get Sample Format
+ * @param wave Pointer to the wave object
+ * @returns the format of the samples in the data chunk or WAVE_SAMPLE_UNKNOWN if it is not supported
+*/
+WaveSampleFormat wave_get_sample_format(Wave *wave)
+{
+    if (wave == NULL)
+        return WAVE_SAMPLE_UNKNOWN;
+
+    if (wave->header.audio_format == WAVE_FORMAT_IEEE_FLOAT)
+        return wave->header.bits_per_sample == 32 ? WAVE_SAMPLE_FLOAT_LE : WAVE_SAMPLE_UNKNOWN;
+    if (wave->header.audio_format != WAVE_FORMAT_PCM)
+        return WAVE_SAMPLE_UNKNOWN;
+
+    switch (wave->header.bits_per_sample)
+    {
+    case 8:
+        return WAVE_SAMPLE_U8;
+    case 16:
+        return WAVE_SAMPLE_S16_LE;
+    case 24:
+        return WAVE_SAMPLE_S24_3LE;
+    case 32:
+        return WAVE_SAMPLE_S32_LE;
+    }
+    return WAVE_SAMPLE_UNKNOWN;
+}
+
+/**
+ * Sample Format Size
+ * @param format Sample format
+ * @returns number of bytes of one sample in [format]
+*/
+int wave_sample_format_size(WaveSampleFormat format)
+{
+    switch (format)
+    {
+    case WAVE_SAMPLE_U8:
+        return 1;
+    case WAVE_SAMPLE_S16_LE:
+        return 2;
+    case WAVE_SAMPLE_S24_3LE:
+        return 3;
+    case WAVE_SAMPLE_S32_LE:
+    case WAVE_SAMPLE_FLOAT_LE:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+/* ----------------------------------- SCALAR KERNELS ----------------------------------- */
+
+static void convert_u8_scalar(const uint8_t *src, int16_t *dst, size_t sample_count)
+{
+    for (size_t i = sample_count; i-- > 0;)
+        dst[i] = (int16_t)((src[i] - 128) * 256);
+}
+
+static void convert_s24_3le_scalar(const uint8_t *src, int16_t *dst, size_t sample_count)
+{
+    // Keep the 16 most significant bits
+    for (size_t i = 0; i < sample_count; i++)
+        dst[i] = (int16_t)(src[3 * i + 1] | (src[3 * i + 2] << 8));
+}
+
+static void convert_s32_le_scalar(const uint8_t *src, int16_t *dst, size_t sample_count)
+{
+    for (size_t i = 0; i < sample_count; i++)
+        dst[i] = (int16_t)(src[4 * i + 2] | (src[4 * i + 3] << 8));
+}
+
+static void convert_float_le_scalar(const uint8_t *src, int16_t *dst, size_t sample_count)
+{
+    for (size_t i = 0; i < sample_count; i++)
+    {
+        float value;
+        memcpy(&value, src + 4 * i, sizeof(value));
+        dst[i] = float_to_s16(value);
+    }
+}
+
+/**
+* Convert a float sample in [-1.0; 1.0] to a signed 16 bit sample, clipping values out of range
+*/
+static int16_t float_to_s16(float value)
+{
+    // NaN clips to the top like in the SIMD kernels
+    if (!(value < 1.0f))
+        return 32767;
+    if (value < -1.0f)
+        return -32767;
+    return (int16_t)lrintf(value * 32767.0f);
+}
+
+#ifdef WAVE_CONVERT_X86
+
+/* ----------------------------------- SSE2 KERNELS ----------------------------------- */
+
+__attribute__((target("sse2")))
+static void convert_u8_sse2(const uint8_t *src, int16_t *dst, size_t sample_count)
+{
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+    const __m128i zero = _mm_setzero_si128();
+    size_t head = sample_count % 16;
+
+    // Back to front, 16 samples per iteration
+    for (size_t i = sample_count; i > head; i -= 16)
+    {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i - 16)), bias);
+        // (x - 128) << 8 is the signed byte placed in the high half of each 16 bit lane
+        _mm_storeu_si128((__m128i *)(dst + i - 8), _mm_unpackhi_epi8(zero, v));
+        _mm_storeu_si128((__m128i *)(dst + i - 16), _mm_unpacklo_epi8(zero, v));
+    }
+    convert_u8_scalar(src, dst, head);
+}
+
+__attribute__((target("sse2")))
+static void convert_s32_le_sse2(const uint8_t *src, int16_t *dst, size_t sample_count)
+{
+    size_t i = 0;
+    for (; i + 8 <= sample_count; i += 8)
+    {
+        __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + 4 * i)), 16);
+        __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + 4 * i + 16)), 16);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+    }
+    convert_s32_le_scalar(src + 4 * i, dst + i, sample_count - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_float_le_sse2(const uint8_t *src, int16_t *dst, size_t sample_count)
+{
+    const __m128 max = _mm_set1_ps(1.0f);
+    const __m128 min = _mm_set1_ps(-1.0f);
+    const __m128 scale = _mm_set1_ps(32767.0f);
+    size_t i = 0;
+    for (; i + 8 <= sample_count; i += 8)
+    {
+        __m128 a = _mm_loadu_ps((const float *)(src + 4 * i));
+        __m128 b = _mm_loadu_ps((const float *)(src + 4 * i + 16));
+        // min(x, 1.0) also turns NaN into 1.0
+        a = _mm_mul_ps(_mm_max_ps(_mm_min_ps(a, max), min), scale);
+        b = _mm_mul_ps(_mm_max_ps(_mm_min_ps(b, max), min), scale);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+    }
+    convert_float_le_scalar(src + 4 * i, dst + i, sample_count - i);
+}
+
+/* ----------------------------------- AVX2 KERNELS ----------------------------------- */
+
+__attribute__((target("avx2")))
+static void convert_u8_avx2(const uint8_t *src, int16_t *dst, size_t sample_count)
+{
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+    size_t head = sample_count % 16;
+
+    for (size_t i = sample_count; i > head; i -= 16)
+    {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i - 16)), bias);
+        _mm256_storeu_si256((__m256i *)(dst + i - 16), _mm256_slli_epi16(_mm256_cvtepi8_epi16(v), 8));
+    }
+    convert_u8_scalar(src, dst, head);
+}
+
+__attribute__((target("avx2")))
+static void convert_s24_3le_avx2(const uint8_t *src, int16_t *dst, size_t sample_count)
+{
+    // Picks the 2 high bytes of the 4 samples held in the low 12 bytes of each lane
+    const __m256i pick = _mm256_setr_epi8(1, 2, 4, 5, 7, 8, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1,
+                                          1, 2, 4, 5, 7, 8, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1);
+    size_t i = 0;
+    // The last load reads 4 bytes past the 16 samples of the iteration, stop before it leaves the buffer
+    for (; i + 18 <= sample_count; i += 16)
+    {
+        const uint8_t *p = src + 3 * i;
+        __m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                            _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+        __m256i y = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(p + 24))),
+                                            _mm_loadu_si128((const __m128i *)(p + 36)), 1);
+        // Lanes hold samples [0-3 | 4-7] and [8-11 | 12-15]
+        __m256i packed = _mm256_unpacklo_epi64(_mm256_shuffle_epi8(x, pick), _mm256_shuffle_epi8(y, pick));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+    convert_s24_3le_scalar(src + 3 * i, dst + i, sample_count - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_s32_le_avx2(const uint8_t *src, int16_t *dst, size_t sample_count)
+{
+    size_t i = 0;
+    for (; i + 16 <= sample_count; i += 16)
+    {
+        __m256i a = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(src + 4 * i)), 16);
+        __m256i b = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(src + 4 * i + 32)), 16);
+        // packs works per 128 bit lane, put the 64 bit blocks back in order
+        __m256i packed = _mm256_packs_epi32(a, b);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+    convert_s32_le_scalar(src + 4 * i, dst + i, sample_count - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_float_le_avx2(const uint8_t *src, int16_t *dst, size_t sample_count)
+{
+    const __m256 max = _mm256_set1_ps(1.0f);
+    const __m256 min = _mm256_set1_ps(-1.0f);
+    const __m256 scale = _mm256_set1_ps(32767.0f);
+    size_t i = 0;
+    for (; i + 16 <= sample_count; i += 16)
+    {
+        __m256 a = _mm256_loadu_ps((const float *)(src + 4 * i));
+        __m256 b = _mm256_loadu_ps((const float *)(src + 4 * i + 32));
+        a = _mm256_mul_ps(_mm256_max_ps(_mm256_min_ps(a, max), min), scale);
+        b = _mm256_mul_ps(_mm256_max_ps(_mm256_min_ps(b, max), min), scale);
+        __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+    convert_float_le_scalar(src + 4 * i, dst + i, sample_count - i);
+}
+
+#endif
+
+/* ----------------------------------- KERNEL SELECTION ----------------------------------- */
+
+/**
+ * Convert ISA
+ * The CPU is only probed on the first call
+ * @returns the instruction set the selected kernels use ("avx2", "sse2" or "scalar")
+*/
+const char *wave_convert_isa()
+{
+    static const char *isa = NULL;
+    if (isa != NULL)
+        return isa;
+
+    isa = "scalar";
+#ifdef WAVE_CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        isa = "avx2";
+    else if (__builtin_cpu_supports("sse2"))
+        isa = "sse2";
+#endif
+    return isa;
+}
+
+/**
+ * Convert Select
+ * Picks the fastest kernel the CPU supports to convert samples from [format] to S16_LE
+ * @param format Format of the samples to convert
+ * @returns the conversion kernel or NULL if [format] is already S16_LE (or is not supported)
+*/
+WaveConvertFunction wave_convert_select(WaveSampleFormat format)
+{
+    const char *isa = wave_convert_isa();
+    (void)isa;
+
+    switch (format)
+    {
+    case WAVE_SAMPLE_U8:
+#ifdef WAVE_CONVERT_X86
+        if (strcmp(isa, "avx2") == 0)
+            return convert_u8_avx2;
+        if (strcmp(isa, "sse2") == 0)
+            return convert_u8_sse2;
+#endif
+        return convert_u8_scalar;
+    case WAVE_SAMPLE_S24_3LE:
+#ifdef WAVE_CONVERT_X86
+        // SSE2 has no byte shuffle, the scalar kernel is as fast there
+        if (strcmp(isa, "avx2") == 0)
+            return convert_s24_3le_avx2;
+#endif
+        return convert_s24_3le_scalar;
+    case WAVE_SAMPLE_S32_LE:
+#ifdef WAVE_CONVERT_X86
+        if (strcmp(isa, "avx2") == 0)
+            return convert_s32_le_avx2;
+        if (strcmp(isa, "sse2") == 0)
+            return convert_s32_le_sse2;
+#endif
+        return convert_s32_le_scalar;
+    case WAVE_SAMPLE_FLOAT_LE:
+#ifdef WAVE_CONVERT_X86
+        if (strcmp(isa, "avx2") == 0)
+            return convert_float_le_avx2;
+        if (strcmp(isa, "sse2") == 0)
+            return convert_float_le_sse2;
+#endif
+        return convert_float_le_scalar;
+    default:
+        return NULL;
+    }
+}
@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WAVE_RESAMPLE_X86
+#endif
+
+#include "wavelib.h"
+
+/*
+* Polyphase windowed-sinc resampler.
+* The rate ratio is reduced to [up]/[down] and one Kaiser windowed sinc is sampled at [phases] fractional
+* offsets, so producing an output frame is a single dot product between the input history of each channel
+* and one precomputed coefficient row.
+*/
+
+// Input frames appended to the history between two compactions
+#define WAVE_RESAMPLE_BLOCK 1024
+// Rate pairs that would need more phases than this share the nearest phase
+#define WAVE_RESAMPLE_MAX_PHASES 1024
+// Max taps per phase when the filter has to be widened for a big down-sampling ratio
+#define WAVE_RESAMPLE_MAX_TAPS 4096
+
+// Functions used internally (private functions)
+static int resample_gcd(int a, int b);
+static double bessel_i0(double x);
+static void resample_build_table(WaveResampler *resampler, int base_taps, double attenuation);
+static float dot_scalar(const float *a, const float *b, int n);
+
+/* ----------------------------------- DOT PRODUCT KERNELS ----------------------------------- */
+
+// [n] is always a multiple of 8 (coefficient rows are padded with zeros)
+static float dot_scalar(const float *a, const float *b, int n)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+#ifdef WAVE_RESAMPLE_X86
+
+__attribute__((target("sse2")))
+static float dot_sse2(const float *a, const float *b, int n)
+{
+    __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+    for (int i = 0; i < n; i += 8)
+    {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_load_ps(b + i)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_load_ps(b + i + 4)));
+    }
+    sum0 = _mm_add_ps(sum0, sum1);
+    sum0 = _mm_add_ps(sum0, _mm_movehl_ps(sum0, sum0));
+    sum0 = _mm_add_ss(sum0, _mm_shuffle_ps(sum0, sum0, 1));
+    return _mm_cvtss_f32(sum0);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *a, const float *b, int n)
+{
+    __m256 sum = _mm256_setzero_ps();
+    for (int i = 0; i < n; i += 8)
+        sum = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_load_ps(b + i), sum);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    return _mm_cvtss_f32(half);
+}
+
+#endif
+
+/* ----------------------------------- RESAMPLER FUNCTIONS ----------------------------------- */
+
+/**
+ * Resampler Create
+ * @param channels Number of interleaved channels
+ * @param in_rate Sample rate of the input frames
+ * @param out_rate Sample rate of the output frames
+ * @param quality Preset trading CPU time against stopband attenuation
+ * @returns pointer to the new resampler or NULL if the parameters are invalid
+*/
+WaveResampler *wave_resampler_create(int channels, int in_rate, int out_rate, WaveResampleQuality quality)
+{
+    if (channels <= 0 || in_rate <= 0 || out_rate <= 0)
+        return NULL;
+
+    // Taps per phase and stopband attenuation (dB) of each preset
+    int base_taps;
+    double attenuation;
+    switch (quality)
+    {
+    case WAVE_RESAMPLE_FAST:
+        base_taps = 16;
+        attenuation = 60.0;
+        break;
+    case WAVE_RESAMPLE_BEST:
+        base_taps = 96;
+        attenuation = 120.0;
+        break;
+    default:
+        base_taps = 48;
+        attenuation = 90.0;
+        break;
+    }
+
+    WaveResampler *resampler = (WaveResampler *)calloc(1, sizeof(WaveResampler));
+    if (resampler == NULL)
+        return NULL;
+
+    int gcd = resample_gcd(in_rate, out_rate);
+    resampler->channels = channels;
+    resampler->in_rate = in_rate;
+    resampler->out_rate = out_rate;
+    resampler->up = out_rate / gcd;
+    resampler->down = in_rate / gcd;
+    resampler->phases = resampler->up < WAVE_RESAMPLE_MAX_PHASES ? resampler->up : WAVE_RESAMPLE_MAX_PHASES;
+
+    resample_build_table(resampler, base_taps, attenuation);
+    if (resampler->coefficients == NULL)
+    {
+        wave_resampler_destroy(resampler);
+        return NULL;
+    }
+
+    // The history can hold a whole filter plus one block, with room for the zero padded row tail
+    resampler->capacity = resampler->taps + WAVE_RESAMPLE_BLOCK;
+    resampler->history = (float **)calloc(channels, sizeof(float *));
+    if (resampler->history == NULL)
+    {
+        wave_resampler_destroy(resampler);
+        return NULL;
+    }
+    for (int c = 0; c < channels; c++)
+    {
+        resampler->history[c] = (float *)calloc(resampler->capacity + resampler->row_size, sizeof(float));
+        if (resampler->history[c] == NULL)
+        {
+            wave_resampler_destroy(resampler);
+            return NULL;
+        }
+    }
+
+    resampler->dot = dot_scalar;
+#ifdef WAVE_RESAMPLE_X86
+    if (strcmp(wave_convert_isa(), "avx2") == 0 && __builtin_cpu_supports("fma"))
+        resampler->dot = dot_avx2;
+    else if (strcmp(wave_convert_isa(), "scalar") != 0)
+        resampler->dot = dot_sse2;
+#endif
+
+    wave_resampler_reset(resampler);
+    return resampler;
+}
+
+/**
+ * Resampler Reset
+ * Forgets every buffered input frame, the next frame is treated as the start of a new stream
+ * @param resampler Pointer to the resampler object
+*/
+void wave_resampler_reset(WaveResampler *resampler)
+{
+    // The first output frame is centered on the first input frame
+    int latency = resampler->taps / 2 - 1;
+    for (int c = 0; c < resampler->channels; c++)
+        memset(resampler->history[c], 0, (resampler->capacity + resampler->row_size) * sizeof(float));
+    resampler->history_frames = latency;
+    resampler->position = 0;
+    resampler->fraction = 0;
+}
+
+/**
+ * Resampler Output Frames
+ * Fewer than [taps] frames are ever left in the history between calls, so the bound does not
+ * depend on the resampler state and can be used to size buffers once
+ * @param resampler Pointer to the resampler object
+ * @param in_frames Number of input frames processed in one call
+ * @returns the max number of frames wave_resampler_process can produce for [in_frames] input frames
+*/
+size_t wave_resampler_output_frames(WaveResampler *resampler, size_t in_frames)
+{
+    uint64_t positions = resampler->taps + in_frames;
+    return (positions * resampler->up) / resampler->down + 2;
+}
+
+/**
+ * Resampler Process
+ * Consumes every input frame and produces all the output frames they complete
+ * @param resampler Pointer to the resampler object
+ * @param in Interleaved S16 input frames
+ * @param in_frames Number of input frames
+ * @param out Interleaved S16 output frames, room for wave_resampler_output_frames(in_frames) frames
+ * @returns number of frames written to [out]
+*/
+size_t wave_resampler_process(WaveResampler *resampler, const int16_t *in, size_t in_frames, int16_t *out)
+{
+    const int channels = resampler->channels;
+    size_t out_frames = 0;
+
+    while (in_frames > 0)
+    {
+        // Append as many frames as fit, de-interleaved and converted to float
+        size_t frames = resampler->capacity - resampler->history_frames;
+        if (frames > in_frames)
+            frames = in_frames;
+        for (int c = 0; c < channels; c++)
+        {
+            float *history = resampler->history[c] + resampler->history_frames;
+            for (size_t i = 0; i < frames; i++)
+                history[i] = in[i * channels + c] * (1.0f / 32768.0f);
+        }
+        resampler->history_frames += frames;
+        in += frames * channels;
+        in_frames -= frames;
+
+        // Produce every output frame whose filter window is complete
+        while (resampler->position + resampler->taps <= resampler->history_frames)
+        {
+            int phase = resampler->phases == resampler->up
+                            ? resampler->fraction
+                            : (int)((uint64_t)resampler->fraction * resampler->phases / resampler->up);
+            const float *row = resampler->coefficients + (size_t)phase * resampler->row_size;
+
+            for (int c = 0; c < channels; c++)
+            {
+                float value = resampler->dot(resampler->history[c] + resampler->position, row, resampler->row_size) * 32768.0f;
+                out[out_frames * channels + c] = value >= 32767.0f ? 32767 : value <= -32768.0f ? -32768 : (int16_t)lrintf(value);
+            }
+            out_frames++;
+
+            resampler->fraction += resampler->down;
+            resampler->position += resampler->fraction / resampler->up;
+            resampler->fraction %= resampler->up;
+        }
+
+        // Drop the frames no filter window will use again
+        size_t consumed = resampler->position < resampler->history_frames ? resampler->position : resampler->history_frames;
+        for (int c = 0; c < channels; c++)
+            memmove(resampler->history[c], resampler->history[c] + consumed, (resampler->history_frames - consumed) * sizeof(float));
+        resampler->history_frames -= consumed;
+        resampler->position -= consumed;
+    }
+
+    return out_frames;
+}
+
+/**
+ * Resampler Flush
+ * Pushes enough silence to get the output frames of the last input frames out of the filter
+ * @param resampler Pointer to the resampler object
+ * @param out Interleaved S16 output frames, room for wave_resampler_output_frames(taps / 2) frames
+ * @returns number of frames written to [out]
+*/
+size_t wave_resampler_flush(WaveResampler *resampler, int16_t *out)
+{
+    size_t frames = resampler->taps / 2;
+    int16_t *silence = (int16_t *)calloc(frames * resampler->channels, sizeof(int16_t));
+    if (silence == NULL)
+        return 0;
+
+    size_t out_frames = wave_resampler_process(resampler, silence, frames, out);
+    free(silence);
+    return out_frames;
+}
+
+/**
+ * Resampler Destroy
+ * @param resampler Pointer to the resampler object to destroy
+*/
+void wave_resampler_destroy(WaveResampler *resampler)
+{
+    if (resampler == NULL)
+        return;
+    if (resampler->history != NULL)
+        for (int c = 0; c < resampler->channels; c++)
+            free(resampler->history[c]);
+    free(resampler->history);
+    free(resampler->coefficients);
+    free(resampler);
+}
+
+/* ----------------------------------- AUXILIARY FUNCTIONS ----------------------------------- */
+
+/**
+* Build the polyphase coefficient table
+* The filter is widened when down-sampling so the transition band keeps its width relative to the
+* output rate, and its cutoff is placed so the stopband starts at the lower of the two Nyquist frequencies
+* @param resampler Pointer to the resampler object (taps, row_size and coefficients are set)
+* @param base_taps Taps per phase when the output rate is not lower than the input rate
+* @param attenuation Stopband attenuation in dB
+*/
+static void resample_build_table(WaveResampler *resampler, int base_taps, double attenuation)
+{
+    double ratio = (double)resampler->up / resampler->down;
+    double scale = ratio < 1.0 ? ratio : 1.0;
+
+    int taps = (int)ceil(base_taps / scale);
+    taps += taps & 1;
+    if (taps > WAVE_RESAMPLE_MAX_TAPS)
+        taps = WAVE_RESAMPLE_MAX_TAPS;
+    resampler->taps = taps;
+    resampler->row_size = (taps + 7) & ~7;
+
+    // Kaiser design rules (transition width in cycles per input sample)
+    double beta = attenuation > 50.0 ? 0.1102 * (attenuation - 8.7) : 0.5842 * pow(attenuation - 21.0, 0.4) + 0.07886 * (attenuation - 21.0);
+    double transition = (attenuation - 7.95) / (14.36 * taps);
+    double cutoff = 0.5 * scale - transition / 2.0;
+    if (cutoff < 0.05 * scale)
+        cutoff = 0.05 * scale;
+
+    size_t table_size = (size_t)resampler->phases * resampler->row_size * sizeof(float);
+    if (posix_memalign((void **)&resampler->coefficients, 32, table_size) != 0)
+    {
+        resampler->coefficients = NULL;
+        return;
+    }
+    memset(resampler->coefficients, 0, table_size);
+
+    double half = taps / 2.0;
+    double i0_beta = bessel_i0(beta);
+    for (int p = 0; p < resampler->phases; p++)
+    {
+        float *row = resampler->coefficients + (size_t)p * resampler->row_size;
+        double fraction = (double)p / resampler->phases;
+        double sum = 0.0;
+        for (int k = 0; k < taps; k++)
+        {
+            // Distance between the output instant and input frame k of the window
+            double d = fraction + (taps / 2 - 1) - k;
+            double x = 2.0 * cutoff * d;
+            double sinc = fabs(x) < 1e-12 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+            double w = d / half;
+            double window = fabs(w) >= 1.0 ? 0.0 : bessel_i0(beta * sqrt(1.0 - w * w)) / i0_beta;
+            row[k] = (float)(sinc * window);
+            sum += row[k];
+        }
+        // Unity gain at DC for every phase
+        for (int k = 0; k < taps; k++)
+            row[k] = (float)(row[k] / sum);
+    }
+}
+
+/**
+* Zeroth order modified Bessel function of the first kind (power series)
+*/
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 64; k++)
+    {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-17)
+            break;
+    }
+    return sum;
+}
+
+/**
+* Greatest common divisor of two positive integers
+*/
+static int resample_gcd(int a, int b)
+{
+    while (b != 0)
+    {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
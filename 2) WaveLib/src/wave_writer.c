@@ -0,0 +1,269 @@
+// Offsets and sizes are 64 bit even on 32 bit platforms (RF64 files go well past 4 GB)
+#define _FILE_OFFSET_BITS 64
+// O_DIRECT
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "wavelib.h"
+
+/*
+* Streaming WAV writer.
+* The header is reserved at the start of the first buffer: a RIFF header, a "JUNK" chunk the size of a
+* "ds64" chunk, the "fmt " chunk and the "data" chunk header. Frames are appended after it and the buffer
+* is written with one positioned write each time it fills up. Closing patches the sizes in place, turning
+* the file into RF64 (the "JUNK" chunk becomes "ds64") when they do not fit in 32 bits, so the frames
+* never have to be moved.
+*/
+
+#define WAVE_WRITER_HEADER_SIZE 80
+#define WAVE_WRITER_DS64_SIZE 28
+
+// Functions used internally (private functions)
+static int wave_writer_flush(WaveWriter *writer, int everything);
+static void wave_writer_build_header(WaveWriter *writer, uint8_t header[WAVE_WRITER_HEADER_SIZE]);
+static void PutUInt16(uint8_t *destination, uint16_t value);
+static void PutUInt32(uint8_t *destination, uint32_t value);
+static void PutUInt64(uint8_t *destination, uint64_t value);
+
+/* ----------------------------------- WAVE WRITER FUNCTIONS ----------------------------------- */
+
+/**
+ * Wave Writer Open (Creates a WAV file to be filled with frames)
+ * @param filename Name of the file to create (truncated if it exists)
+ * @param audio_format WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT
+ * @param channels Number of interleaved channels
+ * @param sample_rate Frames per second
+ * @param bits_per_sample Bits of each sample (8, 16, 24 or 32 for PCM, 32 or 64 for float)
+ * @param flags WAVE_WRITER_DIRECT to bypass the page cache (ignored by filesystems without O_DIRECT)
+ * @returns pointer to the new writer or NULL if the file could not be created
+*/
+WaveWriter *wave_writer_open(const char *filename, uint16_t audio_format, int channels, int sample_rate, int bits_per_sample, int flags)
+{
+    if (channels <= 0 || sample_rate <= 0 || bits_per_sample <= 0 || bits_per_sample % 8 != 0)
+        return NULL;
+
+    WaveWriter *writer = (WaveWriter *)calloc(1, sizeof(WaveWriter));
+    if (writer == NULL)
+    {
+        printf("Out of memory!");
+        return NULL;
+    }
+    writer->audio_format = audio_format;
+    writer->number_of_channels = channels;
+    writer->sample_rate = sample_rate;
+    writer->bits_per_sample = bits_per_sample;
+    writer->block_align = channels * bits_per_sample / 8;
+
+    writer->fd = -1;
+    if (flags & WAVE_WRITER_DIRECT)
+    {
+        writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+        writer->direct = writer->fd != -1;
+    }
+    // tmpfs and a few others refuse O_DIRECT
+    if (writer->fd == -1)
+        writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->fd == -1)
+    {
+        free(writer);
+        return NULL;
+    }
+
+    // Aligned for O_DIRECT, and a whole number of blocks so every full flush starts aligned
+    writer->buffer_size = WAVE_WRITER_BUFFER_SIZE;
+    if (posix_memalign((void **)&writer->buffer, WAVE_WRITER_ALIGNMENT, writer->buffer_size) != 0)
+    {
+        printf("Out of memory!");
+        close(writer->fd);
+        free(writer);
+        return NULL;
+    }
+
+    // Placeholder header, the sizes are patched by wave_writer_close
+    wave_writer_build_header(writer, writer->buffer);
+    writer->buffer_used = WAVE_WRITER_HEADER_SIZE;
+    return writer;
+}
+
+/**
+ * Wave Writer Reserve
+ * Room in the writer buffer to render frames into directly, instead of copying them with append
+ * @param writer Pointer to the writer object
+ * @param frame_count Frames wanted, lowered to what fits in the buffer
+ * @returns pointer to write the frames at (committed with wave_writer_commit) or NULL on a write error
+*/
+uint8_t *wave_writer_reserve(WaveWriter *writer, size_t *frame_count)
+{
+    if (writer->buffer_size - writer->buffer_used < writer->block_align && !wave_writer_flush(writer, 0))
+        return NULL;
+
+    size_t room = (writer->buffer_size - writer->buffer_used) / writer->block_align;
+    if (*frame_count > room)
+        *frame_count = room;
+    return writer->buffer + writer->buffer_used;
+}
+
+/**
+ * Wave Writer Commit
+ * Adds the first [frame_count] frames written at the pointer of the last reserve to the file
+ * @param writer Pointer to the writer object
+ * @param frame_count Number of frames written (at most what the reserve returned)
+*/
+void wave_writer_commit(WaveWriter *writer, size_t frame_count)
+{
+    writer->buffer_used += frame_count * writer->block_align;
+    writer->data_size += (uint64_t)frame_count * writer->block_align;
+}
+
+/**
+ * Wave Writer Append Frames
+ * @param writer Pointer to the writer object
+ * @param frames Interleaved frames in the format of the file
+ * @param frame_count Number of frames to append
+ * @returns number of frames appended (less than [frame_count] only on a write error)
+*/
+size_t wave_writer_append_frames(WaveWriter *writer, const uint8_t *frames, size_t frame_count)
+{
+    size_t appended = 0;
+    while (appended < frame_count)
+    {
+        size_t chunk_frames = frame_count - appended;
+        uint8_t *destination = wave_writer_reserve(writer, &chunk_frames);
+        if (destination == NULL)
+            break;
+        memcpy(destination, frames + appended * writer->block_align, chunk_frames * writer->block_align);
+        wave_writer_commit(writer, chunk_frames);
+        appended += chunk_frames;
+    }
+    return appended;
+}
+
+/**
+ * Wave Writer Close
+ * Writes what is left in the buffer, patches the RIFF and data sizes (RF64 past 4 GB) and closes the file
+ * @param writer Pointer to the writer object
+ * @returns 1 if the file is complete or 0 if a write failed
+*/
+int wave_writer_close(WaveWriter *writer)
+{
+    if (writer == NULL)
+        return 0;
+
+    int complete = !writer->failed;
+    // The tail is rarely a whole number of blocks, it goes through the page cache
+    if (writer->direct && fcntl(writer->fd, F_SETFL, fcntl(writer->fd, F_GETFL) & ~O_DIRECT) == -1)
+        complete = 0;
+    writer->direct = 0;
+    // RIFF pad byte after an odd sized data chunk
+    if (complete && writer->data_size % 2 != 0
+        && (writer->buffer_used < writer->buffer_size || wave_writer_flush(writer, 1)))
+        writer->buffer[writer->buffer_used++] = 0;
+    if (complete)
+        complete = wave_writer_flush(writer, 1);
+
+    if (complete)
+    {
+        uint8_t header[WAVE_WRITER_HEADER_SIZE];
+        wave_writer_build_header(writer, header);
+        complete = pwrite(writer->fd, header, sizeof(header), 0) == sizeof(header);
+    }
+
+    close(writer->fd);
+    free(writer->buffer);
+    free(writer);
+    return complete;
+}
+
+/* ----------------------------------- AUXILIARY FUNCTIONS ----------------------------------- */
+
+/**
+ * Write the buffer to the file at the position it was filled for
+ * @param everything 0 to only write whole blocks on a direct writer (the rest moves to the buffer front)
+ * @returns 1 on success or 0 if the write failed (the writer is then marked as failed)
+*/
+static int wave_writer_flush(WaveWriter *writer, int everything)
+{
+    size_t size = writer->buffer_used;
+    if (writer->direct && !everything)
+        size -= size % WAVE_WRITER_ALIGNMENT;
+
+    for (size_t done = 0; done < size;)
+    {
+        ssize_t written = pwrite(writer->fd, writer->buffer + done, size - done, writer->file_offset + done);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+        {
+            writer->failed = 1;
+            return 0;
+        }
+        done += written;
+    }
+
+    writer->file_offset += size;
+    writer->buffer_used -= size;
+    memmove(writer->buffer, writer->buffer + size, writer->buffer_used);
+    return 1;
+}
+
+/**
+ * Build the header of the file for the frames appended so far
+ * The "JUNK" chunk keeps room for a "ds64" chunk, used when the sizes do not fit in 32 bits
+*/
+static void wave_writer_build_header(WaveWriter *writer, uint8_t header[WAVE_WRITER_HEADER_SIZE])
+{
+    uint64_t riff_size = WAVE_WRITER_HEADER_SIZE - 8 + writer->data_size + writer->data_size % 2;
+    int rf64 = riff_size > UINT32_MAX;
+
+    memcpy(header, rf64 ? "RF64" : "RIFF", 4);
+    PutUInt32(header + 4, rf64 ? UINT32_MAX : (uint32_t)riff_size);
+    memcpy(header + 8, "WAVE", 4);
+
+    memcpy(header + 12, rf64 ? "ds64" : "JUNK", 4);
+    PutUInt32(header + 16, WAVE_WRITER_DS64_SIZE);
+    memset(header + 20, 0, WAVE_WRITER_DS64_SIZE);
+    if (rf64)
+    {
+        PutUInt64(header + 20, riff_size);
+        PutUInt64(header + 28, writer->data_size);
+        PutUInt64(header + 36, writer->data_size / writer->block_align);
+    }
+
+    memcpy(header + 48, "fmt ", 4);
+    PutUInt32(header + 52, 16);
+    PutUInt16(header + 56, writer->audio_format);
+    PutUInt16(header + 58, writer->number_of_channels);
+    PutUInt32(header + 60, writer->sample_rate);
+    PutUInt32(header + 64, writer->sample_rate * writer->block_align);
+    PutUInt16(header + 68, writer->block_align);
+    PutUInt16(header + 70, writer->bits_per_sample);
+
+    memcpy(header + 72, "data", 4);
+    PutUInt32(header + 76, rf64 ? UINT32_MAX : (uint32_t)writer->data_size);
+}
+
+// Little endian stores (the file layout does not depend on the host)
+static void PutUInt16(uint8_t *destination, uint16_t value)
+{
+    destination[0] = value;
+    destination[1] = value >> 8;
+}
+
+static void PutUInt32(uint8_t *destination, uint32_t value)
+{
+    PutUInt16(destination, value);
+    PutUInt16(destination + 2, value >> 16);
+}
+
+static void PutUInt64(uint8_t *destination, uint64_t value)
+{
+    PutUInt32(destination, value);
+    PutUInt32(destination + 4, value >> 32);
+}
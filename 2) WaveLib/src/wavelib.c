@@ -1,3 +1,6 @@
+// Offsets and sizes are 64 bit even on 32 bit platforms (RF64 files go well past 4 GB)
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -5,20 +8,31 @@
 #include <regex.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "wavelib.h"
 
 // Functions used internally (private functions)
-static size_t wav_read_bytes(const char *filename, size_t start, size_t block_size, uint8_t *buffer);
-static int wave_extract_header_field(Wave *wave, const int offset, const int field_size, const bool little_endian);
+static size_t wav_read_bytes(int fd, off_t start, size_t block_size, uint8_t *buffer);
+static int wave_parse_header(int fd, WaveHeader *header);
+static int wave_parse_chunks(int fd, uint64_t file_size, const uint8_t *head, size_t head_size, bool whole, WaveHeader *header);
+static size_t wave_head_read(int fd, const uint8_t *head, size_t head_size, uint64_t start, size_t block_size, uint8_t *buffer);
+static void wave_index_chunk(WaveHeader *header, const uint8_t id[4], uint64_t offset, uint64_t size);
+static size_t wave_frames_in_reach(Wave *wave, uint64_t frame_index, size_t frame_count);
+static const uint8_t *wave_stream_window_for(WaveStream *stream, uint64_t frame_index, size_t *frames_in_window);
 static int regex_match(const char *string, const char *pattern);
-static int ConvertToInt(uint8_t value[], int bytesNum, const bool littleEndian);
-static int wave_get_data_size(Wave *wave);
+static uint16_t ConvertToUInt16(const uint8_t value[]);
+static uint32_t ConvertToUInt32(const uint8_t value[]);
+static uint64_t ConvertToUInt64(const uint8_t value[]);
 
 /* ----------------------------------- WAVE LIBRARY FUNCTIONS ----------------------------------- */
 
 /**
  * Wave Load (Creates a Wave file representation in memory)
+ * The header is decoded once here, every getter answers from the cached descriptor afterwards
  * @param filename Name of the file to load
  * @returns pointer to the new Wave struct
 */
@@ -26,28 +40,133 @@ Wave *wave_load(const char *filename)
 {
     if (!regex_match(filename, "\\.wav$"))
         return NULL;
-    if (access(filename, F_OK) != 0)
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
         return NULL;
 
-    Wave *new_wave = (Wave *)malloc(sizeof(Wave));
+    Wave *new_wave = (Wave *)calloc(1, sizeof(Wave));
     if (new_wave == NULL)
     {
         printf("Out of memory!");
+        close(fd);
         return NULL;
     }
 
-    new_wave->filepath = filename;
+    // Walk the chunks a single time, the data chunk has to fit in memory
+    if (!wave_parse_header(fd, &new_wave->header) || new_wave->header.data_size != (size_t)new_wave->header.data_size)
+    {
+        free(new_wave);
+        close(fd);
+        return NULL;
+    }
 
-    // Calculate file Data size to allocate memory for it
-    size_t data_size = wave_get_data_size(new_wave);
+    new_wave->filepath = strdup(filename);
+    new_wave->data_size = new_wave->header.data_size;
+    new_wave->data = (uint8_t *)calloc(1, new_wave->data_size);
+    if (new_wave->filepath == NULL || new_wave->data == NULL)
+    {
+        printf("Out of memory!");
+        close(fd);
+        wave_destroy(new_wave);
+        return NULL;
+    }
 
-    new_wave->data_size = data_size;
+    // Copy all the file Data to a buffer (new_wave->data)
+    new_wave->data_size = wav_read_bytes(fd, new_wave->header.data_offset, new_wave->data_size, new_wave->data);
 
-    new_wave->data = (uint8_t *)calloc(1, data_size);
+    close(fd);
+    return new_wave;
+}
 
-    // Copy all the file Data to a buffer (new_wave->data)
-    const int dataOffset = 44; // Header Size
-    wav_read_bytes(new_wave->filepath, dataOffset, data_size, new_wave->data);
+/**
+ * Wave Load Mapped (Creates a Wave file representation backed by a read-only memory mapping)
+ * No sample is copied, pages are only brought in as they are played
+ * @param filename Name of the file to load
+ * @returns pointer to the new Wave struct
+*/
+Wave *wave_load_mapped(const char *filename)
+{
+    if (!regex_match(filename, "\\.wav$"))
+        return NULL;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    Wave *new_wave = (Wave *)calloc(1, sizeof(Wave));
+    if (new_wave == NULL)
+    {
+        printf("Out of memory!");
+        close(fd);
+        return NULL;
+    }
+
+    struct stat statbuf;
+    if (!wave_parse_header(fd, &new_wave->header) || fstat(fd, &statbuf) == -1 ||
+        (uint64_t)statbuf.st_size != (size_t)statbuf.st_size)
+    {
+        free(new_wave);
+        close(fd);
+        return NULL;
+    }
+
+    new_wave->map_size = statbuf.st_size;
+    new_wave->map = (uint8_t *)mmap(NULL, new_wave->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid after the file is closed
+    close(fd);
+    if (new_wave->map == MAP_FAILED)
+    {
+        free(new_wave);
+        return NULL;
+    }
+    madvise(new_wave->map, new_wave->map_size, MADV_SEQUENTIAL);
+
+    new_wave->filepath = strdup(filename);
+    if (new_wave->filepath == NULL)
+    {
+        printf("Out of memory!");
+        wave_destroy(new_wave);
+        return NULL;
+    }
+
+    new_wave->data_size = new_wave->header.data_size;
+    new_wave->data = new_wave->map + new_wave->header.data_offset;
+
+    return new_wave;
+}
+
+/**
+ * Wave Load Streamed (Creates a Wave file representation that reads its samples on demand)
+ * Only the fixed size stream windows are kept in memory, whatever the size of the file
+ * @param filename Name of the file to load
+ * @returns pointer to the new Wave struct
+*/
+Wave *wave_load_streamed(const char *filename)
+{
+    WaveStream *stream = wave_stream_open(filename);
+    if (stream == NULL)
+        return NULL;
+
+    Wave *new_wave = (Wave *)calloc(1, sizeof(Wave));
+    if (new_wave == NULL)
+    {
+        printf("Out of memory!");
+        wave_stream_close(stream);
+        return NULL;
+    }
+
+    new_wave->filepath = strdup(filename);
+    if (new_wave->filepath == NULL)
+    {
+        printf("Out of memory!");
+        wave_stream_close(stream);
+        free(new_wave);
+        return NULL;
+    }
+    new_wave->header = stream->header;
+    new_wave->data_size = stream->header.data_size;
+    new_wave->stream = stream;
 
     return new_wave;
 }
@@ -58,6 +177,15 @@ Wave *wave_load(const char *filename)
 */
 void wave_destroy(Wave *wave)
 {
+    if (wave == NULL)
+        return;
+    free((char *)wave->filepath);
+    if (wave->stream != NULL)
+        wave_stream_close(wave->stream);
+    else if (wave->map != NULL)
+        munmap(wave->map, wave->map_size);
+    else
+        free(wave->data);
     free(wave);
 }
 
@@ -68,10 +196,10 @@ void wave_destroy(Wave *wave)
 */
 int wave_get_bits_per_sample(Wave *wave)
 {
-    if (strlen(wave->filepath) == 0)
+    if (wave == NULL)
         return -1;
 
-    return wave_extract_header_field(wave, 34, 2, true);
+    return wave->header.bits_per_sample;
 }
 
 /**
@@ -81,10 +209,10 @@ int wave_get_bits_per_sample(Wave *wave)
 */
 int wave_get_number_of_channels(Wave *wave)
 {
-    if (strlen(wave->filepath) == 0)
+    if (wave == NULL)
         return -1;
 
-    return wave_extract_header_field(wave, 22, 2, true);
+    return wave->header.number_of_channels;
 }
 
 /**
@@ -94,133 +222,525 @@ int wave_get_number_of_channels(Wave *wave)
 */
 int wave_get_sample_rate(Wave *wave)
 {
-    if (strlen(wave->filepath) == 0)
+    if (wave == NULL)
         return -1;
 
-    return wave_extract_header_field(wave, 24, 4, true);
+    return wave->header.sample_rate;
+}
+
+/**
+ * Get Frame Count
+ * @param wave Pointer to the wave object
+ * @returns number of frames in the data chunk
+*/
+uint64_t wave_get_frame_count(Wave *wave)
+{
+    if (wave == NULL || wave->header.block_align == 0)
+        return 0;
+
+    return wave->data_size / wave->header.block_align;
+}
+
+/**
+ * Get Chunk (Look a chunk up in the index built by the loader)
+ * @param wave Pointer to the wave object
+ * @param id Four character chunk identifier (Ex: "LIST")
+ * @returns the first chunk with identifier [id] or NULL if the file has none
+*/
+const WaveChunk *wave_get_chunk(Wave *wave, const char *id)
+{
+    if (wave == NULL)
+        return NULL;
+
+    for (int i = 0; i < wave->header.chunk_count; i++)
+        if (memcmp(wave->header.chunks[i].id, id, 4) == 0)
+            return &wave->header.chunks[i];
+    return NULL;
 }
 
 /**
  * Wave Get Samples (Extract wave samples from Wave object)
+ * The last period of a file may be shorter than [frame_count]
  * @param wave Pointer to the wave object
  * @param frame_index Index for the first frame (group of samples)
  * @param buffer Data Buffer where the samples will be stored
  * @param frame_count Number of frames to retrieve
  * @returns number of samples
 */
-size_t wave_get_samples(Wave *wave, size_t frame_index, uint8_t *buffer, size_t frame_count)
+size_t wave_get_samples(Wave *wave, uint64_t frame_index, uint8_t *buffer, size_t frame_count)
 {
-    if (strlen(wave->filepath) == 0)
+    if (wave == NULL)
         return 0;
 
-    int bits_per_sample = wave_get_bits_per_sample(wave);
-    int channels_number = wave_get_number_of_channels(wave);
+    size_t frame_size = wave->header.block_align;
 
-    int frame_size = (bits_per_sample / 8) * channels_number; // Bytes per frame (1 Frame is [channels_number] Samples)
+    // Streamed waves go through the stream windows
+    if (wave->stream != NULL)
+    {
+        if (!wave_stream_seek(wave->stream, frame_index))
+            return 0;
+        return wave_stream_read_frames(wave->stream, buffer, frame_count) * wave->header.number_of_channels;
+    }
 
-    // Both in Bytes
-    const int startIndex = frame_index * frame_size;
-    const int endIndex = ((frame_index + frame_count) * frame_size) - 1;
+    // Only the frames in reach are copied
+    frame_count = wave_frames_in_reach(wave, frame_index, frame_count);
+
+    memcpy(buffer, wave->data + (size_t)frame_index * frame_size, frame_count * frame_size);
+
+    return frame_count * wave->header.number_of_channels;
+}
 
-    // If the frames requested are not in reach
-    if (startIndex + frame_count > wave->data_size)
+/**
+ * Wave Get Samples View (Access wave samples in place, without copying them)
+ * @param wave Pointer to the wave object
+ * @param frame_index Index for the first frame (group of samples)
+ * @param frame_count Number of frames requested
+ * @param view Receives a pointer to the first frame, valid until the wave is destroyed
+ * (for streamed waves only until the next call on the same wave)
+ * @returns number of frames available through [view], streamed waves stop at the end of a window
+*/
+size_t wave_get_samples_view(Wave *wave, uint64_t frame_index, size_t frame_count, const uint8_t **view)
+{
+    if (wave == NULL)
         return 0;
 
-    // endIndex - startIndex + 1 -> Offset(in Bytes) from the start
-    memcpy(buffer, wave->data + startIndex, endIndex - startIndex + 1);
+    if (wave->stream != NULL)
+    {
+        size_t frames_in_window;
+        *view = wave_stream_window_for(wave->stream, frame_index, &frames_in_window);
+        if (*view == NULL)
+            return 0;
+        return frame_count < frames_in_window ? frame_count : frames_in_window;
+    }
+
+    frame_count = wave_frames_in_reach(wave, frame_index, frame_count);
+    *view = frame_count > 0 ? wave->data + (size_t)frame_index * wave->header.block_align : NULL;
 
-    return frame_count * channels_number;
+    return frame_count;
 }
 
-/* ----------------------------------- AUXILIARY FUNCTIONS ----------------------------------- */
-
 /**
-* Extract the "Subchunk2Size" field from the header which represents the data size
-* @param wave Pointer to the wave object
-* @returns wave file data field size
+ * Wave Prefetch (Ask the kernel to start reading frames that will be needed soon)
+ * Returns immediately, the pages are read in the background
+ * @param wave Pointer to the wave object
+ * @param frame_index Index for the first frame
+ * @param frame_count Number of frames
 */
-static int wave_get_data_size(Wave *wave)
+void wave_prefetch(Wave *wave, uint64_t frame_index, size_t frame_count)
 {
-    if (strlen(wave->filepath) == 0)
-        return -1;
+    if (wave == NULL)
+        return;
+
+    frame_count = wave_frames_in_reach(wave, frame_index, frame_count);
+    if (frame_count == 0)
+        return;
 
-    return wave_extract_header_field(wave, 40, 4, true);
+    uint64_t offset = wave->header.data_offset + frame_index * wave->header.block_align;
+    uint64_t length = (uint64_t)frame_count * wave->header.block_align;
+
+    if (wave->stream != NULL)
+    {
+        posix_fadvise(wave->stream->fd, offset, length, POSIX_FADV_WILLNEED);
+    }
+    else if (wave->map != NULL)
+    {
+        // madvise wants a page aligned address
+        uint64_t page_size = sysconf(_SC_PAGESIZE);
+        uint64_t start = offset - offset % page_size;
+        madvise(wave->map + start, offset + length - start, MADV_WILLNEED);
+    }
 }
 
+/* ----------------------------------- WAVE STREAM FUNCTIONS ----------------------------------- */
+
 /**
-* Extract the value from a field in the header of a wave file
-* @param wave Pointer to the wave object
-* @param offset Offset from the beggining of the file to the field we wish to get the value from
-* @param field_size Size of the header field we wish to retrieve
-* @param little_endian Indicates if the field is in little-endian format or big-endian format
-* @returns the header field asked in the position [0 + offset; 0 + offset + field_size]
+ * Wave Probe
+ * Checks a file is a RIFF/WAVE file and decodes its header from the first bytes of the file, so files can be
+ * probed by the thousand with one read each. The chunks lying past [head] are read through [fd], the ones
+* after both the "fmt " and the "data" chunks are not indexed
+ * @param fd Descriptor of the file, read with positioned reads only (-1 to only look at [head])
+ * @param file_size Size of the file in bytes
+ * @param head First bytes of the file (WAVE_PROBE_SIZE of them are usually enough)
+ * @param head_size Number of bytes in [head]
+ * @param header Descriptor to fill with the decoded fields
+ * @returns 1 if the file is a valid RIFF/WAVE file or 0 if not (or if its header lies past [head] and [fd] is -1)
 */
-static int wave_extract_header_field(Wave *wave, const int offset, const int field_size, const bool little_endian)
+int wave_probe(int fd, uint64_t file_size, const uint8_t *head, size_t head_size, WaveHeader *header)
 {
-    uint8_t *buffer = (uint8_t *)malloc(field_size);
+    return wave_parse_chunks(fd, file_size, head, head_size, false, header);
+}
 
-    wav_read_bytes(wave->filepath, offset, field_size, buffer);
+/**
+ * Wave Stream Open
+ * Keeps a single file descriptor open and serves frames from two fixed size windows
+ * filled with positioned reads, so memory usage does not depend on the file size
+ * @param filename Name of the file to stream
+ * @returns pointer to the new stream or NULL if the file is not a valid wave file
+*/
+WaveStream *wave_stream_open(const char *filename)
+{
+    if (!regex_match(filename, "\\.wav$"))
+        return NULL;
 
-    int field = ConvertToInt(buffer, field_size, little_endian);
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    WaveStream *stream = (WaveStream *)calloc(1, sizeof(WaveStream));
+    if (stream == NULL)
+    {
+        printf("Out of memory!");
+        close(fd);
+        return NULL;
+    }
+    stream->fd = fd;
+
+    if (!wave_parse_header(fd, &stream->header) || stream->header.block_align == 0)
+    {
+        wave_stream_close(stream);
+        return NULL;
+    }
+
+    stream->frame_count = stream->header.data_size / stream->header.block_align;
+
+    // Windows hold whole frames so a frame never straddles two of them
+    stream->window_frames = WAVE_STREAM_WINDOW_SIZE / stream->header.block_align;
+    if (stream->window_frames == 0)
+        stream->window_frames = 1;
+
+    for (int i = 0; i < 2; i++)
+    {
+        stream->windows[i].first_frame = UINT64_MAX;
+        stream->windows[i].buffer = (uint8_t *)malloc(stream->window_frames * stream->header.block_align);
+        if (stream->windows[i].buffer == NULL)
+        {
+            printf("Out of memory!");
+            wave_stream_close(stream);
+            return NULL;
+        }
+    }
+
+    posix_fadvise(fd, stream->header.data_offset, stream->header.data_size, POSIX_FADV_SEQUENTIAL);
 
-    free(buffer);
-    return field;
+    return stream;
 }
 
 /**
-* Read Bytes from any file
-* @param filename Name of the file
-* @param start Number of offset bytes from the begging of the file
-* @param block_size Number of bytes to extract to the buffer
-* @param buffer Holds the bytes retrieved from the file
-* @returns number of bytes put inside the buffer
+ * Wave Stream Read Frames
+ * Copies frames starting at the current stream position and advances it
+ * @param stream Pointer to the stream object
+ * @param buffer Buffer where the frames will be stored
+ * @param frame_count Number of frames to read
+ * @returns number of frames read (fewer than [frame_count] at the end of the data chunk)
 */
-static size_t wav_read_bytes(const char *filename, size_t start, size_t block_size, uint8_t *buffer)
+size_t wave_stream_read_frames(WaveStream *stream, uint8_t *buffer, size_t frame_count)
 {
-    FILE *fp = fopen(filename, "r");
-    int iterations = start;
-    // Add [start] offset to file pointer (in Bytes)
-    while (iterations--)
+    size_t frame_size = stream->header.block_align;
+    size_t frames_read = 0;
+
+    while (frames_read < frame_count)
     {
-        fread(buffer, 1, 1, fp);
+        size_t frames_in_window;
+        const uint8_t *frames = wave_stream_window_for(stream, stream->frame_index, &frames_in_window);
+        if (frames == NULL)
+            break;
+
+        size_t frames_to_copy = frame_count - frames_read;
+        if (frames_to_copy > frames_in_window)
+            frames_to_copy = frames_in_window;
+
+        memcpy(buffer + frames_read * frame_size, frames, frames_to_copy * frame_size);
+        frames_read += frames_to_copy;
+        stream->frame_index += frames_to_copy;
     }
 
-    fread(buffer, 1, block_size, fp);
+    return frames_read;
+}
 
-    fclose(fp);
-    return block_size;
+/**
+ * Wave Stream Seek
+ * Moves the stream position, no I/O happens until the next read
+ * @param stream Pointer to the stream object
+ * @param frame_index Index of the next frame to read
+ * @returns 1 if [frame_index] is inside the data chunk or 0 if not
+*/
+int wave_stream_seek(WaveStream *stream, uint64_t frame_index)
+{
+    if (frame_index > stream->frame_count)
+        return 0;
+
+    stream->frame_index = frame_index;
+    return 1;
 }
 
 /**
-* Convert a little-endian/big-endian value spreaded in an array of 1 byte each position
-* @param value Bytes Array where the value is contained
-* @param bytesNum Number of Bytes inside the [value] array
-* @param littleEndian Indicates if the field is in little-endian format or big-endian format
-* @returns Value inside [value] converted to integer(2 Bytes(short int) or 4 Bytes(int))
+ * Wave Stream Close
+ * Closes the file descriptor and releases the stream windows
+ * @param stream Pointer to the stream object
 */
-static int ConvertToInt(uint8_t value[], int bytesNum, const bool littleEndian)
+void wave_stream_close(WaveStream *stream)
 {
-    if (littleEndian && bytesNum == 2)
+    if (stream == NULL)
+        return;
+    if (stream->fd != -1)
+        close(stream->fd);
+    free(stream->windows[0].buffer);
+    free(stream->windows[1].buffer);
+    free(stream);
+}
+
+/* ----------------------------------- AUXILIARY FUNCTIONS ----------------------------------- */
+
+/**
+* Stream Window For
+* Finds the window holding [frame_index], filling one with a positioned read if neither does.
+* The other window keeps the previous block (cheap small seeks backwards, like resuming after a pause)
+* while the kernel is asked to read ahead the block that comes next
+* @param stream Pointer to the stream object
+* @param frame_index Index of the wanted frame
+* @param frames_in_window Receives the number of frames from [frame_index] to the end of the window
+* @returns pointer to the frame inside the window or NULL if it is out of reach
+*/
+static const uint8_t *wave_stream_window_for(WaveStream *stream, uint64_t frame_index, size_t *frames_in_window)
+{
+    if (frame_index >= stream->frame_count)
+        return NULL;
+
+    size_t frame_size = stream->header.block_align;
+    uint64_t first_frame = frame_index - frame_index % stream->window_frames;
+
+    WaveStreamWindow *window = NULL;
+    for (int i = 0; i < 2; i++)
+        if (stream->windows[i].first_frame == first_frame)
+            window = &stream->windows[i];
+
+    if (window == NULL)
     {
-        short newValue = value[0] | (value[1] << 8);
-        return newValue;
+        // Replace the window that was not served last
+        window = &stream->windows[!stream->current];
+
+        size_t frames = stream->window_frames;
+        if (frames > stream->frame_count - first_frame)
+            frames = stream->frame_count - first_frame;
+
+        off_t offset = stream->header.data_offset + (off_t)first_frame * frame_size;
+        size_t bytes = wav_read_bytes(stream->fd, offset, frames * frame_size, window->buffer);
+        window->first_frame = first_frame;
+        window->frames = bytes / frame_size;
+
+        posix_fadvise(stream->fd, offset + bytes, stream->window_frames * frame_size, POSIX_FADV_WILLNEED);
     }
-    else if (littleEndian && bytesNum == 4)
+    stream->current = window - stream->windows;
+
+    if (frame_index - window->first_frame >= window->frames)
+        return NULL;
+
+    *frames_in_window = window->frames - (frame_index - window->first_frame);
+    return window->buffer + (frame_index - window->first_frame) * frame_size;
+}
+
+/**
+* Parse the header of a wave file
+* Walks every RIFF chunk once, indexing their payload offsets and sizes, decoding the "fmt " chunk
+* and locating the "data" chunk. RF64/BW64 files take their 64 bit sizes from the "ds64" chunk
+* @param fd Descriptor of the file, read with positioned reads only
+* @param header Descriptor to fill with the decoded fields
+* @returns 1 if the file is a valid RIFF/WAVE file or 0 if not
+*/
+static int wave_parse_header(int fd, WaveHeader *header)
+{
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1)
+        return 0;
+    return wave_parse_chunks(fd, statbuf.st_size, NULL, 0, true, header);
+}
+
+/**
+* Parse Chunks
+* Chunk walk of wave_parse_header, reading the bytes found in [head] from there and the others through [fd]
+* @param whole 'true' to walk every chunk, 'false' to stop once the format and the data chunk are known
+* @returns 1 if the file is a valid RIFF/WAVE file or 0 if not
+*/
+static int wave_parse_chunks(int fd, uint64_t file_size, const uint8_t *head, size_t head_size, bool whole, WaveHeader *header)
+{
+    uint8_t riff[12];
+    if (wave_head_read(fd, head, head_size, 0, sizeof(riff), riff) != sizeof(riff) || memcmp(riff + 8, "WAVE", 4) != 0)
+        return 0;
+
+    bool is_rf64 = memcmp(riff, "RF64", 4) == 0 || memcmp(riff, "BW64", 4) == 0;
+    if (!is_rf64 && memcmp(riff, "RIFF", 4) != 0)
+        return 0;
+
+    memset(header, 0, sizeof(WaveHeader));
+    uint64_t ds64_data_size = 0;
+    bool has_fmt = false, has_data = false;
+    uint64_t offset = sizeof(riff);
+    uint8_t chunk[8];
+    while (offset + sizeof(chunk) <= file_size && wave_head_read(fd, head, head_size, offset, sizeof(chunk), chunk) == sizeof(chunk))
     {
-        int newValue = (value[0] & 0xFF) | ((value[1] & 0xFF) << 8) | ((value[2] & 0xFF) << 16) | ((value[3] & 0xFF) << 24);
-        return newValue;
+        uint64_t chunk_size = ConvertToUInt32(chunk + 4);
+        offset += sizeof(chunk);
+
+        if (memcmp(chunk, "ds64", 4) == 0 && is_rf64)
+        {
+            // riffSize(8) dataSize(8) sampleCount(8)
+            uint8_t ds64[24];
+            if (chunk_size < sizeof(ds64) || wave_head_read(fd, head, head_size, offset, sizeof(ds64), ds64) != sizeof(ds64))
+                return 0;
+            ds64_data_size = ConvertToUInt64(ds64 + 8);
+        }
+        else if (memcmp(chunk, "fmt ", 4) == 0)
+        {
+            uint8_t fmt[40];
+            size_t fmt_size = chunk_size < sizeof(fmt) ? chunk_size : sizeof(fmt);
+            if (fmt_size < 16 || wave_head_read(fd, head, head_size, offset, fmt_size, fmt) != fmt_size)
+                return 0;
+            header->audio_format = ConvertToUInt16(fmt);
+            header->number_of_channels = ConvertToUInt16(fmt + 2);
+            header->sample_rate = ConvertToUInt32(fmt + 4);
+            header->byte_rate = ConvertToUInt32(fmt + 8);
+            header->bits_per_sample = ConvertToUInt16(fmt + 14);
+            header->valid_bits_per_sample = header->bits_per_sample;
+            // WAVE_FORMAT_EXTENSIBLE keeps the real format in the first 2 bytes of the SubFormat GUID
+            if (header->audio_format == WAVE_FORMAT_EXTENSIBLE && fmt_size >= 40)
+            {
+                header->valid_bits_per_sample = ConvertToUInt16(fmt + 18);
+                header->channel_mask = ConvertToUInt32(fmt + 20);
+                header->audio_format = ConvertToUInt16(fmt + 24);
+            }
+            // Bytes per frame (1 Frame is [number_of_channels] Samples)
+            header->block_align = (header->bits_per_sample + 7) / 8 * header->number_of_channels;
+            has_fmt = true;
+        }
+        else if (memcmp(chunk, "data", 4) == 0 && !has_data)
+        {
+            // RF64 marks sizes that do not fit in 32 bits with 0xFFFFFFFF
+            if (is_rf64 && chunk_size == 0xFFFFFFFF)
+                chunk_size = ds64_data_size;
+            // A truncated file (or a recorder that never patched the size) only exposes the samples it really holds
+            if (chunk_size > file_size - offset)
+                chunk_size = file_size - offset;
+            header->data_offset = offset;
+            header->data_size = chunk_size;
+            has_data = true;
+        }
+
+        wave_index_chunk(header, chunk, offset, chunk_size);
+
+        // Chunks are word aligned
+        offset += chunk_size + (chunk_size & 1);
+        if (!whole && has_fmt && has_data)
+            break;
     }
-    else if (!littleEndian && bytesNum == 2)
+    return has_fmt && has_data;
+}
+
+/**
+* Index Chunk
+* Appends a chunk to the header chunk index (chunks past WAVE_MAX_CHUNKS are walked but not indexed)
+* @param header Descriptor holding the index
+* @param id Four character chunk identifier
+* @param offset Offset of the chunk payload from the beggining of the file
+* @param size Size of the chunk payload
+*/
+static void wave_index_chunk(WaveHeader *header, const uint8_t id[4], uint64_t offset, uint64_t size)
+{
+    if (header->chunk_count == WAVE_MAX_CHUNKS)
+        return;
+
+    WaveChunk *entry = &header->chunks[header->chunk_count++];
+    memcpy(entry->id, id, 4);
+    entry->offset = offset;
+    entry->size = size;
+}
+
+/**
+* Frames In Reach
+* @param wave Pointer to the wave object
+* @param frame_index Index for the first frame
+* @param frame_count Number of frames requested
+* @returns how many of the [frame_count] frames starting at [frame_index] exist in the data chunk
+*/
+static size_t wave_frames_in_reach(Wave *wave, uint64_t frame_index, size_t frame_count)
+{
+    size_t frame_size = wave->header.block_align;
+    if (frame_size == 0)
+        return 0;
+
+    uint64_t total_frames = wave->data_size / frame_size;
+    if (frame_index >= total_frames)
+        return 0;
+
+    return frame_count > total_frames - frame_index ? total_frames - frame_index : frame_count;
+}
+
+/**
+* Read Bytes from any file with positioned reads (the file offset is never moved)
+* @param fd Descriptor of the file
+* @param start Number of offset bytes from the begging of the file
+* @param block_size Number of bytes to extract to the buffer
+* @param buffer Holds the bytes retrieved from the file
+* @returns number of bytes put inside the buffer
+*/
+static size_t wav_read_bytes(int fd, off_t start, size_t block_size, uint8_t *buffer)
+{
+    size_t total = 0;
+    while (total < block_size)
     {
-        short newValue = value[1] | (value[0] << 8);
-        return newValue;
+        ssize_t bytes = pread(fd, buffer + total, block_size - total, start + total);
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            break;
+        total += bytes;
     }
-    else if (!littleEndian && bytesNum == 4)
+    return total;
+}
+
+/**
+* Read Bytes from the first bytes of a file already in memory, or from the file when they lie past them
+* @param fd Descriptor of the file (-1 when only [head] may be read)
+* @param head First [head_size] bytes of the file (NULL if none)
+* @returns number of bytes put inside the buffer
+*/
+static size_t wave_head_read(int fd, const uint8_t *head, size_t head_size, uint64_t start, size_t block_size, uint8_t *buffer)
+{
+    if (start + block_size <= head_size)
     {
-        int newValue = (value[3] & 0xFF) | ((value[2] & 0xFF) << 8) | ((value[1] & 0xFF) << 16) | ((value[0] & 0xFF) << 24);
-        return newValue;
+        memcpy(buffer, head + start, block_size);
+        return block_size;
     }
-    return 0;
+    return fd == -1 ? 0 : wav_read_bytes(fd, start, block_size, buffer);
+}
+
+/**
+* Convert a little-endian 16 bit value spreaded in an array of 1 byte each position
+* @param value Bytes Array where the value is contained
+* @returns Value inside [value] converted to an unsigned 16 bit integer
+*/
+static uint16_t ConvertToUInt16(const uint8_t value[])
+{
+    return (uint16_t)(value[0] | (value[1] << 8));
+}
+
+/**
+* Convert a little-endian 32 bit value spreaded in an array of 1 byte each position
+* @param value Bytes Array where the value is contained
+* @returns Value inside [value] converted to an unsigned 32 bit integer
+*/
+static uint32_t ConvertToUInt32(const uint8_t value[])
+{
+    return (uint32_t)value[0] | ((uint32_t)value[1] << 8) | ((uint32_t)value[2] << 16) | ((uint32_t)value[3] << 24);
+}
+
+/**
+* Convert a little-endian 64 bit value spreaded in an array of 1 byte each position
+* @param value Bytes Array where the value is contained
+* @returns Value inside [value] converted to an unsigned 64 bit integer
+*/
+static uint64_t ConvertToUInt64(const uint8_t value[])
+{
+    return (uint64_t)ConvertToUInt32(value) | ((uint64_t)ConvertToUInt32(value + 4) << 32);
 }
 
 /**
@@ -233,6 +753,9 @@ static int ConvertToInt(uint8_t value[], int bytesNum, const bool littleEndian)
 static int regex_match(const char *string, const char *pattern)
 {
     regex_t regex;
-    regcomp(&regex, pattern, 0);
-    return !regexec(&regex, string, 0, NULL, 0);
+    if (regcomp(&regex, pattern, 0) != 0)
+        return 0;
+    int match = !regexec(&regex, string, 0, NULL, 0);
+    regfree(&regex);
+    return match;
 }
\ No newline at end of file
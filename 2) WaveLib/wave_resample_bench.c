@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "wavelib.h"
+
+// Seconds of stereo input pushed through every resampler
+#define BENCH_SECONDS 20
+// Input frames handed to wave_resampler_process per call (a playback period)
+#define BENCH_PERIOD 1024
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(int in_rate, int out_rate, WaveResampleQuality quality, const char *quality_name) {
+	const int channels = 2;
+	WaveResampler *resampler = wave_resampler_create(channels, in_rate, out_rate, quality);
+	if (resampler == NULL) {
+		fprintf(stderr, "wave_resampler_create(%d, %d) failed\n", in_rate, out_rate);
+		return;
+	}
+
+	int16_t in[BENCH_PERIOD * channels];
+	for (int i = 0; i < BENCH_PERIOD; i++)
+		in[i * channels] = in[i * channels + 1] = (int16_t)(16000 * sin(2 * M_PI * 1000.0 * i / in_rate));
+	size_t out_capacity = wave_resampler_output_frames(resampler, BENCH_PERIOD) + BENCH_PERIOD;
+	int16_t *out = (int16_t *)malloc(out_capacity * channels * sizeof(int16_t));
+
+	size_t periods = (size_t)in_rate * BENCH_SECONDS / BENCH_PERIOD;
+	size_t out_frames = 0;
+	double start = now();
+	for (size_t p = 0; p < periods; p++)
+		out_frames += wave_resampler_process(resampler, in, BENCH_PERIOD, out);
+	double elapsed = now() - start;
+
+	printf("%6d -> %6d  %-6s taps=%-4d phases=%-4d %12.0f frames/s  %7.1fx realtime\n",
+		in_rate, out_rate, quality_name, resampler->taps, resampler->phases,
+		out_frames / elapsed, (double)periods * BENCH_PERIOD / in_rate / elapsed);
+
+	free(out);
+	wave_resampler_destroy(resampler);
+}
+
+int main(int argc, char *argv[]) {
+	const int rates[][2] = { {44100, 48000}, {48000, 44100}, {22050, 48000}, {96000, 48000}, {192000, 48000} };
+	const char *names[] = { "fast", "medium", "best" };
+
+	printf("Stereo S16 throughput (%s dot product), output frames per second:\n\n", wave_convert_isa());
+	for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+		for (int q = WAVE_RESAMPLE_FAST; q <= WAVE_RESAMPLE_BEST; q++)
+			bench(rates[r][0], rates[r][1], (WaveResampleQuality)q, names[q]);
+	return 0;
+}
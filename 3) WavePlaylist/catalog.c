@@ -0,0 +1,1095 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "file_tree_foreach.h"
+
+#include "wavelib.h"
+
+#include "catalog.h"
+
+/*
+* Index file layout (host byte order, rebuilt from scratch when it does not check out):
+* header | directories | files | strings (NUL terminated paths, referenced by their offset)
+* The files of each directory are contiguous, so the files of a directory that did not change are
+* carried over as a block by a refresh. The rules of the scan are kept in the header: an index scanned with
+* other rules is not loaded.
+*/
+#define CATALOG_INDEX_MAGIC "WPINDEX3"
+
+typedef struct catalog_index_header {
+	char magic[8];
+	uint64_t root_offset;
+	uint64_t directory_count;
+	uint64_t file_count;
+	uint64_t strings_size;
+	// Rules of the scan (UINT64_MAX as the offset of the exclude patterns when there are none)
+	uint64_t exclude_offset;
+	uint64_t rule_flags;
+	uint64_t max_depth;
+	uint64_t min_size;
+	uint64_t max_size;
+} CatalogIndexHeader;
+
+typedef struct catalog_index_directory {
+	uint64_t path_offset;
+	int64_t mtime;
+	uint64_t first_file;
+	uint64_t file_count;
+} CatalogIndexDirectory;
+
+typedef struct catalog_index_file {
+	uint64_t path_offset;
+	uint64_t size;
+	int64_t mtime;
+	uint32_t sample_rate;
+	uint16_t channels;
+	uint16_t bits_per_sample;
+	uint64_t frame_count;
+} CatalogIndexFile;
+
+/* -- Private Functions -- */
+static int catalog_read_directory(Catalog *catalog, const char *dirpath, const char **known, size_t known_count);
+static int catalog_walk(Catalog *catalog, const char *root);
+static int catalog_walk_batch(const FileTreeEntry *directory, const FileTreeEntry *entries, size_t count, void *user);
+static int catalog_rules_equal(const CatalogRules *a, const CatalogRules *b);
+static int catalog_add_directory(Catalog *catalog, const char *path, int64_t mtime);
+static int catalog_add_file(Catalog *catalog, const char *path, uint64_t size, int64_t mtime, const CatalogFormat *format);
+static void catalog_probe_entries(const FileTreeEntry *entries, size_t count, CatalogFormat *formats);
+static int catalog_probe_file(int fd, uint64_t size, CatalogFormat *format);
+static const char *catalog_intern(Catalog *catalog, const char *path);
+static int catalog_arena_rebuild(Catalog *catalog);
+static void catalog_path_free(Catalog *catalog, const char *path);
+static void catalog_clear(Catalog *catalog);
+static void catalog_compact(Catalog *catalog, const uint8_t *removed);
+static int is_inside(const char *path, const char *dirpath, size_t dirpath_length);
+static int is_mapped(const Catalog *catalog, const char *path);
+static void *catalog_scan_run(void *arg);
+static int catalog_map_index(Catalog *catalog, const char *filepath);
+static int catalog_write_index(Catalog *catalog, const char *filepath);
+static int catalog_publish(Catalog *catalog, int force);
+static int compare_names(const void *a, const void *b, void *files);
+static int compare_paths(const void *a, const void *b);
+static int64_t stat_mtime(const struct stat *statbuf);
+
+/**
+* Catalog Create
+* @returns pointer to a new empty catalog or NULL if there was no memory
+*/
+Catalog *catalog_create()
+{
+	Catalog *catalog = (Catalog *)calloc(1, sizeof(Catalog));
+	if (catalog == NULL)
+		return NULL;
+	catalog->pattern = file_tree_pattern_compile(CATALOG_PATTERN, 0);
+	if (catalog->pattern == NULL) {
+		free(catalog);
+		return NULL;
+	}
+	pthread_mutex_init(&catalog->lock, NULL);
+	return catalog;
+}
+
+/**
+* Catalog Set Rules
+* Changes what the next scans leave out. The catalog is emptied when the rules change, the next scan
+* walks its root from scratch. Not to be called while a scan or a watcher changes the catalog
+* @param rules Rules to copy (NULL for none: every directory is walked and every wave file kept)
+* @returns 0 or -1 if there was no memory (the rules are left as they were)
+*/
+int catalog_set_rules(Catalog *catalog, const CatalogRules *rules)
+{
+	CatalogRules wanted = { NULL, 0, 0, 0, 0 };
+	if (rules != NULL)
+		wanted = *rules;
+	// Other flags are the catalog's business
+	wanted.flags &= FILE_TREE_ONE_FILE_SYSTEM | FILE_TREE_SKIP_HIDDEN | CATALOG_PROBE;
+	if (catalog_rules_equal(&catalog->rules, &wanted))
+		return 0;
+
+	char *exclude = NULL;
+	FileTreePattern *pattern = NULL;
+	if (wanted.exclude != NULL && *wanted.exclude != '\0') {
+		exclude = strdup(wanted.exclude);
+		pattern = exclude != NULL ? file_tree_pattern_compile(exclude, 0) : NULL;
+		if (pattern == NULL) {
+			free(exclude);
+			return -1;
+		}
+	}
+	pthread_mutex_lock(&catalog->lock);
+	catalog_clear(catalog);
+	free((char *)catalog->rules.exclude);
+	file_tree_pattern_destroy(catalog->exclude);
+	catalog->rules = wanted;
+	catalog->rules.exclude = exclude;
+	catalog->exclude = pattern;
+	pthread_mutex_unlock(&catalog->lock);
+	return 0;
+}
+
+/**
+* Catalog Scan
+* Walks [root] looking for wave files. Scanning the root the catalog already holds only rescans
+* the directories whose modification time changed since (see catalog_refresh).
+* The files found are listed in batches, so the catalog can be read by other threads during the walk
+* @param root Directory to scan
+* @returns 0, or -1 if [root] could not be read or the scan was cancelled
+*/
+int catalog_scan(Catalog *catalog, const char *root)
+{
+	// "/home/" and "/home" are the same root
+	size_t length = strlen(root);
+	while (length > 1 && root[length - 1] == '/')
+		length--;
+
+	int result = -1;
+	if (catalog->root != NULL && strlen(catalog->root) == length && strncmp(catalog->root, root, length) == 0) {
+		result = catalog_refresh(catalog);
+	}
+	else {
+		pthread_mutex_lock(&catalog->lock);
+		catalog_clear(catalog);
+		catalog->root = strndup(root, length);
+		pthread_mutex_unlock(&catalog->lock);
+		if (catalog->root != NULL && catalog_walk(catalog, catalog->root) == 0)
+			result = catalog_publish(catalog, 1);
+	}
+
+	// A walk cut short left directories unread under directories that look up to date:
+	// without a root, the next scan walks everything again (and the catalog is not saved)
+	if (result < 0 || atomic_load(&catalog->cancelled)) {
+		pthread_mutex_lock(&catalog->lock);
+		free(catalog->root);
+		catalog->root = NULL;
+		pthread_mutex_unlock(&catalog->lock);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+* Catalog Scan Start
+* Runs catalog_scan on its own thread. The catalog is read holding its lock meanwhile, and must not be
+* changed by anything else until catalog_scan_wait
+* @param root Directory to scan
+* @returns pointer to the running scan or NULL if the thread could not be started
+*/
+CatalogScan *catalog_scan_start(Catalog *catalog, const char *root)
+{
+	CatalogScan *scan = (CatalogScan *)calloc(1, sizeof(CatalogScan));
+	if (scan == NULL)
+		return NULL;
+	scan->catalog = catalog;
+	scan->root = strdup(root);
+	if (scan->root == NULL || pthread_create(&scan->thread, NULL, catalog_scan_run, scan) != 0) {
+		free(scan->root);
+		free(scan);
+		return NULL;
+	}
+	return scan;
+}
+
+/**
+* Catalog Scan Finished
+* @returns '1' if the scan is over (catalog_scan_wait returns at once) or '0' if it is still walking
+*/
+int catalog_scan_finished(CatalogScan *scan)
+{
+	return atomic_load(&scan->finished);
+}
+
+/**
+* Catalog Scan Cancel
+* Stops the walk as soon as possible, the files found so far stay in the catalog
+*/
+void catalog_scan_cancel(CatalogScan *scan)
+{
+	atomic_store(&scan->catalog->cancelled, 1);
+}
+
+/**
+* Catalog Scan Wait
+* Waits for the end of the scan and frees it
+* @returns the result of catalog_scan
+*/
+int catalog_scan_wait(CatalogScan *scan)
+{
+	pthread_join(scan->thread, NULL);
+	atomic_store(&scan->catalog->cancelled, 0);
+	int result = scan->result;
+	free(scan->root);
+	free(scan);
+	return result;
+}
+
+/**
+* Catalog Refresh
+* Brings the catalog up to date with one stat per known directory: directories that did not change keep
+* their files, changed ones are read again (new subdirectories are walked) and missing ones are dropped.
+* Files rewritten in place do not change their directory and keep their old size and time
+* @returns 0 or -1 if there was no memory
+*/
+int catalog_refresh(Catalog *catalog)
+{
+	// Only the thread changing the catalog gets here, it reads the records without the lock
+	char **changed = (char **)malloc((catalog->directory_count + 1) * sizeof(char *));
+	if (changed == NULL)
+		return -1;
+	size_t changed_count = 0;
+	for (size_t i = 0; i < catalog->directory_count && !atomic_load(&catalog->cancelled); i++)
+	{
+		struct stat statbuf;
+		if (stat(catalog->directories[i].path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode) &&
+			stat_mtime(&statbuf) == catalog->directories[i].mtime)
+			continue;
+		// Copied, the update drops the record (and may move the paths of the others)
+		if ((changed[changed_count] = strdup(catalog->directories[i].path)) != NULL)
+			changed_count++;
+	}
+
+	size_t first_read;
+	int result = catalog_update_directories(catalog, (const char **)changed, changed_count, &first_read);
+	for (size_t i = 0; i < changed_count; i++)
+		free(changed[i]);
+	free(changed);
+	return result;
+}
+
+/**
+* Catalog Update Directories
+* Makes the catalog agree with what is at [dirpaths] now, without walking anything else: each path is listed
+* again (its new subdirectories are walked), or dropped with everything under it when it is no longer a directory
+* @param dirpaths Directories that changed (duplicates are fine)
+* @param count Number of [dirpaths]
+* @param first_read Set to the index of the first directory record read by the update (the records from there
+* to the end of [directories] are the directories that were listed)
+* @returns 0 or -1 if there was no memory (the catalog is then left without some of [dirpaths])
+*/
+int catalog_update_directories(Catalog *catalog, const char **dirpaths, size_t count, size_t *first_read)
+{
+	if (count == 0) {
+		*first_read = catalog->directory_count;
+		return 0;
+	}
+	uint8_t *removed = (uint8_t *)calloc(catalog->directory_count + 1, 1);
+	const char **changed = (const char **)malloc((count + 1) * sizeof(char *));
+	if (removed == NULL || changed == NULL) {
+		free(removed);
+		free(changed);
+		*first_read = catalog->directory_count;
+		return -1;
+	}
+
+	// The records of the changed directories go first, so the ones read again land after [first_read]
+	size_t changed_count = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		struct stat statbuf;
+		int exists = stat(dirpaths[i], &statbuf) == 0 && S_ISDIR(statbuf.st_mode);
+		size_t length = strlen(dirpaths[i]);
+		for (size_t j = 0; j < catalog->directory_count; j++)
+			if (strcmp(catalog->directories[j].path, dirpaths[i]) == 0 ||
+				(!exists && is_inside(catalog->directories[j].path, dirpaths[i], length)))
+				removed[j] = 1;
+		if (exists)
+			changed[changed_count++] = dirpaths[i];
+	}
+	catalog_compact(catalog, removed);
+	free(removed);
+	*first_read = catalog->directory_count;
+
+	const char **known = (const char **)malloc((catalog->directory_count + 1) * sizeof(char *));
+	if (known == NULL) {
+		free(changed);
+		catalog_publish(catalog, 1);
+		return -1;
+	}
+	size_t known_count = catalog->directory_count;
+	for (size_t i = 0; i < known_count; i++)
+		known[i] = catalog->directories[i].path;
+	qsort(known, known_count, sizeof(char *), compare_paths);
+
+	// Parents are listed before their subdirectories, which they may walk
+	qsort(changed, changed_count, sizeof(char *), compare_paths);
+	for (size_t i = 0; i < changed_count && !atomic_load(&catalog->cancelled); i++)
+	{
+		// Already walked as a new subdirectory of another changed directory (or listed twice)
+		int listed = 0;
+		for (size_t j = *first_read; j < catalog->directory_count && !listed; j++)
+			listed = strcmp(catalog->directories[j].path, changed[i]) == 0;
+		if (listed)
+			continue;
+
+		catalog_read_directory(catalog, changed[i], known, known_count);
+	}
+	free(known);
+	free(changed);
+	return catalog_publish(catalog, 1);
+}
+
+/**
+* Catalog Load
+* Maps an index written by catalog_save. The paths are used in place, straight from the mapping
+* @param filepath Path of the index file
+* @returns 0 or -1 if the file is missing or does not check out (the catalog is left empty)
+*/
+int catalog_load(Catalog *catalog, const char *filepath)
+{
+	pthread_mutex_lock(&catalog->lock);
+	int result = catalog_map_index(catalog, filepath);
+	pthread_mutex_unlock(&catalog->lock);
+	if (result < 0)
+		return -1;
+	return catalog_publish(catalog, 1);
+}
+
+/**
+* Catalog Save
+* Writes the index to a temporary file renamed over [filepath], a crash never leaves half an index
+* @returns 0 or -1 if the index could not be written (or the catalog is not a complete scan)
+*/
+int catalog_save(Catalog *catalog, const char *filepath)
+{
+	pthread_mutex_lock(&catalog->lock);
+	int result = catalog_write_index(catalog, filepath);
+	pthread_mutex_unlock(&catalog->lock);
+	return result;
+}
+
+/**
+* Catalog Size
+* @returns number of wave files in the listing (a walk running may have found more)
+*/
+size_t catalog_size(Catalog *catalog)
+{
+	return catalog->order_count;
+}
+
+/**
+* Catalog Get
+* @param index Position of the file in the listing (files sorted by name)
+* @returns the file or NULL if [index] is out of range
+*/
+const CatalogFile *catalog_get(Catalog *catalog, size_t index)
+{
+	if (index >= catalog->order_count)
+		return NULL;
+	return &catalog->files[catalog->order[index]];
+}
+
+/**
+* Catalog Destroy
+* @param catalog Pointer to the catalog object to free
+*/
+void catalog_destroy(Catalog *catalog)
+{
+	if (catalog == NULL)
+		return;
+	catalog_clear(catalog);
+	file_tree_pattern_destroy(catalog->pattern);
+	file_tree_pattern_destroy(catalog->exclude);
+	free((char *)catalog->rules.exclude);
+	pthread_mutex_destroy(&catalog->lock);
+	free(catalog);
+}
+
+/* ----------------------------------- AUXILIARY FUNCTIONS ----------------------------------- */
+
+/**
+* Scan thread
+*/
+static void *catalog_scan_run(void *arg)
+{
+	CatalogScan *scan = (CatalogScan *)arg;
+	scan->result = catalog_scan(scan->catalog, scan->root);
+	atomic_store(&scan->finished, 1);
+	return NULL;
+}
+
+/**
+* Map an index file and point the records at it (catalog locked)
+* @returns 0 or -1 if the file is missing or does not check out (the catalog is left empty)
+*/
+static int catalog_map_index(Catalog *catalog, const char *filepath)
+{
+	catalog_clear(catalog);
+	int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == -1 || statbuf.st_size < (off_t)sizeof(CatalogIndexHeader)) {
+		close(fd);
+		return -1;
+	}
+	uint8_t *map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	catalog->map = map;
+	catalog->map_size = statbuf.st_size;
+
+	CatalogIndexHeader header;
+	memcpy(&header, map, sizeof(header));
+	uint64_t records_size = header.directory_count * sizeof(CatalogIndexDirectory) + header.file_count * sizeof(CatalogIndexFile);
+	if (memcmp(header.magic, CATALOG_INDEX_MAGIC, 8) != 0 ||
+		header.directory_count > catalog->map_size || header.file_count > catalog->map_size ||
+		sizeof(header) + records_size + header.strings_size != catalog->map_size ||
+		header.strings_size == 0 || header.root_offset >= header.strings_size ||
+		(header.exclude_offset != UINT64_MAX && header.exclude_offset >= header.strings_size))
+	{
+		catalog_clear(catalog);
+		return -1;
+	}
+	const CatalogIndexDirectory *index_directories = (const CatalogIndexDirectory *)(map + sizeof(header));
+	const CatalogIndexFile *index_files = (const CatalogIndexFile *)(index_directories + header.directory_count);
+	const char *strings = (const char *)(index_files + header.file_count);
+	// Every offset below [strings_size] is then a terminated string
+	if (strings[header.strings_size - 1] != '\0') {
+		catalog_clear(catalog);
+		return -1;
+	}
+	// Scanned with other rules, it may lack files the rules keep now (or hold files they leave out)
+	CatalogRules rules = { header.exclude_offset != UINT64_MAX ? strings + header.exclude_offset : NULL,
+		(int)header.rule_flags, header.max_depth, header.min_size, header.max_size };
+	if (!catalog_rules_equal(&catalog->rules, &rules)) {
+		catalog_clear(catalog);
+		return -1;
+	}
+
+	catalog->directories = (CatalogDirectory *)malloc((header.directory_count + 1) * sizeof(CatalogDirectory));
+	catalog->files = (CatalogFile *)malloc((header.file_count + 1) * sizeof(CatalogFile));
+	catalog->root = strdup(strings + header.root_offset);
+	if (catalog->directories == NULL || catalog->files == NULL || catalog->root == NULL) {
+		catalog_clear(catalog);
+		return -1;
+	}
+	catalog->directory_capacity = header.directory_count + 1;
+	catalog->file_capacity = header.file_count + 1;
+
+	uint64_t files_seen = 0;
+	for (uint64_t i = 0; i < header.directory_count; i++)
+	{
+		// The files of each directory follow the files of the previous one
+		const CatalogIndexDirectory *index_directory = &index_directories[i];
+		if (index_directory->path_offset >= header.strings_size || index_directory->first_file != files_seen ||
+			index_directory->file_count > header.file_count - files_seen)
+		{
+			catalog_clear(catalog);
+			return -1;
+		}
+		CatalogDirectory directory = { strings + index_directory->path_offset, index_directory->mtime,
+			index_directory->first_file, index_directory->file_count };
+		catalog->directories[catalog->directory_count++] = directory;
+		files_seen += index_directory->file_count;
+	}
+	for (uint64_t i = 0; i < header.file_count; i++)
+	{
+		if (files_seen != header.file_count || index_files[i].path_offset >= header.strings_size) {
+			catalog_clear(catalog);
+			return -1;
+		}
+		CatalogFormat format = { index_files[i].sample_rate, index_files[i].channels, index_files[i].bits_per_sample,
+			index_files[i].frame_count };
+		CatalogFile file = { strings + index_files[i].path_offset, index_files[i].size, index_files[i].mtime, format };
+		catalog->files[catalog->file_count++] = file;
+	}
+	return 0;
+}
+
+/**
+* Write the records to a temporary file renamed over [filepath] (catalog locked)
+*/
+static int catalog_write_index(Catalog *catalog, const char *filepath)
+{
+	if (catalog->root == NULL)
+		return -1;
+
+	char temporary[strlen(filepath) + 5];
+	snprintf(temporary, sizeof(temporary), "%s.tmp", filepath);
+	FILE *file = fopen(temporary, "wb");
+	if (file == NULL)
+		return -1;
+
+	CatalogIndexHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CATALOG_INDEX_MAGIC, 8);
+	header.directory_count = catalog->directory_count;
+	header.file_count = catalog->file_count;
+	header.strings_size = strlen(catalog->root) + 1;
+	header.exclude_offset = UINT64_MAX;
+	if (catalog->rules.exclude != NULL) {
+		header.exclude_offset = header.strings_size;
+		header.strings_size += strlen(catalog->rules.exclude) + 1;
+	}
+	header.rule_flags = catalog->rules.flags;
+	header.max_depth = catalog->rules.max_depth;
+	header.min_size = catalog->rules.min_size;
+	header.max_size = catalog->rules.max_size;
+	// Strings go in the order of the records: root, exclude patterns, directories, files
+	uint64_t offset = header.strings_size;
+	for (size_t i = 0; i < catalog->directory_count; i++)
+		header.strings_size += strlen(catalog->directories[i].path) + 1;
+	for (size_t i = 0; i < catalog->file_count; i++)
+		header.strings_size += strlen(catalog->files[i].path) + 1;
+	fwrite(&header, sizeof(header), 1, file);
+
+	for (size_t i = 0; i < catalog->directory_count; i++)
+	{
+		CatalogIndexDirectory record = { offset, catalog->directories[i].mtime,
+			catalog->directories[i].first_file, catalog->directories[i].file_count };
+		fwrite(&record, sizeof(record), 1, file);
+		offset += strlen(catalog->directories[i].path) + 1;
+	}
+	for (size_t i = 0; i < catalog->file_count; i++)
+	{
+		const CatalogFormat *format = &catalog->files[i].format;
+		CatalogIndexFile record = { offset, catalog->files[i].size, catalog->files[i].mtime, format->sample_rate,
+			format->channels, format->bits_per_sample, format->frame_count };
+		fwrite(&record, sizeof(record), 1, file);
+		offset += strlen(catalog->files[i].path) + 1;
+	}
+	fwrite(catalog->root, strlen(catalog->root) + 1, 1, file);
+	if (catalog->rules.exclude != NULL)
+		fwrite(catalog->rules.exclude, strlen(catalog->rules.exclude) + 1, 1, file);
+	for (size_t i = 0; i < catalog->directory_count; i++)
+		fwrite(catalog->directories[i].path, strlen(catalog->directories[i].path) + 1, 1, file);
+	for (size_t i = 0; i < catalog->file_count; i++)
+		fwrite(catalog->files[i].path, strlen(catalog->files[i].path) + 1, 1, file);
+
+	int failed = ferror(file);
+	if (fclose(file) != 0 || failed || rename(temporary, filepath) == -1) {
+		unlink(temporary);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+* Add a directory and the wave files directly in it, then walk its unknown subdirectories
+* @param dirpath Path of the directory (the record gets its own copy)
+* @param known Sorted paths of the directories that are refreshed on their own (NULL to walk every subdirectory)
+* @returns 0 if the directory was added or -1 if not
+*/
+static int catalog_read_directory(Catalog *catalog, const char *dirpath, const char **known, size_t known_count)
+{
+	int dirfd = open(dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat statbuf;
+	if (dirfd == -1 || fstat(dirfd, &statbuf) == -1) {
+		if (dirfd != -1)
+			close(dirfd);
+		return -1;
+	}
+	DIR *dir = fdopendir(dirfd);
+	if (dir == NULL) {
+		close(dirfd);
+		return -1;
+	}
+	// The same rules as the walk of the root: levels below it and mount points
+	const CatalogRules *rules = &catalog->rules;
+	// A root ending in '/' ("/") holds the separator of its first level
+	size_t root_length = strlen(catalog->root);
+	const char *c = dirpath + root_length;
+	size_t depth = *c != '\0' && root_length > 0 && catalog->root[root_length - 1] == '/';
+	for (; *c != '\0'; c++)
+		depth += *c == '/';
+	size_t max_depth = rules->max_depth > 0 ? rules->max_depth : FILE_TREE_MAX_DEPTH;
+	int walk_subdirectories = depth + 1 < max_depth;
+	dev_t device = statbuf.st_dev;
+
+	pthread_mutex_lock(&catalog->lock);
+	int added = catalog_add_directory(catalog, dirpath, stat_mtime(&statbuf));
+	pthread_mutex_unlock(&catalog->lock);
+	if (added < 0) {
+		closedir(dir);
+		return -1;
+	}
+	if (catalog->directory_opened != NULL)
+		catalog->directory_opened(catalog->directory_context, dirpath);
+	size_t directory_index = catalog->directory_count - 1;
+
+	// Subdirectories are walked once this directory is closed, so its files stay contiguous
+	char **subdirectories = NULL;
+	size_t subdirectory_count = 0, subdirectory_capacity = 0;
+	size_t dirpath_length = strlen(dirpath);
+	// "/" is not followed by a second separator
+	size_t separator = dirpath_length > 0 && dirpath[dirpath_length - 1] != '/';
+	// Paths of the entries are put together here, only subdirectories get a copy
+	char *path = NULL;
+	size_t path_capacity = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		if ((rules->flags & FILE_TREE_SKIP_HIDDEN) && entry->d_name[0] == '.')
+			continue;
+
+		size_t name_length = strlen(entry->d_name);
+		int matches = file_tree_pattern_match(catalog->pattern, entry->d_name, name_length);
+		if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN && !matches)
+			continue;
+		if (fstatat(dirfd, entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+
+		if (dirpath_length + separator + name_length + 1 > path_capacity) {
+			size_t capacity = dirpath_length + separator + name_length + 1 + 256;
+			char *grown = realloc(path, capacity);
+			if (grown == NULL)
+				continue;
+			path = grown;
+			path_capacity = capacity;
+		}
+		memcpy(path, dirpath, dirpath_length);
+		path[dirpath_length] = '/';
+		memcpy(path + dirpath_length + separator, entry->d_name, name_length + 1);
+
+		if (S_ISDIR(statbuf.st_mode) && walk_subdirectories &&
+			(catalog->exclude == NULL || !file_tree_pattern_match(catalog->exclude, entry->d_name, name_length)) &&
+			(!(rules->flags & FILE_TREE_ONE_FILE_SYSTEM) || statbuf.st_dev == device) &&
+			(known == NULL || bsearch(&path, known, known_count, sizeof(char *), compare_paths) == NULL))
+		{
+			if (subdirectory_count == subdirectory_capacity) {
+				size_t capacity = subdirectory_capacity == 0 ? 16 : subdirectory_capacity * 2;
+				char **grown = realloc(subdirectories, capacity * sizeof(char *));
+				if (grown == NULL)
+					continue;
+				subdirectories = grown;
+				subdirectory_capacity = capacity;
+			}
+			if ((subdirectories[subdirectory_count] = strdup(path)) != NULL)
+				subdirectory_count++;
+		}
+		else if (S_ISREG(statbuf.st_mode) && matches &&
+			(rules->min_size == 0 || (uint64_t)statbuf.st_size >= rules->min_size) &&
+			(rules->max_size == 0 || (uint64_t)statbuf.st_size <= rules->max_size))
+		{
+			// Probed before taking the lock, readers are not held up by the read
+			CatalogFormat format = { 0, 0, 0, 0 };
+			if (rules->flags & CATALOG_PROBE) {
+				int fd = openat(dirfd, entry->d_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+				int probed = fd != -1 && catalog_probe_file(fd, statbuf.st_size, &format);
+				if (fd != -1)
+					close(fd);
+				if (!probed)
+					continue;
+			}
+			pthread_mutex_lock(&catalog->lock);
+			if (catalog_add_file(catalog, path, statbuf.st_size, stat_mtime(&statbuf), &format) == 0)
+				catalog->directories[directory_index].file_count++;
+			pthread_mutex_unlock(&catalog->lock);
+		}
+	}
+	closedir(dir);
+	free(path);
+	catalog_publish(catalog, 0);
+
+	for (size_t i = 0; i < subdirectory_count; i++)
+	{
+		if (!atomic_load(&catalog->cancelled))
+			catalog_read_directory(catalog, subdirectories[i], known, known_count);
+		free(subdirectories[i]);
+	}
+	free(subdirectories);
+	return 0;
+}
+
+/**
+* Walk a new root: its directories are read by a pool of workers, each one handed over with all of its files
+* @returns 0 or -1 if [root] could not be read
+*/
+static int catalog_walk(Catalog *catalog, const char *root)
+{
+	// The hook wants to hear of every directory before it is listed, which only the reads of this file do
+	if (catalog->directory_opened != NULL)
+		return catalog_read_directory(catalog, root, NULL, 0);
+	int flags = FILE_TREE_STAT | FILE_TREE_DIRECTORIES | FILE_TREE_QUIET | (catalog->rules.flags & ~CATALOG_PROBE);
+	FileTreeOptions options = { CATALOG_PATTERN, flags, 0,
+		catalog->rules.max_depth, 0, catalog->rules.exclude, catalog->rules.min_size, catalog->rules.max_size };
+	return file_tree_walk_parallel(root, &options, catalog_walk_batch, catalog, CATALOG_WALK_THREADS) < 0 ? -1 : 0;
+}
+
+/**
+* Add a directory of a walk and its wave files (called concurrently by the workers of the walk, which probe
+* the files of their directories in parallel)
+* @returns FILE_TREE_STOP once the scan was cancelled or FILE_TREE_CONTINUE
+*/
+static int catalog_walk_batch(const FileTreeEntry *directory, const FileTreeEntry *entries, size_t count, void *user)
+{
+	Catalog *catalog = (Catalog *)user;
+	if (atomic_load(&catalog->cancelled))
+		return FILE_TREE_STOP;
+	int probe = catalog->rules.flags & CATALOG_PROBE;
+	CatalogFormat *formats = probe ? (CatalogFormat *)malloc((count + 1) * sizeof(CatalogFormat)) : NULL;
+	if (probe && formats == NULL)
+		return FILE_TREE_CONTINUE;
+	// Read before taking the lock, readers are not held up by the reads
+	if (probe)
+		catalog_probe_entries(entries, count, formats);
+
+	pthread_mutex_lock(&catalog->lock);
+	if (catalog_add_directory(catalog, directory->path, directory->mtime) < 0) {
+		pthread_mutex_unlock(&catalog->lock);
+		free(formats);
+		return FILE_TREE_CONTINUE;
+	}
+	CatalogDirectory *record = &catalog->directories[catalog->directory_count - 1];
+	CatalogFormat none = { 0, 0, 0, 0 };
+	for (size_t i = 0; i < count; i++)
+	{
+		// Not a wave file if its probe found no channels
+		if (entries[i].type != DT_REG || (probe && formats[i].channels == 0))
+			continue;
+		if (catalog_add_file(catalog, entries[i].path, entries[i].size, entries[i].mtime, probe ? &formats[i] : &none) == 0)
+			record->file_count++;
+	}
+	pthread_mutex_unlock(&catalog->lock);
+	free(formats);
+	catalog_publish(catalog, 0);
+	return FILE_TREE_CONTINUE;
+}
+
+/**
+* Append a directory (its files are appended right after it)
+* @param path Path of the directory (interned by the catalog)
+* @returns 0 or -1 if there was no memory
+*/
+static int catalog_add_directory(Catalog *catalog, const char *path, int64_t mtime)
+{
+	if ((path = catalog_intern(catalog, path)) == NULL)
+		return -1;
+	if (catalog->directory_count == catalog->directory_capacity) {
+		size_t capacity = catalog->directory_capacity == 0 ? 64 : catalog->directory_capacity * 2;
+		CatalogDirectory *directories = realloc(catalog->directories, capacity * sizeof(CatalogDirectory));
+		if (directories == NULL)
+			return -1;
+		catalog->directories = directories;
+		catalog->directory_capacity = capacity;
+	}
+	CatalogDirectory directory = { path, mtime, catalog->file_count, 0 };
+	catalog->directories[catalog->directory_count++] = directory;
+	return 0;
+}
+
+/**
+* Append a file to the last directory added
+* @param path Path of the file (interned by the catalog)
+* @returns 0 or -1 if there was no memory
+*/
+static int catalog_add_file(Catalog *catalog, const char *path, uint64_t size, int64_t mtime, const CatalogFormat *format)
+{
+	if ((path = catalog_intern(catalog, path)) == NULL)
+		return -1;
+	if (catalog->file_count == catalog->file_capacity) {
+		size_t capacity = catalog->file_capacity == 0 ? 256 : catalog->file_capacity * 2;
+		CatalogFile *files = realloc(catalog->files, capacity * sizeof(CatalogFile));
+		if (files == NULL)
+			return -1;
+		catalog->files = files;
+		catalog->file_capacity = capacity;
+	}
+	CatalogFile file = { path, size, mtime, *format };
+	catalog->files[catalog->file_count++] = file;
+	return 0;
+}
+
+/**
+* Probe the regular files of a walk batch. They are opened a group at a time and the first bytes of the whole
+* group are requested before any is read, so the reads of a directory that is not cached overlap
+* @param formats Set to the format of each entry (all 0 for the entries that are not wave files)
+*/
+static void catalog_probe_entries(const FileTreeEntry *entries, size_t count, CatalogFormat *formats)
+{
+	memset(formats, 0, count * sizeof(CatalogFormat));
+	int fds[CATALOG_PROBE_BATCH];
+	for (size_t first = 0; first < count; first += CATALOG_PROBE_BATCH)
+	{
+		size_t group = count - first < CATALOG_PROBE_BATCH ? count - first : CATALOG_PROBE_BATCH;
+		for (size_t i = 0; i < group; i++)
+		{
+			const FileTreeEntry *entry = &entries[first + i];
+			fds[i] = entry->type == DT_REG ? open(entry->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW) : -1;
+			if (fds[i] != -1)
+				posix_fadvise(fds[i], 0, WAVE_PROBE_SIZE, POSIX_FADV_WILLNEED);
+		}
+		for (size_t i = 0; i < group; i++)
+		{
+			if (fds[i] == -1)
+				continue;
+			catalog_probe_file(fds[i], entries[first + i].size, &formats[first + i]);
+			close(fds[i]);
+		}
+	}
+}
+
+/**
+* Read the header of a candidate, from its first WAVE_PROBE_SIZE bytes most of the time
+* @param size Size of the file in bytes
+* @returns 1 if it is a wave file that can be played ([format] is filled) or 0 if not
+*/
+static int catalog_probe_file(int fd, uint64_t size, CatalogFormat *format)
+{
+	uint8_t head[WAVE_PROBE_SIZE];
+	ssize_t head_size = pread(fd, head, sizeof(head), 0);
+	WaveHeader header;
+	if (head_size <= 0 || !wave_probe(fd, size, head, head_size, &header) ||
+		header.sample_rate == 0 || header.number_of_channels == 0 || header.block_align == 0)
+		return 0;
+	format->sample_rate = header.sample_rate;
+	format->channels = header.number_of_channels;
+	format->bits_per_sample = header.bits_per_sample;
+	format->frame_count = header.data_size / header.block_align;
+	return 1;
+}
+
+/**
+* Copy a path to the arena (catalog locked). A path that could not be recorded is simply left as garbage
+* @returns the copy or NULL if there was no memory
+*/
+static const char *catalog_intern(Catalog *catalog, const char *path)
+{
+	size_t size = strlen(path) + 1;
+	CatalogBlock *block = catalog->blocks;
+	if (block == NULL || block->size - block->used < size) {
+		size_t block_size = size > CATALOG_ARENA_BLOCK ? size : CATALOG_ARENA_BLOCK;
+		if ((block = (CatalogBlock *)malloc(sizeof(CatalogBlock) + block_size)) == NULL)
+			return NULL;
+		block->size = block_size;
+		block->used = 0;
+		// A long path in a block of its own leaves the current block open for the next ones
+		if (catalog->blocks != NULL && block_size > CATALOG_ARENA_BLOCK) {
+			block->next = catalog->blocks->next;
+			catalog->blocks->next = block;
+		}
+		else {
+			block->next = catalog->blocks;
+			catalog->blocks = block;
+		}
+	}
+	char *copy = block->data + block->used;
+	memcpy(copy, path, size);
+	block->used += size;
+	catalog->arena_used += size;
+	return copy;
+}
+
+/**
+* Copy the paths still used to a new arena and free the old one (catalog locked)
+* @returns 0 or -1 if there was no memory (the old arena is kept)
+*/
+static int catalog_arena_rebuild(Catalog *catalog)
+{
+	// Only the arena of [rebuilt] is used. The records only move once every live path has its copy
+	Catalog rebuilt;
+	memset(&rebuilt, 0, sizeof(rebuilt));
+	const char **directory_paths = (const char **)malloc((catalog->directory_count + 1) * sizeof(char *));
+	const char **file_paths = (const char **)malloc((catalog->file_count + 1) * sizeof(char *));
+	int failed = directory_paths == NULL || file_paths == NULL;
+	for (size_t i = 0; i < catalog->directory_count && !failed; i++) {
+		const char *path = catalog->directories[i].path;
+		failed = (directory_paths[i] = is_mapped(catalog, path) ? path : catalog_intern(&rebuilt, path)) == NULL;
+	}
+	for (size_t i = 0; i < catalog->file_count && !failed; i++) {
+		const char *path = catalog->files[i].path;
+		failed = (file_paths[i] = is_mapped(catalog, path) ? path : catalog_intern(&rebuilt, path)) == NULL;
+	}
+
+	CatalogBlock *blocks = failed ? rebuilt.blocks : catalog->blocks;
+	if (!failed) {
+		for (size_t i = 0; i < catalog->directory_count; i++)
+			catalog->directories[i].path = directory_paths[i];
+		for (size_t i = 0; i < catalog->file_count; i++)
+			catalog->files[i].path = file_paths[i];
+		catalog->blocks = rebuilt.blocks;
+		catalog->arena_used = rebuilt.arena_used;
+		catalog->arena_garbage = 0;
+		catalog->generation++;
+	}
+	while (blocks != NULL) {
+		CatalogBlock *next = blocks->next;
+		free(blocks);
+		blocks = next;
+	}
+	free(directory_paths);
+	free(file_paths);
+	return failed ? -1 : 0;
+}
+
+/**
+* Drop a path: its bytes in the arena are garbage until the next rebuild (the mapped index is left alone)
+*/
+static void catalog_path_free(Catalog *catalog, const char *path)
+{
+	if (is_mapped(catalog, path))
+		return;
+	catalog->arena_garbage += strlen(path) + 1;
+}
+
+/**
+* Empty the catalog (the pattern and the rules are kept)
+*/
+static void catalog_clear(Catalog *catalog)
+{
+	while (catalog->blocks != NULL) {
+		CatalogBlock *next = catalog->blocks->next;
+		free(catalog->blocks);
+		catalog->blocks = next;
+	}
+	free(catalog->directories);
+	free(catalog->files);
+	free(catalog->order);
+	free(catalog->root);
+	if (catalog->map != NULL)
+		munmap(catalog->map, catalog->map_size);
+
+	catalog->root = NULL;
+	catalog->files = NULL;
+	catalog->file_count = catalog->file_capacity = 0;
+	catalog->directories = NULL;
+	catalog->directory_count = catalog->directory_capacity = 0;
+	catalog->order = NULL;
+	catalog->order_count = 0;
+	catalog->map = NULL;
+	catalog->map_size = 0;
+	catalog->arena_used = catalog->arena_garbage = 0;
+	catalog->generation++;
+}
+
+/**
+* Drop the [removed] directories and their files, keeping the files of the others contiguous and in order.
+* The listing keeps its order, its entries are moved with the files
+*/
+static void catalog_compact(Catalog *catalog, const uint8_t *removed)
+{
+	pthread_mutex_lock(&catalog->lock);
+	// New index of every file, SIZE_MAX for the ones dropped
+	size_t *moved = (size_t *)malloc((catalog->file_count + 1) * sizeof(size_t));
+
+	size_t directory_count = 0, file_count = 0;
+	for (size_t i = 0; i < catalog->directory_count; i++)
+	{
+		CatalogDirectory directory = catalog->directories[i];
+		CatalogFile *files = catalog->files + directory.first_file;
+		if (removed[i]) {
+			for (size_t j = 0; j < directory.file_count; j++) {
+				catalog_path_free(catalog, files[j].path);
+				if (moved != NULL)
+					moved[directory.first_file + j] = SIZE_MAX;
+			}
+			catalog_path_free(catalog, directory.path);
+			continue;
+		}
+		for (size_t j = 0; j < directory.file_count && moved != NULL; j++)
+			moved[directory.first_file + j] = file_count + j;
+		memmove(catalog->files + file_count, files, directory.file_count * sizeof(CatalogFile));
+		directory.first_file = file_count;
+		file_count += directory.file_count;
+		catalog->directories[directory_count++] = directory;
+	}
+	catalog->directory_count = directory_count;
+	catalog->file_count = file_count;
+
+	// Files keep their relative order, the listed ones are still the first ones
+	size_t order_count = 0;
+	for (size_t i = 0; i < catalog->order_count && moved != NULL; i++)
+		if (moved[catalog->order[i]] != SIZE_MAX)
+			catalog->order[order_count++] = moved[catalog->order[i]];
+	// Without memory to move the listing, it is sorted again from scratch by the next publish
+	catalog->order_count = order_count;
+	free(moved);
+	catalog->generation++;
+	// Paths dropped by the watcher pile up over a long session, they are let go once they outweigh the others
+	if (catalog->arena_garbage > CATALOG_ARENA_BLOCK && catalog->arena_garbage > catalog->arena_used - catalog->arena_garbage)
+		catalog_arena_rebuild(catalog);
+	pthread_mutex_unlock(&catalog->lock);
+}
+
+/**
+* Add the files found since the last publish to the listing: they are sorted by name and merged into it
+* @param force '0' to wait for a batch worth of files, '1' to publish whatever was found
+* @returns 0 or -1 if there was no memory (the files stay unlisted until a publish succeeds)
+*/
+static int catalog_publish(Catalog *catalog, int force)
+{
+	pthread_mutex_lock(&catalog->lock);
+	size_t listed = catalog->order_count;
+	size_t found = catalog->file_count - listed;
+	// Batches grow with the listing, so merging stays linear over a whole walk
+	if (found == 0 || (!force && (found < CATALOG_PUBLISH_BATCH || found < listed / 4))) {
+		pthread_mutex_unlock(&catalog->lock);
+		return 0;
+	}
+
+	size_t *order = (size_t *)realloc(catalog->order, (catalog->file_count + 1) * sizeof(size_t));
+	size_t *batch = (size_t *)malloc(found * sizeof(size_t));
+	if (order == NULL || batch == NULL) {
+		if (order != NULL)
+			catalog->order = order;
+		free(batch);
+		pthread_mutex_unlock(&catalog->lock);
+		return -1;
+	}
+	catalog->order = order;
+	for (size_t i = 0; i < found; i++)
+		batch[i] = listed + i;
+	qsort_r(batch, found, sizeof(size_t), compare_names, catalog->files);
+
+	// Merged from the end, the listing stays in place at the front
+	size_t i = listed, j = found, k = catalog->file_count;
+	while (j > 0)
+	{
+		if (i > 0 && compare_names(&order[i - 1], &batch[j - 1], catalog->files) > 0)
+			order[--k] = order[--i];
+		else
+			order[--k] = batch[--j];
+	}
+	free(batch);
+	catalog->order_count = catalog->file_count;
+	catalog->generation++;
+	pthread_mutex_unlock(&catalog->lock);
+	return 0;
+}
+
+static int catalog_rules_equal(const CatalogRules *a, const CatalogRules *b)
+{
+	// No patterns and empty patterns leave out the same
+	const char *exclude_a = a->exclude != NULL ? a->exclude : "";
+	const char *exclude_b = b->exclude != NULL ? b->exclude : "";
+	return strcmp(exclude_a, exclude_b) == 0 && a->flags == b->flags && a->max_depth == b->max_depth &&
+		a->min_size == b->min_size && a->max_size == b->max_size;
+}
+
+static int compare_names(const void *a, const void *b, void *files)
+{
+	const CatalogFile *file_a = (const CatalogFile *)files + *(const size_t *)a;
+	const CatalogFile *file_b = (const CatalogFile *)files + *(const size_t *)b;
+	return strcmp(strrchr(file_a->path, '/') + 1, strrchr(file_b->path, '/') + 1);
+}
+
+static int is_inside(const char *path, const char *dirpath, size_t dirpath_length)
+{
+	return strncmp(path, dirpath, dirpath_length) == 0 && path[dirpath_length] == '/';
+}
+
+static int is_mapped(const Catalog *catalog, const char *path)
+{
+	return catalog->map != NULL && (const uint8_t *)path >= catalog->map && (const uint8_t *)path < catalog->map + catalog->map_size;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static int64_t stat_mtime(const struct stat *statbuf)
+{
+	return (int64_t)statbuf->st_mtim.tv_sec * 1000000000 + statbuf->st_mtim.tv_nsec;
+}
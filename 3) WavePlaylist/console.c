@@ -3,6 +3,8 @@
 
 #include "console.h"
 
+Console *console;
+
 void console_free() {
     free(console);
 }
@@ -32,7 +34,7 @@ void console_printString(const char *message)
 int *console_get_keycode()
 {
 	// Will hold 1 or 3 chars (1 if single key; 3 if key combo)
-	int *buffer = (int *)calloc(3, 1);
+	int *buffer = (int *)calloc(3, sizeof(int));
 	// Set terminal mode to raw
 	system("/bin/stty raw");
 	int ch;
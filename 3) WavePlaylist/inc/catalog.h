@@ -0,0 +1,128 @@
+#ifndef CATALOG
+#define CATALOG
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "file_tree_foreach.h"
+
+// Files the catalog keeps from a scan
+#define CATALOG_PATTERN "*.wav"
+// Index file kept in the home directory between runs
+#define CATALOG_INDEX_NAME ".wave_playlist.index"
+// Files found by a walk before they are added to the listing (at least, a quarter of the listing at most)
+#define CATALOG_PUBLISH_BATCH 256
+// Workers walking a new root (0 for one per online processor)
+#define CATALOG_WALK_THREADS 0
+// Rules flag: the header of every candidate is read, files that are not RIFF/WAVE are left out
+#define CATALOG_PROBE 0x10000
+// Bytes of each block of the arena paths are interned in (longer paths get a block of their own)
+#define CATALOG_ARENA_BLOCK (64 * 1024)
+// Candidates of a directory opened at once to be probed (their first reads are all requested before any is waited for)
+#define CATALOG_PROBE_BATCH 32
+
+// Format of a wave file, read from its header by a scan that probes (all 0 otherwise)
+typedef struct catalog_format {
+	uint32_t sample_rate;
+	uint16_t channels;
+	uint16_t bits_per_sample;
+	uint64_t frame_count;
+} CatalogFormat;
+
+// A wave file found by a scan (times in nanoseconds since the epoch)
+typedef struct catalog_file {
+	const char *path;
+	uint64_t size;
+	int64_t mtime;
+	CatalogFormat format;
+} CatalogFile;
+
+// Block of the arena the paths of a catalog are interned in
+typedef struct catalog_block {
+	struct catalog_block *next;
+	size_t size, used;
+	char data[];
+} CatalogBlock;
+
+// What a scan leaves out, so it only reads the directories media may be in
+typedef struct catalog_rules {
+	// Wildcard patterns of the names of the directories never walked ("node_modules|.git"), NULL for none
+	const char *exclude;
+	// FILE_TREE_ONE_FILE_SYSTEM, FILE_TREE_SKIP_HIDDEN and CATALOG_PROBE
+	int flags;
+	// Levels of directories read at most, the root being the first one (0 for FILE_TREE_MAX_DEPTH)
+	size_t max_depth;
+	// Bounds of the size of the wave files kept, in bytes (0 for no bound)
+	uint64_t min_size, max_size;
+} CatalogRules;
+
+// A directory walked by a scan and the range of [files] found directly in it
+typedef struct catalog_directory {
+	const char *path;
+	int64_t mtime;
+	size_t first_file;
+	size_t file_count;
+} CatalogDirectory;
+
+// Wave files under one root, kept on disk so the next run only rescans the directories that changed.
+// One thread at a time changes a catalog (a scan or a watcher), others read it holding [lock]
+typedef struct catalog {
+	char *root;
+	CatalogFile *files;
+	size_t file_count, file_capacity;
+	CatalogDirectory *directories;
+	size_t directory_count, directory_capacity;
+	// Files by name, for the listing. Files found by a walk are added in batches, the ones past
+	// [order_count] are not listed yet
+	size_t *order;
+	size_t order_count;
+	FileTreePattern *pattern;
+	// Rules of the scans (owned copy) and its compiled exclude patterns (NULL for none)
+	CatalogRules rules;
+	FileTreePattern *exclude;
+	// Mapped index the paths of a loaded catalog point into (paths outside of it are interned in [blocks])
+	uint8_t *map;
+	size_t map_size;
+	// Arena of the paths found by the scans, newest block first. Dropped paths stay until the garbage
+	// outweighs the live paths, the arena is then rebuilt with the live ones only
+	CatalogBlock *blocks;
+	size_t arena_used, arena_garbage;
+	// Changed every time the listing or the paths move (indexes over the listing check it to know they are stale)
+	uint64_t generation;
+	// Held to read the catalog while another thread may change it (taken by the catalog functions to change it)
+	pthread_mutex_t lock;
+	// Set to stop the walk of a scan (what was found so far is kept)
+	atomic_int cancelled;
+	// Called with every directory about to be listed (NULL if nobody needs to know). A new root is
+	// walked by a single thread while it is set
+	void (*directory_opened)(void *context, const char *dirpath);
+	void *directory_context;
+} Catalog;
+
+Catalog *catalog_create();
+// A scan running on its own thread
+typedef struct catalog_scan {
+	Catalog *catalog;
+	char *root;
+	pthread_t thread;
+	atomic_int finished;
+	int result;
+} CatalogScan;
+
+int catalog_set_rules(Catalog *catalog, const CatalogRules *rules);
+int catalog_scan(Catalog *catalog, const char *root);
+CatalogScan *catalog_scan_start(Catalog *catalog, const char *root);
+int catalog_scan_finished(CatalogScan *scan);
+void catalog_scan_cancel(CatalogScan *scan);
+int catalog_scan_wait(CatalogScan *scan);
+int catalog_refresh(Catalog *catalog);
+int catalog_update_directories(Catalog *catalog, const char **dirpaths, size_t count, size_t *first_read);
+int catalog_load(Catalog *catalog, const char *filepath);
+int catalog_save(Catalog *catalog, const char *filepath);
+size_t catalog_size(Catalog *catalog);
+const CatalogFile *catalog_get(Catalog *catalog, size_t index);
+void catalog_destroy(Catalog *catalog);
+
+#endif
@@ -12,7 +12,7 @@ typedef struct console {
 
 
 // Global console object
-Console *console;
+extern Console *console;
 
 void console_init();
 void console_free();
@@ -0,0 +1,125 @@
+#ifndef TREE_SEARCH
+#define TREE_SEARCH
+
+#include <stddef.h>
+#include <stdint.h>
+
+void file_tree_foreach(const char *dirpath, void (*doit)(const char *, void *), void *context);
+int file_tree_foreach_parallel(const char *dirpath, void (*doit)(const char *, void *), void *context, int thread_count);
+
+/* ---------- BATCHED WALK ---------- */
+
+// file_tree_walk flags (FILE_TREE_MATCH_CASELESS applies to the pattern as well)
+// Fill the size and modification time of the entries (one fstatat each, links are not followed)
+#define FILE_TREE_STAT 0x2
+// Call the callback for every directory read, even when none of its entries match
+#define FILE_TREE_DIRECTORIES 0x4
+// Do not report the directories that cannot be read on stderr
+#define FILE_TREE_QUIET 0x8
+// Follow symbolic links to directories (file_tree_open only, loops are detected)
+#define FILE_TREE_FOLLOW 0x10
+// Do not walk into directories on another filesystem than their parent (mount points)
+#define FILE_TREE_ONE_FILE_SYSTEM 0x20
+// Leave out the entries whose name starts with '.', and the subtrees of such directories
+#define FILE_TREE_SKIP_HIDDEN 0x40
+
+// Levels an iterator walks below its start by default
+#define FILE_TREE_MAX_DEPTH 256
+// Directories an iterator keeps open at once by default
+#define FILE_TREE_FD_BUDGET 32
+
+// What a batch callback wants the walk to do next
+enum FILE_TREE_ACTION {
+    FILE_TREE_CONTINUE,
+    // Do not walk the subdirectories of the directory the batch was found in
+    FILE_TREE_PRUNE,
+    // End the walk (with a parallel walk, batches already being handed out still arrive)
+    FILE_TREE_STOP
+};
+
+// An entry found by a walk: [path] holds the whole path and the name starts at [name_offset]
+typedef struct file_tree_entry {
+    const char *path;
+    size_t name_offset;
+    // DT_* of the entry (DT_UNKNOWN when the filesystem does not tell and it was not stat'ed)
+    unsigned char type;
+    uint64_t inode;
+    // Only filled with FILE_TREE_STAT (time in nanoseconds since the epoch)
+    uint64_t size;
+    int64_t mtime;
+} FileTreeEntry;
+
+// Called with entries of [directory] matching the pattern, a batch at a time. Every batch holds entries
+// of a single directory and its paths are only valid during the call. Returns a FILE_TREE_ACTION
+typedef int (*FileTreeBatchFunction)(const FileTreeEntry *directory, const FileTreeEntry *entries, size_t count, void *user);
+
+typedef struct file_tree_options {
+    // Wildcard patterns the names of the entries reported must match (see file_tree_pattern_compile), NULL for all
+    const char *pattern;
+    // FILE_TREE_* flags
+    int flags;
+    // Entries handed to the callback at once at most, 0 for a whole directory per batch
+    size_t batch_size;
+    // Levels below the start walked at most, 0 for FILE_TREE_MAX_DEPTH
+    size_t max_depth;
+    // Directories kept open at once at most, 0 for FILE_TREE_FD_BUDGET (file_tree_open only)
+    size_t fd_budget;
+    // Wildcard patterns of the names of the directories pruned (never opened), NULL for none.
+    // Ex: "node_modules|.git|.cache"
+    const char *exclude;
+    // Bounds of the size of the regular files reported, in bytes (0 for no bound). They are stat'ed for it
+    uint64_t min_size, max_size;
+} FileTreeOptions;
+
+int file_tree_walk(const char *dirpath, const FileTreeOptions *options, FileTreeBatchFunction batch, void *user);
+int file_tree_walk_parallel(const char *dirpath, const FileTreeOptions *options, FileTreeBatchFunction batch, void *user, int thread_count);
+
+/* ---------- ITERATOR ---------- */
+
+// Pull-style walk over an explicit stack of directories: memory and descriptors stay bounded by the
+// depth limit and the descriptor budget whatever the shape of the tree
+typedef struct file_tree_iterator FileTreeIterator;
+
+FileTreeIterator *file_tree_open(const char *dirpath, const FileTreeOptions *options);
+int file_tree_next(FileTreeIterator *iterator, FileTreeEntry *entry);
+size_t file_tree_depth(const FileTreeIterator *iterator);
+void file_tree_skip_subtree(FileTreeIterator *iterator);
+void file_tree_close(FileTreeIterator *iterator);
+
+/* ---------- PATTERNS ---------- */
+
+// file_tree_pattern_compile flags
+#define FILE_TREE_MATCH_CASELESS 0x1
+
+// How an alternative is matched: exact text, "*text" (one compare of the tail) or anything else
+enum FILE_TREE_GLOB {
+    FILE_TREE_GLOB_LITERAL,
+    FILE_TREE_GLOB_SUFFIX,
+    FILE_TREE_GLOB_GENERAL
+};
+
+// One alternative of a pattern ('*' and '?' wildcards)
+typedef struct file_tree_glob {
+    int kind;
+    const char *text;
+    size_t length;
+    // Characters before the first star and index right after the last one
+    size_t prefix, suffix;
+    // Characters a name needs at least (everything but the stars)
+    size_t min_length;
+} FileTreeGlob;
+
+// Set of alternatives compiled once ("*.wav|*.wave"), matched in a single pass without backtracking
+typedef struct file_tree_pattern {
+    int flags;
+    int count;
+    FileTreeGlob *globs;
+    // Alternatives, split in place (lower case when caseless)
+    char *text;
+} FileTreePattern;
+
+FileTreePattern *file_tree_pattern_compile(const char *patterns, int flags);
+int file_tree_pattern_match(const FileTreePattern *pattern, const char *name, size_t length);
+void file_tree_pattern_destroy(FileTreePattern *pattern);
+
+#endif
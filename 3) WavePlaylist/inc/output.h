@@ -0,0 +1,60 @@
+#ifndef OUTPUT
+#define OUTPUT
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Buffered audio an output holds (in microseconds)
+#define OUTPUT_LATENCY 500000
+
+// What went through an output since it was opened (times in seconds, CLOCK_MONOTONIC)
+typedef struct output_stats {
+	uint64_t frames;
+	uint64_t commits;
+	double first_commit, last_commit;
+	// Intervals between the wake ups of the writer (the periods of the device)
+	uint64_t wakeups;
+	double last_wakeup;
+	double interval_sum, interval_square_sum, interval_max;
+	// Times the device ran out of frames
+	uint64_t underruns;
+} OutputStats;
+
+// Audio output backend taking interleaved S16 frames
+typedef struct audio_output {
+	const char *name;
+	void *state;
+	int channels;
+	int rate;
+	OutputStats stats;
+
+	int (*open)(struct audio_output *output);
+	// Buffer to write up to [*frame_count] frames into. [*frame_count] is lowered to what fits, 0 if the output is full
+	int (*begin)(struct audio_output *output, int16_t **buffer, size_t *frame_count);
+	// Queue the first [frame_count] frames written into the buffer of the last begin
+	int (*commit)(struct audio_output *output, size_t frame_count);
+	// Sleep until there is room for more frames or [wake_fd] becomes readable
+	int (*wait)(struct audio_output *output, int wake_fd);
+	// Throw away the queued frames and get ready to be written again
+	int (*reset)(struct audio_output *output);
+	// Return once the queued frames were played
+	int (*drain)(struct audio_output *output);
+	// Frames committed that were not heard yet
+	int (*delay)(struct audio_output *output, size_t *frame_count);
+	void (*destroy)(struct audio_output *output);
+} AudioOutput;
+
+AudioOutput *output_alsa_create(const char *device, int mmap_access);
+AudioOutput *output_null_create(int realtime);
+AudioOutput *output_file_create(const char *filepath, int direct);
+AudioOutput *output_create(const char *spec);
+
+int output_open(AudioOutput *output, int channels, int rate);
+int output_commit(AudioOutput *output, size_t frame_count);
+int output_wait(AudioOutput *output, int wake_fd);
+void output_stats_reset(AudioOutput *output);
+void output_stats_print(AudioOutput *output, FILE *stream);
+void output_destroy(AudioOutput *output);
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef PLAYER
+#define PLAYER
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "wavelib.h"
+
+#include "output.h"
+
+// Periods buffered between the producer and the audio thread (power of 2)
+#ifndef PLAYER_RING_PERIODS
+#define PLAYER_RING_PERIODS 256
+#endif
+
+// AVAILABLE "WHILE-PLAYING" FUNCTIONALLITY
+enum WAVE {
+	WAVE_PAUSE = 1,
+	WAVE_NEXT
+};
+
+// Source of the waves to play and of the user commands (implemented by the playlist)
+typedef struct player_session {
+	void *context;
+	// Descriptor that becomes readable when the user types a command (-1 if there is none)
+	int input_fd;
+	// Wave at position [index] of the queue (0 is the one playing) or NULL
+	Wave *(*peek)(void *context, size_t index);
+	// The wave at position 0 finished playing
+	void (*pop)(void *context);
+	void (*track_started)(void *context, Wave *wave);
+	// Called periodically with the position the device reached in [wave]
+	void (*track_progress)(void *context, Wave *wave, uint64_t frame_index);
+	// Called when [input_fd] is readable. Returns WAVE_PAUSE, WAVE_NEXT or 0 if the user did not ask for anything
+	int (*poll_command)(void *context);
+} PlayerSession;
+
+// A wave being played (or prepared to be played next)
+typedef struct player_track {
+	Wave *wave;
+	int channels;
+	uint64_t frame_index;
+	int finished;
+	// Already in the device layout and rate: the slots point at the wave frames instead of holding a copy
+	int direct;
+	// Frames up to this index were already prefetched
+	uint64_t prefetched;
+	WaveConvertFunction convert;
+	WaveResampler *resampler;
+	// Period in the file format, converted and remixed in place to the device format
+	uint8_t *buffer;
+	int16_t *resampled;
+} PlayerTrack;
+
+// One period of device frames handed from the producer to the audio thread
+typedef struct player_slot {
+	// Wave the frames belong to (NULL marks the end of the queue)
+	Wave *wave;
+	// Position in [wave] right after these frames
+	uint64_t frame_index;
+	// Slots of an older generation were skipped by the user and are thrown away
+	unsigned generation;
+	size_t frame_count;
+	int16_t *frames;
+	// Frames of a direct track: read in place from the wave and converted on the way to the device
+	const uint8_t *source;
+	int source_frame_size;
+	WaveConvertFunction convert;
+} PlayerSlot;
+
+// Lock-free single-producer/single-consumer ring of periods
+typedef struct player_ring {
+	PlayerSlot slots[PLAYER_RING_PERIODS];
+	// Slots are only read by the audio thread from [head] and only written by the producer at [tail]
+	atomic_size_t head, tail;
+	// Set by a side before it sleeps on its eventfd (the other side only signals a sleeping side)
+	atomic_int producer_waiting, audio_waiting;
+	int producer_event, audio_event;
+	int16_t *frames;
+} PlayerRing;
+
+// Playback engine owning one output for the whole session
+typedef struct player {
+	AudioOutput *output;
+	int opened;
+	int channels;
+	int rate;
+	size_t period_size;
+	// SCHED_FIFO priority of the audio thread (0 keeps the default scheduler)
+	int realtime_priority;
+
+	// Owned by the producer thread while playing
+	PlayerTrack current, next;
+	PlayerSession *session;
+	// Serializes the session callbacks between the producer and the calling thread
+	pthread_mutex_t session_lock;
+
+	PlayerRing ring;
+	pthread_t producer_thread, audio_thread;
+	atomic_int running;
+	// Command pushed to the producer (WAVE_NEXT)
+	atomic_int command;
+	atomic_uint generation;
+	// Signaled by the audio thread when what it publishes changes
+	int ui_event;
+	// Periodic refresh of the progress while playing
+	int refresh_timer;
+	// Published by the audio thread: what the device is playing, end of the queue, write error
+	_Atomic(Wave *) playing;
+	_Atomic uint64_t played_frame;
+	// Position in [playing] right after the frames handed to the output (read once the audio thread stopped)
+	uint64_t written_frame;
+	atomic_int finished;
+	atomic_int error;
+
+	// Position to resume from when the paused wave is played again
+	Wave *resume_wave;
+	uint64_t resume_frame;
+} Player;
+
+Player *player_create(AudioOutput *output, int channels, int rate, size_t period_size, int realtime_priority);
+int player_play(Player *player, PlayerSession *session);
+void player_forget(Player *player, const Wave *wave);
+int player_export(PlayerSession *session, AudioOutput *output, int channels, int rate, size_t period_size);
+void player_destroy(Player *player);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef SEARCH
+#define SEARCH
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "catalog.h"
+
+// Trigram index over the names of the files listed by a catalog, to find them by any part of their name.
+// Built by the first query after the listing changed, queries then only read the lists of their trigrams
+typedef struct catalog_search {
+	Catalog *catalog;
+	// Generation of the catalog the index was built for
+	uint64_t generation;
+	int built;
+	// Names of the listing in lower case, by position (copied to [lower_names])
+	const char **names;
+	size_t name_count;
+	char *lower_names;
+	// Distinct trigrams (3 lower case bytes), sorted. The names holding trigrams[i] are at the positions
+	// positions[offsets[i]] to positions[offsets[i + 1] - 1], in the order of the listing
+	uint32_t *trigrams;
+	size_t trigram_count;
+	uint32_t *offsets;
+	uint32_t *positions;
+} CatalogSearch;
+
+CatalogSearch *catalog_search_create(Catalog *catalog);
+size_t catalog_search_find(CatalogSearch *search, const char *text, size_t *results, size_t max_results);
+void catalog_search_destroy(CatalogSearch *search);
+
+#endif
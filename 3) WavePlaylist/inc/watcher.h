@@ -0,0 +1,34 @@
+#ifndef WATCHER
+#define WATCHER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "catalog.h"
+
+// Size of the buffer inotify events are read into
+#define WATCHER_EVENTS_SIZE 65536
+
+// Keeps a catalog in step with the filesystem: every directory of the catalog is watched with inotify and
+// the directories events happen in are listed again by a background thread (nothing is walked again)
+typedef struct catalog_watcher {
+	Catalog *catalog;
+	int inotify_fd;
+	// Signaled to stop the thread
+	int stop_event;
+	pthread_t thread;
+	// Path of the directory watched by each watch descriptor (indexed by descriptor)
+	char **watches;
+	size_t watch_capacity;
+	size_t watch_count;
+	// Directories that could not be watched (fs.inotify.max_user_watches reached)
+	size_t unwatched;
+	// Times the kernel event queue overflowed (each one recovered with a refresh of the catalog)
+	uint64_t overflows;
+} CatalogWatcher;
+
+CatalogWatcher *catalog_watcher_start(Catalog *catalog);
+void catalog_watcher_stop(CatalogWatcher *watcher);
+
+#endif
@@ -3,20 +3,65 @@
 
 /* ---------- PLAY WAVE ---------- */
 
-int play(Wave* wave);
+// Output used when none is passed on the command line
+#define SOUND_OUTPUT "alsa:default"
+// Every wave is remixed and resampled to this format so the device is configured only once
+#define PLAYBACK_CHANNELS 2
+#define PLAYBACK_RATE 48000
+#define PLAYBACK_PERIOD 64
+// SCHED_FIFO priority of the audio thread (needs CAP_SYS_NICE or an rtprio limit), 0 to keep the default scheduler
+#ifndef PLAYBACK_REALTIME_PRIORITY
+#define PLAYBACK_REALTIME_PRIORITY 0
+#endif
+// Frames rendered at a time by the export command (no device to keep fed, so large periods)
+#define EXPORT_PERIOD 65536
+
+// Playback engine shared by every play command (keeps the sound device open)
+Player *player;
+
+// Player session over the playlist
+static Wave *session_peek(void *context, size_t index);
+static void session_pop(void *context);
+static void session_track_started(void *context, Wave *wave);
+static void session_track_progress(void *context, Wave *wave, uint64_t frame_index);
+static int session_poll_command(void *context);
+static void session_track_exported(void *context, Wave *wave);
 
 /* ---------- FILE SEARCH UTILS ---------- */
 
-#define MAX_FILES 500
 #define MAX_FILE_NAME_SIZE 100
-
-// Global array that will hold the filepaths of all the files found matching the pattern
-char *filepaths[MAX_FILES];
-
-void file_tree_find_wavs(const char *dirpath);
-void sort_file_search_results();
-void file_show_search_results();                      
-static size_t files_found_num();
+#define CATALOG_INDEX_PATH_SIZE 4096
+// Files shown by the find command at most
+#define FIND_MAX_RESULTS 100
+
+// Keep the catalog in step with the filesystem from startup (the watch command turns it on and off)
+#define CATALOG_WATCH 1
+
+// Rules of a scan, unless its options change them: caches, packages and hidden directories are never
+// walked, neither are other filesystems (mounts), and files too small to hold a wave header are left out.
+// The header of every file is read, only real wave files are listed (with their format)
+#define CATALOG_EXCLUDE "node_modules|__pycache__|site-packages|venv|lost+found"
+#define CATALOG_RULE_FLAGS (FILE_TREE_ONE_FILE_SYSTEM | FILE_TREE_SKIP_HIDDEN | CATALOG_PROBE)
+#define CATALOG_MAX_DEPTH 0
+#define CATALOG_MIN_SIZE 44
+#define CATALOG_MAX_SIZE 0
+
+// Wave files found by the scans (loaded from the index of the last run at startup)
+Catalog *catalog;
+// Applies the changes of the filesystem to the catalog (NULL while not watching)
+CatalogWatcher *watcher;
+// Whether the catalog should be watched (the watcher waits for the end of a scan, a catalog has one writer)
+int watch_wanted;
+// Scan running in the background (NULL if there is none)
+CatalogScan *scan;
+// Trigram index the find command looks the names of the listing up in
+CatalogSearch *search;
+
+void file_tree_find_wavs(const char *dirpath, const CatalogRules *rules);
+static void file_tree_scan_collect(int wait);
+static int catalog_index_path(char *buffer, size_t size);
+static void catalog_watch(int enable);
+void file_show_search_results();
 
 /* ---------- PLAYLIST ---------- */
 // Queue Item
@@ -34,6 +79,7 @@ typedef struct playlist {
 
 Playlist *playlist_init();
 Wave *playlist_first(Playlist *playlist);
+Wave *playlist_get(Playlist *playlist, size_t index);
 size_t playlist_size(Playlist *playlist);
 int playlist_add(Playlist *playlist, Wave *wave);
 int playlist_remove(Playlist *playlist, size_t index);
@@ -65,10 +111,13 @@ void command_print_commands(Playlist *playlist, const char *args);
 void command_exit(Playlist *playlist, const char *args);
 void command_scan(Playlist *playlist, const char *args);
 void command_print_files(Playlist *playlist, const char *args);
+void command_find(Playlist *playlist, const char *args);
+void command_watch(Playlist *playlist, const char *args);
 void command_playlist_print(Playlist *playlist, const char *args);
 void command_add(Playlist *playlist, const char *args);
 void command_remove(Playlist *playlist, const char *args);
 void command_play(Playlist *playlist, const char *args);
+void command_export(Playlist *playlist, const char *args);
 void command_clear_console(Playlist *playlist, const char *args);
 
 /* ---------- COMMANDS HISTORY ---------- */
@@ -80,15 +129,6 @@ int commands_history_size();
 /* ---- ASYNCHRONOUSLY WAIT FOR INTERRUPTIONS(VIA STDIN) WHILE PLAYING WAVE FILES ---- */
 struct termios orig_termios;
 
-// AVAILABLE "WHILE-PLAYING" FUNCTIONALLITY
-enum WAVE {
-	WAVE_PAUSE = 1,
-	WAVE_NEXT
-};
-
-// Holds the last frame_index played to allow play/pause functionality
-int last_frame_index;
-
 void reset_terminal_mode()
 {
     tcsetattr(0, TCSANOW, &orig_termios);
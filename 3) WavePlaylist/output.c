@@ -0,0 +1,653 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <alsa/asoundlib.h>
+
+#include "wavelib.h"
+
+#include "output.h"
+
+// Frames handed out by a single begin of the outputs without a device buffer
+#define OUTPUT_CHUNK_FRAMES 4096
+
+/* -- Private Functions -- */
+static double output_now();
+static AudioOutput *output_new(const char *name, void *state);
+
+/* ----------------------------------- OUTPUT FUNCTIONS ----------------------------------- */
+
+/**
+* Output Create
+* @param spec "alsa[:device]" (mmap access with a snd_pcm_writei fallback), "null" (consumes frames as fast as they come),
+* "null:realtime" (consumes frames at the sample rate, like a sound card) or "file:path" (writes a WAV file)
+* @returns pointer to the new output or NULL if [spec] is not valid
+*/
+AudioOutput *output_create(const char *spec)
+{
+	if (spec == NULL || strcmp(spec, "alsa") == 0)
+		return output_alsa_create("default", 1);
+	if (strncmp(spec, "alsa:", 5) == 0)
+		return output_alsa_create(spec + 5, 1);
+	if (strcmp(spec, "null") == 0)
+		return output_null_create(0);
+	if (strcmp(spec, "null:realtime") == 0)
+		return output_null_create(1);
+	if (strncmp(spec, "file:", 5) == 0 && spec[5] != '\0')
+		return output_file_create(spec + 5, 0);
+	return NULL;
+}
+
+/**
+* Output Open
+* @param channels Channels of the interleaved frames
+* @param rate Sample rate of the frames
+* @returns 0 if the output is ready or a negative error code
+*/
+int output_open(AudioOutput *output, int channels, int rate)
+{
+	output->channels = channels;
+	output->rate = rate;
+	output_stats_reset(output);
+	return output->open(output);
+}
+
+/**
+* Output Commit (queues the frames written after a begin and keeps the statistics)
+* @returns 0 or a negative error code
+*/
+int output_commit(AudioOutput *output, size_t frame_count)
+{
+	int result = output->commit(output, frame_count);
+	if (result < 0)
+		return result;
+
+	double now = output_now();
+	if (output->stats.commits == 0)
+		output->stats.first_commit = now;
+	output->stats.last_commit = now;
+	output->stats.commits++;
+	output->stats.frames += frame_count;
+	return 0;
+}
+
+/**
+* Output Wait (sleeps until the output has room and keeps the statistics of the periods)
+* @returns 0 or a negative error code
+*/
+int output_wait(AudioOutput *output, int wake_fd)
+{
+	int result = output->wait(output, wake_fd);
+
+	double now = output_now();
+	OutputStats *stats = &output->stats;
+	if (stats->last_wakeup > 0) {
+		double interval = now - stats->last_wakeup;
+		stats->wakeups++;
+		stats->interval_sum += interval;
+		stats->interval_square_sum += interval * interval;
+		if (interval > stats->interval_max)
+			stats->interval_max = interval;
+	}
+	stats->last_wakeup = now;
+	return result;
+}
+
+/**
+* Output Stats Reset
+*/
+void output_stats_reset(AudioOutput *output)
+{
+	memset(&output->stats, 0, sizeof(OutputStats));
+}
+
+/**
+* Output Stats Print (frames per second and jitter of the periods)
+*/
+void output_stats_print(AudioOutput *output, FILE *stream)
+{
+	OutputStats *stats = &output->stats;
+	double elapsed = stats->last_commit - stats->first_commit;
+	double fps = elapsed > 0 ? stats->frames / elapsed : 0;
+
+	fprintf(stream, "Output:    %s (%d channels, %d Hz)\n", output->name, output->channels, output->rate);
+	fprintf(stream, "Frames:    %llu in %.3f s, %.0f frames/s (%.2fx realtime)\n",
+			(unsigned long long)stats->frames, elapsed, fps, output->rate > 0 ? fps / output->rate : 0);
+	fprintf(stream, "Commits:   %llu, underruns: %llu\n",
+			(unsigned long long)stats->commits, (unsigned long long)stats->underruns);
+	if (stats->wakeups > 0) {
+		double mean = stats->interval_sum / stats->wakeups;
+		double variance = stats->interval_square_sum / stats->wakeups - mean * mean;
+		fprintf(stream, "Periods:   %llu, mean %.3f ms, max %.3f ms, jitter %.3f ms\n",
+				(unsigned long long)stats->wakeups, mean * 1e3, stats->interval_max * 1e3,
+				sqrt(variance > 0 ? variance : 0) * 1e3);
+	}
+}
+
+/**
+* Output Destroy
+*/
+void output_destroy(AudioOutput *output)
+{
+	if (output == NULL)
+		return;
+	output->destroy(output);
+	free(output);
+}
+
+/* ----------------------------------- ALSA OUTPUT ----------------------------------- */
+
+typedef struct alsa_output {
+	const char *device;
+	snd_pcm_t *handle;
+	int mmap_access;
+	// Where the frames of the last begin go in the device buffer (mmap access)
+	snd_pcm_uframes_t offset;
+	// Frames queued before the device is started (mmap access, see alsa_start)
+	snd_pcm_uframes_t buffer_size, start_threshold;
+	// Frames of the last begin (snd_pcm_writei access)
+	int16_t *staging;
+} AlsaOutput;
+
+static int alsa_open(AudioOutput *output)
+{
+	AlsaOutput *alsa = (AlsaOutput *)output->state;
+
+	// Non-blocking, the writer waits for the device in poll
+	int result = snd_pcm_open(&alsa->handle, alsa->device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+	if (result < 0) {
+		printf("snd_pcm_open(&handle, %s, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK): %s\n",
+				alsa->device, snd_strerror(result));
+		alsa->handle = NULL;
+		return result;
+	}
+
+	snd_config_update_free_global();
+
+	result = snd_pcm_set_params(alsa->handle,
+					  SND_PCM_FORMAT_S16_LE,
+					  alsa->mmap_access ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED,
+					  output->channels,
+					  output->rate,
+					  1,
+					  OUTPUT_LATENCY);
+	if (result < 0 && alsa->mmap_access) {
+		fprintf(stderr, "No mmap access on %s (%s), using snd_pcm_writei\n", alsa->device, snd_strerror(result));
+		alsa->mmap_access = 0;
+		result = snd_pcm_set_params(alsa->handle,
+						  SND_PCM_FORMAT_S16_LE,
+						  SND_PCM_ACCESS_RW_INTERLEAVED,
+						  output->channels,
+						  output->rate,
+						  1,
+						  OUTPUT_LATENCY);
+	}
+	if (result < 0) {
+		fprintf(stderr, "Playback open error: %s\n", snd_strerror(result));
+		snd_pcm_close(alsa->handle);
+		alsa->handle = NULL;
+		return result;
+	}
+
+	if (!alsa->mmap_access) {
+		alsa->staging = (int16_t *)malloc(OUTPUT_CHUNK_FRAMES * output->channels * sizeof(int16_t));
+		if (alsa->staging == NULL) {
+			snd_pcm_close(alsa->handle);
+			alsa->handle = NULL;
+			return -ENOMEM;
+		}
+	}
+	else {
+		snd_pcm_uframes_t period_size;
+		snd_pcm_sw_params_t *sw_params;
+		snd_pcm_sw_params_alloca(&sw_params);
+		if (snd_pcm_get_params(alsa->handle, &alsa->buffer_size, &period_size) < 0 ||
+			snd_pcm_sw_params_current(alsa->handle, sw_params) < 0 ||
+			snd_pcm_sw_params_get_start_threshold(sw_params, &alsa->start_threshold) < 0 ||
+			alsa->start_threshold > alsa->buffer_size)
+			alsa->start_threshold = alsa->buffer_size;
+	}
+	return 0;
+}
+
+/**
+* Start a prepared device once the frames queued reach the start threshold. Only snd_pcm_writei applies the
+* threshold by itself: frames committed through mmap would wait in a full buffer forever
+* @returns 0 or a negative error code
+*/
+static int alsa_start(AlsaOutput *alsa)
+{
+	if (!alsa->mmap_access || snd_pcm_state(alsa->handle) != SND_PCM_STATE_PREPARED)
+		return 0;
+	snd_pcm_sframes_t avail = snd_pcm_avail_update(alsa->handle);
+	if (avail < 0)
+		return avail;
+	if (alsa->buffer_size - avail < alsa->start_threshold)
+		return 0;
+	return snd_pcm_start(alsa->handle);
+}
+
+static int alsa_begin(AudioOutput *output, int16_t **buffer, size_t *frame_count)
+{
+	AlsaOutput *alsa = (AlsaOutput *)output->state;
+
+	snd_pcm_sframes_t avail = snd_pcm_avail_update(alsa->handle);
+	if (avail < 0) {
+		output->stats.underruns++;
+		int result = snd_pcm_recover(alsa->handle, avail, 1);
+		if (result == 0)
+			result = alsa_start(alsa);
+		if (result < 0)
+			return result;
+		avail = snd_pcm_avail_update(alsa->handle);
+		if (avail < 0)
+			return avail;
+	}
+	if ((snd_pcm_uframes_t)avail < *frame_count)
+		*frame_count = avail;
+	if (*frame_count == 0)
+		return 0;
+
+	if (!alsa->mmap_access) {
+		if (*frame_count > OUTPUT_CHUNK_FRAMES)
+			*frame_count = OUTPUT_CHUNK_FRAMES;
+		*buffer = alsa->staging;
+		return 0;
+	}
+
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t frames = *frame_count;
+	int result = snd_pcm_mmap_begin(alsa->handle, &areas, &alsa->offset, &frames);
+	if (result < 0)
+		return result;
+	// Interleaved: every channel shares the first area
+	*buffer = (int16_t *)((uint8_t *)areas[0].addr + areas[0].first / 8 + alsa->offset * (areas[0].step / 8));
+	*frame_count = frames;
+	return 0;
+}
+
+static int alsa_commit(AudioOutput *output, size_t frame_count)
+{
+	AlsaOutput *alsa = (AlsaOutput *)output->state;
+	snd_pcm_sframes_t result = alsa->mmap_access
+		? snd_pcm_mmap_commit(alsa->handle, alsa->offset, frame_count)
+		: snd_pcm_writei(alsa->handle, alsa->staging, frame_count);
+	if (result < 0) {
+		output->stats.underruns += result == -EPIPE;
+		result = snd_pcm_recover(alsa->handle, result, 1);
+		if (result < 0)
+			return result;
+	}
+	return alsa_start(alsa);
+}
+
+static int alsa_wait(AudioOutput *output, int wake_fd)
+{
+	AlsaOutput *alsa = (AlsaOutput *)output->state;
+	int descriptors = snd_pcm_poll_descriptors_count(alsa->handle);
+	if (descriptors < 0)
+		return descriptors;
+	struct pollfd fds[descriptors + 1];
+	// On plugin devices (dmix, ioplug) the events of the descriptors do not tell the device is writable,
+	// the PCM translates them
+	for (;;) {
+		snd_pcm_poll_descriptors(alsa->handle, fds, descriptors);
+		fds[descriptors].fd = wake_fd;
+		fds[descriptors].events = POLLIN;
+		if (poll(fds, descriptors + 1, -1) < 0)
+			return errno == EINTR ? 0 : -errno;
+		if (fds[descriptors].revents & POLLIN)
+			return 0;
+		unsigned short revents;
+		int result = snd_pcm_poll_descriptors_revents(alsa->handle, fds, descriptors, &revents);
+		if (result < 0)
+			return result;
+		if (revents & (POLLOUT | POLLERR))
+			return 0;
+	}
+}
+
+static int alsa_reset(AudioOutput *output)
+{
+	AlsaOutput *alsa = (AlsaOutput *)output->state;
+	snd_pcm_drop(alsa->handle);
+	return snd_pcm_prepare(alsa->handle);
+}
+
+static int alsa_delay(AudioOutput *output, size_t *frame_count)
+{
+	AlsaOutput *alsa = (AlsaOutput *)output->state;
+	snd_pcm_sframes_t delay;
+	int result = snd_pcm_delay(alsa->handle, &delay);
+	if (result < 0)
+		return result;
+	*frame_count = delay > 0 ? delay : 0;
+	return 0;
+}
+
+static int alsa_drain(AudioOutput *output)
+{
+	AlsaOutput *alsa = (AlsaOutput *)output->state;
+	/* pass the remaining samples, otherwise they're dropped when the device is prepared again */
+	snd_pcm_nonblock(alsa->handle, 0);
+	int result = snd_pcm_drain(alsa->handle);
+	snd_pcm_nonblock(alsa->handle, 1);
+	if (result < 0)
+		printf("snd_pcm_drain failed: %s\r\n", snd_strerror(result));
+	return result;
+}
+
+static void alsa_destroy(AudioOutput *output)
+{
+	AlsaOutput *alsa = (AlsaOutput *)output->state;
+	if (alsa->handle != NULL) {
+		snd_pcm_close(alsa->handle);
+		snd_config_update_free_global();
+	}
+	free(alsa->staging);
+	free(alsa);
+}
+
+/**
+* Output ALSA Create
+* @param device ALSA device name
+* @param mmap_access Write into the device buffer with snd_pcm_mmap_begin/commit instead of snd_pcm_writei
+* (falls back to snd_pcm_writei if the device does not support it)
+* @returns pointer to the new output
+*/
+AudioOutput *output_alsa_create(const char *device, int mmap_access)
+{
+	AlsaOutput *alsa = (AlsaOutput *)calloc(1, sizeof(AlsaOutput));
+	if (alsa == NULL)
+		return NULL;
+	alsa->device = device;
+	alsa->mmap_access = mmap_access;
+
+	AudioOutput *output = output_new("alsa", alsa);
+	if (output == NULL) {
+		free(alsa);
+		return NULL;
+	}
+	output->open = alsa_open;
+	output->begin = alsa_begin;
+	output->commit = alsa_commit;
+	output->wait = alsa_wait;
+	output->reset = alsa_reset;
+	output->drain = alsa_drain;
+	output->delay = alsa_delay;
+	output->destroy = alsa_destroy;
+	return output;
+}
+
+/* ----------------------------------- NULL OUTPUT ----------------------------------- */
+
+typedef struct null_output {
+	int realtime;
+	int16_t *scratch;
+	// Emulated device buffer (realtime): frames queued since [started]
+	double started;
+	uint64_t queued;
+	size_t buffer_frames;
+	size_t period_frames;
+} NullOutput;
+
+// Frames the emulated device has room for (an underrun restarts its clock)
+static size_t null_room(AudioOutput *output, NullOutput *null)
+{
+	if (null->queued == 0)
+		return null->buffer_frames;
+	double played = (output_now() - null->started) * output->rate;
+	if (played >= null->queued) {
+		output->stats.underruns++;
+		null->queued = 0;
+		return null->buffer_frames;
+	}
+	return null->buffer_frames - (null->queued - (uint64_t)played);
+}
+
+static int null_open(AudioOutput *output)
+{
+	NullOutput *null = (NullOutput *)output->state;
+	null->scratch = (int16_t *)malloc(OUTPUT_CHUNK_FRAMES * output->channels * sizeof(int16_t));
+	if (null->scratch == NULL)
+		return -ENOMEM;
+	// Same buffer as the sound card would get, woken up every quarter of it
+	null->buffer_frames = (size_t)((double)output->rate * OUTPUT_LATENCY / 1000000);
+	null->period_frames = null->buffer_frames / 4;
+	null->queued = 0;
+	return 0;
+}
+
+static int null_begin(AudioOutput *output, int16_t **buffer, size_t *frame_count)
+{
+	NullOutput *null = (NullOutput *)output->state;
+	if (*frame_count > OUTPUT_CHUNK_FRAMES)
+		*frame_count = OUTPUT_CHUNK_FRAMES;
+	if (null->realtime) {
+		size_t room = null_room(output, null);
+		if (*frame_count > room)
+			*frame_count = room;
+	}
+	*buffer = null->scratch;
+	return 0;
+}
+
+static int null_commit(AudioOutput *output, size_t frame_count)
+{
+	NullOutput *null = (NullOutput *)output->state;
+	if (null->realtime) {
+		if (null->queued == 0)
+			null->started = output_now();
+		null->queued += frame_count;
+	}
+	return 0;
+}
+
+static int null_wait(AudioOutput *output, int wake_fd)
+{
+	NullOutput *null = (NullOutput *)output->state;
+	if (!null->realtime)
+		return 0;
+	size_t room = null_room(output, null);
+	if (room >= null->period_frames)
+		return 0;
+
+	// Until a period was played
+	double seconds = (double)(null->period_frames - room) / output->rate;
+	struct timespec timeout = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+	struct pollfd pfd = { wake_fd, POLLIN, 0 };
+	if (ppoll(&pfd, 1, &timeout, NULL) < 0 && errno != EINTR)
+		return -errno;
+	return 0;
+}
+
+static int null_reset(AudioOutput *output)
+{
+	NullOutput *null = (NullOutput *)output->state;
+	null->queued = 0;
+	return 0;
+}
+
+static int null_delay(AudioOutput *output, size_t *frame_count)
+{
+	NullOutput *null = (NullOutput *)output->state;
+	*frame_count = null->realtime ? null->buffer_frames - null_room(output, null) : 0;
+	return 0;
+}
+
+static int null_drain(AudioOutput *output)
+{
+	NullOutput *null = (NullOutput *)output->state;
+	if (null->realtime && null->queued > 0) {
+		double seconds = null->started + (double)null->queued / output->rate - output_now();
+		if (seconds > 0) {
+			struct timespec remaining = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+			while (nanosleep(&remaining, &remaining) < 0 && errno == EINTR)
+				;
+		}
+	}
+	null->queued = 0;
+	return 0;
+}
+
+static void null_destroy(AudioOutput *output)
+{
+	NullOutput *null = (NullOutput *)output->state;
+	free(null->scratch);
+	free(null);
+}
+
+/**
+* Output Null Create (throws the frames away, to run the playback pipeline without a sound card)
+* @param realtime Consume the frames at the sample rate like a sound card, otherwise as fast as they come
+* @returns pointer to the new output
+*/
+AudioOutput *output_null_create(int realtime)
+{
+	NullOutput *null = (NullOutput *)calloc(1, sizeof(NullOutput));
+	if (null == NULL)
+		return NULL;
+	null->realtime = realtime;
+
+	AudioOutput *output = output_new(realtime ? "null:realtime" : "null", null);
+	if (output == NULL) {
+		free(null);
+		return NULL;
+	}
+	output->open = null_open;
+	output->begin = null_begin;
+	output->commit = null_commit;
+	output->wait = null_wait;
+	output->reset = null_reset;
+	output->drain = null_drain;
+	output->delay = null_delay;
+	output->destroy = null_destroy;
+	return output;
+}
+
+/* ----------------------------------- FILE OUTPUT ----------------------------------- */
+
+typedef struct file_output {
+	const char *filepath;
+	int flags;
+	WaveWriter *writer;
+} FileOutput;
+
+static int file_open(AudioOutput *output)
+{
+	FileOutput *file = (FileOutput *)output->state;
+	errno = 0;
+	file->writer = wave_writer_open(file->filepath, WAVE_FORMAT_PCM, output->channels, output->rate, 16, file->flags);
+	if (file->writer == NULL) {
+		int error = errno != 0 ? errno : EINVAL;
+		fprintf(stderr, "Could not create \"%s\": %s\n", file->filepath, strerror(error));
+		return -error;
+	}
+	return 0;
+}
+
+// The frames are rendered straight into the buffer of the writer
+static int file_begin(AudioOutput *output, int16_t **buffer, size_t *frame_count)
+{
+	FileOutput *file = (FileOutput *)output->state;
+	*buffer = (int16_t *)wave_writer_reserve(file->writer, frame_count);
+	return *buffer != NULL ? 0 : -EIO;
+}
+
+static int file_commit(AudioOutput *output, size_t frame_count)
+{
+	FileOutput *file = (FileOutput *)output->state;
+	wave_writer_commit(file->writer, frame_count);
+	return 0;
+}
+
+static int file_wait(AudioOutput *output, int wake_fd)
+{
+	return 0;
+}
+
+// Whatever was committed is already part of the file
+static int file_reset(AudioOutput *output)
+{
+	return 0;
+}
+
+// The writer only patches the header when it is closed (by destroy), nothing waits to be played
+static int file_drain(AudioOutput *output)
+{
+	FileOutput *file = (FileOutput *)output->state;
+	return file->writer->failed ? -EIO : 0;
+}
+
+// Frames are never waiting to be played either
+static int file_delay(AudioOutput *output, size_t *frame_count)
+{
+	*frame_count = 0;
+	return 0;
+}
+
+static void file_destroy(AudioOutput *output)
+{
+	FileOutput *file = (FileOutput *)output->state;
+	if (file->writer != NULL && !wave_writer_close(file->writer))
+		fprintf(stderr, "Could not finish \"%s\"\n", file->filepath);
+	free(file);
+}
+
+/**
+* Output File Create (writes the frames to a 16 bit PCM WAV file, as fast as they come)
+* The file is complete (sizes in the header, RF64 past 4 GB) once the output is destroyed
+* @param filepath Path of the file to create
+* @param direct Write with O_DIRECT so big renders do not fill the page cache
+* @returns pointer to the new output
+*/
+AudioOutput *output_file_create(const char *filepath, int direct)
+{
+	FileOutput *file = (FileOutput *)calloc(1, sizeof(FileOutput));
+	if (file == NULL)
+		return NULL;
+	file->filepath = filepath;
+	file->flags = direct ? WAVE_WRITER_DIRECT : 0;
+
+	AudioOutput *output = output_new("file", file);
+	if (output == NULL) {
+		free(file);
+		return NULL;
+	}
+	output->open = file_open;
+	output->begin = file_begin;
+	output->commit = file_commit;
+	output->wait = file_wait;
+	output->reset = file_reset;
+	output->drain = file_drain;
+	output->delay = file_delay;
+	output->destroy = file_destroy;
+	return output;
+}
+
+/* ----------------------------------- AUXILIARY FUNCTIONS ----------------------------------- */
+
+static double output_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static AudioOutput *output_new(const char *name, void *state)
+{
+	AudioOutput *output = (AudioOutput *)calloc(1, sizeof(AudioOutput));
+	if (output == NULL)
+		return NULL;
+	output->name = name;
+	output->state = state;
+	return output;
+}
@@ -0,0 +1,909 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "wavelib.h"
+
+#include "output.h"
+
+#include "player.h"
+
+#define RESAMPLE_QUALITY WAVE_RESAMPLE_MEDIUM
+// How often the progress of the wave being played is refreshed (in milliseconds)
+#define PLAYER_REFRESH_INTERVAL 1000
+
+/* -- Private Functions -- */
+static int player_open_output(Player *player);
+static int player_start(Player *player);
+static void player_stop(Player *player);
+static void player_sync_session(Player *player, Wave **announced);
+static uint64_t player_heard_frame(Player *player, Wave *wave, uint64_t frame_index);
+static Wave *player_session_next(Player *player, Wave *wave);
+static void *player_producer(void *arg);
+static void *player_audio(void *arg);
+static PlayerSlot *ring_acquire(Player *player);
+static void ring_publish(PlayerRing *ring, PlayerSlot *slot, unsigned generation);
+static PlayerSlot *ring_front(Player *player);
+static void ring_release(PlayerRing *ring);
+static void event_signal(int fd);
+static void event_clear(int fd);
+static void event_wait(int fd);
+static int player_track_prepare(Player *player, PlayerTrack *track, Wave *wave, uint64_t frame_index);
+static void player_track_release(PlayerTrack *track);
+static size_t player_render(Player *player, PlayerTrack *track, const int16_t **frames);
+static size_t player_render_view(Player *player, PlayerTrack *track, PlayerSlot *slot);
+static void player_track_prefetch(Player *player, PlayerTrack *track);
+static int player_export_period(Player *player, PlayerTrack *track);
+static void player_slot_copy(Player *player, PlayerSlot *slot, size_t first, size_t frame_count, int16_t *dst);
+static void player_remix(const int16_t *src, int src_channels, int16_t *dst, int dst_channels, size_t frame_count);
+
+/**
+* Player Create
+* The output is only opened by the first play and then kept open until the player is destroyed.
+* Playing runs on two threads: a producer that reads, converts and resamples the waves into a ring of periods
+* and an audio thread that only moves periods from the ring to the output
+* @param output Output the waves are played on (destroyed with the player)
+* @param channels Channels of the device (every track is remixed to them)
+* @param rate Sample rate of the device (every track is resampled to it)
+* @param period_size Number of frames read from a wave at a time
+* @param realtime_priority SCHED_FIFO priority of the audio thread, 0 to keep the default scheduler.
+* The memory of the process is also locked so the audio thread never waits for a page fault
+* @returns pointer to the new player object
+*/
+Player *player_create(AudioOutput *output, int channels, int rate, size_t period_size, int realtime_priority)
+{
+	Player *player = (Player *)calloc(1, sizeof(Player));
+	if (player == NULL)
+		return NULL;
+	player->output = output;
+	player->channels = channels;
+	player->rate = rate;
+	player->period_size = period_size;
+	player->realtime_priority = realtime_priority;
+
+	player->ring.frames = (int16_t *)calloc(PLAYER_RING_PERIODS * period_size * channels, sizeof(int16_t));
+	if (player->ring.frames == NULL) {
+		free(player);
+		return NULL;
+	}
+	for (int i = 0; i < PLAYER_RING_PERIODS; i++)
+		player->ring.slots[i].frames = player->ring.frames + i * period_size * channels;
+	pthread_mutex_init(&player->session_lock, NULL);
+
+	player->ring.producer_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	player->ring.audio_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	player->ui_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	player->refresh_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (player->ring.producer_event < 0 || player->ring.audio_event < 0 || player->ui_event < 0 || player->refresh_timer < 0) {
+		perror("Could not create the player events");
+		player_destroy(player);
+		return NULL;
+	}
+
+	// Only what is mapped now (not the waves mapped later, which can be huge)
+	if (realtime_priority > 0 && mlockall(MCL_CURRENT) < 0)
+		fprintf(stderr, "mlockall failed: %s\n", strerror(errno));
+	return player;
+}
+
+/**
+* Player Play
+* Plays the session queue from its first wave until it is empty or the user pauses.
+* The next wave is prepared as soon as the current one starts and its first period is written
+* right after the last period of the current one, without draining the device in between.
+* The calling thread sleeps in poll until the user types a command, the device starts another wave
+* or the progress has to be refreshed
+* @param player Pointer to the player object
+* @param session Queue of waves and source of user commands
+* @returns 0 when the queue was played to the end, WAVE_PAUSE if the user paused or -1 if the device failed
+*/
+int player_play(Player *player, PlayerSession *session)
+{
+	if (player_open_output(player) < 0)
+		return -1;
+
+	Wave *wave = session->peek(session->context, 0);
+	if (wave == NULL)
+		return 0;
+	player->session = session;
+
+	// Resume the paused wave where it stopped
+	uint64_t start_frame = wave == player->resume_wave ? player->resume_frame : 0;
+	player->resume_wave = NULL;
+	// A wave that cannot be prepared is left finished and gets skipped by the producer
+	player_track_prepare(player, &player->current, wave, start_frame);
+	player_track_prepare(player, &player->next, player_session_next(player, wave), 0);
+
+	if (player_start(player) < 0) {
+		player_track_release(&player->current);
+		player_track_release(&player->next);
+		return -1;
+	}
+
+	struct itimerspec refresh = {
+		{ PLAYER_REFRESH_INTERVAL / 1000, PLAYER_REFRESH_INTERVAL % 1000 * 1000000L },
+		{ PLAYER_REFRESH_INTERVAL / 1000, PLAYER_REFRESH_INTERVAL % 1000 * 1000000L }
+	};
+	timerfd_settime(player->refresh_timer, 0, &refresh, NULL);
+
+	// A negative descriptor (no input) is ignored by poll
+	struct pollfd fds[3] = {
+		{ session->input_fd, POLLIN, 0 },
+		{ player->ui_event, POLLIN, 0 },
+		{ player->refresh_timer, POLLIN, 0 }
+	};
+	Wave *announced = NULL;
+	while (!atomic_load(&player->finished))
+	{
+		if (poll(fds, 3, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (fds[1].revents & POLLIN)
+			event_clear(player->ui_event);
+
+		int command = fds[0].revents & POLLIN ? session->poll_command(session->context) : 0;
+		if (command == WAVE_PAUSE)
+		{
+			player_stop(player);
+			player_sync_session(player, &announced);
+			// What the output still holds was not heard, it is thrown away by the reset
+			Wave *playing = atomic_load(&player->playing);
+			player->resume_wave = playing != NULL ? playing : wave;
+			player->resume_frame = playing != NULL ? player_heard_frame(player, playing, player->written_frame) : start_frame;
+			player->output->reset(player->output);
+			player_track_release(&player->current);
+			player_track_release(&player->next);
+			return WAVE_PAUSE;
+		}
+		// The producer starts the next wave and the audio thread throws away what was queued
+		if (command == WAVE_NEXT) {
+			atomic_store(&player->command, WAVE_NEXT);
+			// The producer may be asleep on a full ring
+			event_signal(player->ring.producer_event);
+		}
+
+		player_sync_session(player, &announced);
+		if (fds[2].revents & POLLIN) {
+			event_clear(player->refresh_timer);
+			if (announced != NULL)
+				session->track_progress(session->context, announced, atomic_load(&player->played_frame));
+		}
+	}
+
+	player_stop(player);
+	player_track_release(&player->current);
+	player_track_release(&player->next);
+
+	int error = atomic_load(&player->error);
+	if (error < 0) {
+		printf("Output %s failed: %s\r\n", player->output->name, strerror(-error));
+		player->output->reset(player->output);
+		return -1;
+	}
+
+	// Everything was played
+	pthread_mutex_lock(&player->session_lock);
+	while (session->peek(session->context, 0) != NULL)
+		session->pop(session->context);
+	pthread_mutex_unlock(&player->session_lock);
+	return 0;
+}
+
+/**
+* Player Forget
+* Drops the resume point of [wave] before the session destroys it (a wave allocated later at the same
+* address would otherwise start where the destroyed one was paused)
+* @param player Pointer to the player object
+* @param wave Wave leaving the session or NULL for all of them
+*/
+void player_forget(Player *player, const Wave *wave)
+{
+	if (wave == NULL || player->resume_wave == wave)
+		player->resume_wave = NULL;
+}
+
+/**
+* Player Destroy
+* Destroys the output and frees the player object
+* @param player Pointer to the player object to destroy
+*/
+void player_destroy(Player *player)
+{
+	if (player == NULL)
+		return;
+	player_track_release(&player->current);
+	player_track_release(&player->next);
+	output_destroy(player->output);
+	close(player->ring.producer_event);
+	close(player->ring.audio_event);
+	close(player->ui_event);
+	close(player->refresh_timer);
+	pthread_mutex_destroy(&player->session_lock);
+	free(player->ring.frames);
+	free(player);
+}
+
+/**
+* Player Export
+* Renders the waves of a session into an output through the same conversion, remix and resampling as playing,
+* but on the calling thread and as fast as the output takes the frames. The session queue is only peeked
+* (pop, poll_command and track_progress are not called) so the waves stay queued
+* @param session Waves to render, from index 0 until peek returns NULL (track_started is called for each)
+* @param output Output to render into (opened and drained here, destroyed by the caller)
+* @param channels Channels of the rendered frames
+* @param rate Sample rate of the rendered frames
+* @param period_size Number of frames rendered at a time (large periods keep the per-period cost out of the way)
+* @returns 0 if every wave was rendered or -1 if the output failed
+*/
+int player_export(PlayerSession *session, AudioOutput *output, int channels, int rate, size_t period_size)
+{
+	// Only the track fields of a player are used, there is no ring and no thread
+	Player exporter;
+	memset(&exporter, 0, sizeof(Player));
+	exporter.output = output;
+	exporter.channels = channels;
+	exporter.rate = rate;
+	exporter.period_size = period_size;
+	if (output_open(output, channels, rate) < 0)
+		return -1;
+
+	// The next wave is prepared early so its first frames are read while the current one renders
+	size_t index = 0;
+	player_track_prepare(&exporter, &exporter.current, session->peek(session->context, index), 0);
+	player_track_prepare(&exporter, &exporter.next, session->peek(session->context, index + 1), 0);
+	int result = 0;
+	while (exporter.current.wave != NULL && result >= 0)
+	{
+		session->track_started(session->context, exporter.current.wave);
+		while (!exporter.current.finished && result >= 0)
+			result = player_export_period(&exporter, &exporter.current);
+
+		player_track_release(&exporter.current);
+		exporter.current = exporter.next;
+		index++;
+		player_track_prepare(&exporter, &exporter.next, session->peek(session->context, index + 1), 0);
+	}
+	player_track_release(&exporter.current);
+	player_track_release(&exporter.next);
+
+	if (result >= 0)
+		result = output->drain(output);
+	if (result < 0) {
+		fprintf(stderr, "Could not write to the output: %s\n", strerror(-result));
+		return -1;
+	}
+	return 0;
+}
+
+/* ----------------------------------- PLAYER THREADS ----------------------------------- */
+
+/**
+* Empty the ring and start the producer and the audio threads
+* @returns 0 if both threads are running or -1 if not
+*/
+static int player_start(Player *player)
+{
+	PlayerRing *ring = &player->ring;
+	atomic_store(&ring->head, 0);
+	atomic_store(&ring->tail, 0);
+	atomic_store(&ring->producer_waiting, 0);
+	atomic_store(&ring->audio_waiting, 0);
+	event_clear(ring->producer_event);
+	event_clear(ring->audio_event);
+	event_clear(player->ui_event);
+
+	atomic_store(&player->running, 1);
+	atomic_store(&player->command, 0);
+	atomic_store(&player->generation, 0);
+	atomic_store(&player->playing, NULL);
+	atomic_store(&player->played_frame, 0);
+	player->written_frame = 0;
+	atomic_store(&player->finished, 0);
+	atomic_store(&player->error, 0);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (player->realtime_priority > 0) {
+		struct sched_param param = { .sched_priority = player->realtime_priority };
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	int result = pthread_create(&player->audio_thread, &attr, player_audio, player);
+	pthread_attr_destroy(&attr);
+	if (result == EPERM) {
+		fprintf(stderr, "Not allowed to use SCHED_FIFO, the audio thread keeps the default scheduler\r\n");
+		result = pthread_create(&player->audio_thread, NULL, player_audio, player);
+	}
+	if (result != 0) {
+		fprintf(stderr, "Could not start the audio thread: %s\r\n", strerror(result));
+		return -1;
+	}
+
+	result = pthread_create(&player->producer_thread, NULL, player_producer, player);
+	if (result != 0) {
+		fprintf(stderr, "Could not start the producer thread: %s\r\n", strerror(result));
+		atomic_store(&player->running, 0);
+		event_signal(ring->audio_event);
+		pthread_join(player->audio_thread, NULL);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+* Stop both threads (they are woken up if they are sleeping) and wait for them
+*/
+static void player_stop(Player *player)
+{
+	struct itimerspec disarm = { { 0, 0 }, { 0, 0 } };
+	timerfd_settime(player->refresh_timer, 0, &disarm, NULL);
+
+	atomic_store(&player->running, 0);
+	event_signal(player->ring.producer_event);
+	event_signal(player->ring.audio_event);
+	pthread_join(player->producer_thread, NULL);
+	pthread_join(player->audio_thread, NULL);
+}
+
+/**
+* Remove the waves the device already went past from the session and announce the one it is playing
+* @param announced Last wave announced, updated when the device started a new one
+*/
+static void player_sync_session(Player *player, Wave **announced)
+{
+	Wave *playing = atomic_load(&player->playing);
+	if (playing == NULL || playing == *announced)
+		return;
+
+	PlayerSession *session = player->session;
+	pthread_mutex_lock(&player->session_lock);
+	Wave *first;
+	while ((first = session->peek(session->context, 0)) != NULL && first != playing)
+		session->pop(session->context);
+	pthread_mutex_unlock(&player->session_lock);
+
+	session->track_started(session->context, playing);
+	*announced = playing;
+}
+
+/**
+* Position the listener is at in [wave] when the frames up to [frame_index] were handed to the output
+* (the output still holds some of them)
+* @returns the position, 0 if what the output holds goes back to an earlier wave
+*/
+static uint64_t player_heard_frame(Player *player, Wave *wave, uint64_t frame_index)
+{
+	size_t delay;
+	if (player->output->delay(player->output, &delay) < 0)
+		return frame_index;
+	// The output counts frames at the rate of the device
+	uint64_t behind = (uint64_t)delay * wave_get_sample_rate(wave) / player->rate;
+	return frame_index > behind ? frame_index - behind : 0;
+}
+
+/**
+* Wave that follows [wave] in the session queue
+* @returns the next wave or NULL if [wave] is the last one
+*/
+static Wave *player_session_next(Player *player, Wave *wave)
+{
+	PlayerSession *session = player->session;
+	Wave *next = NULL;
+	pthread_mutex_lock(&player->session_lock);
+	for (size_t i = 0; (next = session->peek(session->context, i)) != NULL; i++)
+		if (next == wave) {
+			next = session->peek(session->context, i + 1);
+			break;
+		}
+	pthread_mutex_unlock(&player->session_lock);
+	return next;
+}
+
+/**
+* Producer thread: renders the current track period by period into the ring and
+* moves on to the prepared next track when it ends. Blocks only while the ring is full
+*/
+static void *player_producer(void *arg)
+{
+	Player *player = (Player *)arg;
+	size_t frame_size = player->channels * sizeof(int16_t);
+	unsigned generation = 0;
+	// Slot being filled (published when full or at the end of its track)
+	PlayerSlot *slot = NULL;
+	// Wave the device goes to after the last skip (its older frames were thrown away)
+	Wave *skipped_to = NULL;
+
+	while (atomic_load(&player->running))
+	{
+		if (player->current.wave == NULL) {
+			// End of the queue, there is nothing left to skip to
+			atomic_store(&player->command, 0);
+			if (slot == NULL && (slot = ring_acquire(player)) == NULL)
+				continue;
+			slot->wave = NULL;
+			slot->frame_count = 0;
+			ring_publish(&player->ring, slot, generation);
+			break;
+		}
+
+		if (atomic_exchange(&player->command, 0) == WAVE_NEXT) {
+			generation = atomic_fetch_add(&player->generation, 1) + 1;
+			if (slot != NULL)
+				slot->frame_count = 0;
+			// The audio thread throws the older slots away as soon as it leaves the output wait
+			event_signal(player->ring.audio_event);
+			// The ring runs ahead of the device: while the end of an earlier wave is heard the current one only
+			// starts over, the frames of both are thrown away
+			Wave *playing = atomic_load(&player->playing);
+			if (playing != NULL && playing != player->current.wave && skipped_to != player->current.wave) {
+				Wave *wave = player->current.wave;
+				player_track_release(&player->current);
+				player_track_prepare(player, &player->current, wave, 0);
+				skipped_to = wave;
+			} else {
+				player->current.finished = 1;
+				skipped_to = player->next.wave;
+			}
+		} else if (player->current.direct) {
+			if (slot == NULL && (slot = ring_acquire(player)) == NULL)
+				continue;
+			if (player_render_view(player, &player->current, slot) > 0) {
+				ring_publish(&player->ring, slot, generation);
+				slot = NULL;
+			}
+		} else {
+			const int16_t *frames;
+			size_t frame_count = player_render(player, &player->current, &frames);
+			while (frame_count > 0) {
+				// The frames left are thrown away by the skip
+				if (slot == NULL && (slot = ring_acquire(player)) == NULL)
+					break;
+				size_t copy = player->period_size - slot->frame_count;
+				if (copy > frame_count)
+					copy = frame_count;
+				memcpy(slot->frames + slot->frame_count * player->channels, frames, copy * frame_size);
+				slot->wave = player->current.wave;
+				slot->frame_index = player->current.frame_index;
+				slot->frame_count += copy;
+				frames += copy * player->channels;
+				frame_count -= copy;
+				if (slot->frame_count == player->period_size) {
+					ring_publish(&player->ring, slot, generation);
+					slot = NULL;
+				}
+			}
+		}
+
+		if (player->current.finished) {
+			// Slots never hold frames of two waves, so the audio thread always knows what it is playing
+			if (slot != NULL && slot->frame_count > 0) {
+				ring_publish(&player->ring, slot, generation);
+				slot = NULL;
+			}
+			player_track_release(&player->current);
+			player->current = player->next;
+			memset(&player->next, 0, sizeof(PlayerTrack));
+			if (player->current.wave != NULL)
+				player_track_prepare(player, &player->next, player_session_next(player, player->current.wave), 0);
+		}
+	}
+	return NULL;
+}
+
+/**
+* Audio thread: writes the periods of the ring to the output and publishes what is being played.
+* Sleeps in the output until it has room for a period.
+* Takes no locks, the only memory it reads besides the ring is the mapped wave of direct slots (prefetched by the producer)
+*/
+static void *player_audio(void *arg)
+{
+	Player *player = (Player *)arg;
+	AudioOutput *output = player->output;
+	unsigned generation = 0;
+	PlayerSlot *slot;
+	// Frames of the slot at the head of the ring already written to the output
+	size_t written = 0;
+
+	while ((slot = ring_front(player)) != NULL)
+	{
+		if (written == 0) {
+			if (slot->generation != atomic_load(&player->generation)) {
+				// Skipped by the user
+				ring_release(&player->ring);
+				continue;
+			}
+			if (slot->generation != generation) {
+				// First period after a skip: throw away what the output still holds
+				output->reset(output);
+				generation = slot->generation;
+			}
+		}
+
+		if (slot->wave == NULL) {
+			output->drain(output);
+			ring_release(&player->ring);
+			atomic_store(&player->finished, 1);
+			event_signal(player->ui_event);
+			break;
+		}
+
+		// Copied (or converted) straight into the buffer of the output
+		int16_t *buffer;
+		size_t frame_count = slot->frame_count - written;
+		int result = output->begin(output, &buffer, &frame_count);
+		if (result >= 0 && frame_count == 0) {
+			// Sleep until the output needs data
+			result = output_wait(output, player->ring.audio_event);
+			event_clear(player->ring.audio_event);
+			if (result >= 0)
+				continue;
+		}
+		if (result >= 0) {
+			player_slot_copy(player, slot, written, frame_count, buffer);
+			result = output_commit(output, frame_count);
+		}
+		if (result < 0) {
+			atomic_store(&player->error, result);
+			atomic_store(&player->finished, 1);
+			event_signal(player->ui_event);
+			break;
+		}
+
+		written += frame_count;
+		if (written < slot->frame_count)
+			continue;
+		written = 0;
+		player->written_frame = slot->frame_index;
+		atomic_store(&player->played_frame, player_heard_frame(player, slot->wave, slot->frame_index));
+		if (atomic_exchange(&player->playing, slot->wave) != slot->wave)
+			event_signal(player->ui_event);
+		ring_release(&player->ring);
+	}
+	return NULL;
+}
+
+/* ----------------------------------- RING FUNCTIONS ----------------------------------- */
+
+/**
+* Producer side: wait for a free slot. Once the ring is full the producer sleeps until half of it was played
+* or the user asks for the next wave
+* @returns the slot at the tail of the ring or NULL if the player is stopping or a command is pending
+*/
+static PlayerSlot *ring_acquire(Player *player)
+{
+	PlayerRing *ring = &player->ring;
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	while (atomic_load(&player->running) && atomic_load(&player->command) == 0 &&
+			tail - atomic_load(&ring->head) == PLAYER_RING_PERIODS) {
+		atomic_store(&ring->producer_waiting, 1);
+		// Checked again after the flag is set, a release in between would not signal
+		if (tail - atomic_load(&ring->head) < PLAYER_RING_PERIODS)
+			break;
+		event_wait(ring->producer_event);
+	}
+	if (!atomic_load(&player->running) || atomic_load(&player->command) != 0)
+		return NULL;
+	PlayerSlot *slot = &ring->slots[tail % PLAYER_RING_PERIODS];
+	slot->frame_count = 0;
+	slot->source = NULL;
+	return slot;
+}
+
+/**
+* Producer side: hand the slot at the tail of the ring to the audio thread
+*/
+static void ring_publish(PlayerRing *ring, PlayerSlot *slot, unsigned generation)
+{
+	slot->generation = generation;
+	atomic_fetch_add(&ring->tail, 1);
+	if (atomic_load(&ring->audio_waiting) && atomic_exchange(&ring->audio_waiting, 0))
+		event_signal(ring->audio_event);
+}
+
+/**
+* Audio thread side: wait for a filled slot
+* @returns the slot at the head of the ring or NULL if the player is stopping
+*/
+static PlayerSlot *ring_front(Player *player)
+{
+	PlayerRing *ring = &player->ring;
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	while (atomic_load(&player->running) && head == atomic_load(&ring->tail)) {
+		atomic_store(&ring->audio_waiting, 1);
+		if (head != atomic_load(&ring->tail))
+			break;
+		event_wait(ring->audio_event);
+	}
+	if (!atomic_load(&player->running))
+		return NULL;
+	return &ring->slots[head % PLAYER_RING_PERIODS];
+}
+
+/**
+* Audio thread side: give the slot at the head of the ring back to the producer
+*/
+static void ring_release(PlayerRing *ring)
+{
+	size_t head = atomic_fetch_add(&ring->head, 1) + 1;
+	if (atomic_load(&ring->producer_waiting)
+			&& atomic_load_explicit(&ring->tail, memory_order_relaxed) - head <= PLAYER_RING_PERIODS / 2
+			&& atomic_exchange(&ring->producer_waiting, 0))
+		event_signal(ring->producer_event);
+}
+
+/**
+* Wake up the thread sleeping on an eventfd
+*/
+static void event_signal(int fd)
+{
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("eventfd write");
+}
+
+/**
+* Reset an eventfd after it was signaled
+*/
+static void event_clear(int fd)
+{
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror("eventfd read");
+}
+
+/**
+* Sleep until an eventfd is signaled
+*/
+static void event_wait(int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	if (poll(&pfd, 1, -1) > 0)
+		event_clear(fd);
+}
+
+/* ----------------------------------- AUXILIARY FUNCTIONS ----------------------------------- */
+
+/**
+* Open the output the first time and get it ready to be written to
+* @returns 0 if the output is ready or -1 if not
+*/
+static int player_open_output(Player *player)
+{
+	if (!player->opened) {
+		if (output_open(player->output, player->channels, player->rate) < 0)
+			return -1;
+		player->opened = 1;
+	}
+	return player->output->reset(player->output) < 0 ? -1 : 0;
+}
+
+/**
+* Prepare a wave to be played: pick its conversion kernel, create its resampler, allocate its buffers
+* and ask the kernel to start reading its first frames
+* @param track Track to fill (left empty if [wave] is NULL or cannot be played)
+* @returns 0 if the track is ready or -1 if not
+*/
+static int player_track_prepare(Player *player, PlayerTrack *track, Wave *wave, uint64_t frame_index)
+{
+	memset(track, 0, sizeof(PlayerTrack));
+	if (wave == NULL)
+		return -1;
+
+	WaveSampleFormat sample_format = wave_get_sample_format(wave);
+	if (sample_format == WAVE_SAMPLE_UNKNOWN) {
+		fprintf(stderr, "Unsupported sample format (%d bits, format 0x%x)\r\n",
+				wave_get_bits_per_sample(wave), wave->header.audio_format);
+		// Still queued so it gets skipped when its turn comes
+		track->wave = wave;
+		track->finished = 1;
+		return -1;
+	}
+
+	track->wave = wave;
+	track->channels = wave_get_number_of_channels(wave);
+	track->frame_index = frame_index;
+	track->convert = wave_convert_select(sample_format);
+
+	// The buffer holds a period in the file format and after the conversion and the remix
+	int max_channels = track->channels > player->channels ? track->channels : player->channels;
+	size_t frame_size = wave->header.block_align > 2 * max_channels ? wave->header.block_align : 2 * max_channels;
+	track->buffer = (uint8_t *)malloc(player->period_size * frame_size);
+
+	if (wave_get_sample_rate(wave) != player->rate) {
+		track->resampler = wave_resampler_create(player->channels, wave_get_sample_rate(wave), player->rate, RESAMPLE_QUALITY);
+		if (track->resampler != NULL) {
+			// Room for a period and for the frames the filter flushes at the end
+			size_t resampled_frames = wave_resampler_output_frames(track->resampler, player->period_size + track->resampler->taps);
+			track->resampled = (int16_t *)malloc(resampled_frames * player->channels * sizeof(int16_t));
+		}
+	}
+
+	if (track->buffer == NULL || (wave_get_sample_rate(wave) != player->rate && track->resampled == NULL)) {
+		fprintf(stderr, "Could not prepare \"%s\"\r\n", wave->filepath);
+		player_track_release(track);
+		track->wave = wave;
+		track->finished = 1;
+		return -1;
+	}
+
+	// Streamed waves replace their windows, so a view would not outlive the next read
+	track->direct = wave->stream == NULL && track->resampler == NULL && track->channels == player->channels;
+
+	wave_prefetch(wave, frame_index, wave_get_sample_rate(wave));
+	track->prefetched = frame_index + wave_get_sample_rate(wave);
+	return 0;
+}
+
+/**
+* Release the resources of a track (the wave itself belongs to the session)
+*/
+static void player_track_release(PlayerTrack *track)
+{
+	wave_resampler_destroy(track->resampler);
+	free(track->resampled);
+	free(track->buffer);
+	memset(track, 0, sizeof(PlayerTrack));
+}
+
+/**
+* Render the next period of a track in the device format (converted, remixed and resampled)
+* @param frames Receives a pointer to the rendered frames
+* @returns number of frames rendered (0 does not mean the end, the track is finished when [finished] is set)
+*/
+static size_t player_render(Player *player, PlayerTrack *track, const int16_t **frames)
+{
+	if (track->finished)
+		return 0;
+
+	size_t read_frames = wave_get_samples(track->wave, track->frame_index, track->buffer, player->period_size) / track->channels;
+	track->frame_index += read_frames;
+	player_track_prefetch(player, track);
+
+	if (read_frames == 0) {
+		// Get the last frames out of the resampler filter
+		track->finished = 1;
+		*frames = track->resampled;
+		return track->resampler != NULL ? wave_resampler_flush(track->resampler, track->resampled) : 0;
+	}
+
+	int16_t *samples = (int16_t *)track->buffer;
+	if (track->convert != NULL)
+		track->convert(track->buffer, samples, read_frames * track->channels);
+	if (track->channels != player->channels)
+		player_remix(samples, track->channels, samples, player->channels, read_frames);
+
+	if (track->resampler != NULL) {
+		*frames = track->resampled;
+		return wave_resampler_process(track->resampler, samples, read_frames, track->resampled);
+	}
+	*frames = samples;
+	return read_frames;
+}
+
+/**
+* Point a slot at the next period of a direct track, without copying it
+* @returns number of frames in the slot (0 when the track ended)
+*/
+static size_t player_render_view(Player *player, PlayerTrack *track, PlayerSlot *slot)
+{
+	const uint8_t *view;
+	size_t frame_count = wave_get_samples_view(track->wave, track->frame_index, player->period_size, &view);
+	if (frame_count == 0) {
+		track->finished = 1;
+		return 0;
+	}
+	track->frame_index += frame_count;
+	player_track_prefetch(player, track);
+
+	slot->wave = track->wave;
+	slot->frame_index = track->frame_index;
+	slot->frame_count = frame_count;
+	slot->source = view;
+	slot->source_frame_size = track->wave->header.block_align;
+	slot->convert = track->convert;
+	return frame_count;
+}
+
+/**
+* Keep the kernel reading ahead of a track, whoever renders it must not wait for the disk.
+* The window is a second of the wave or four periods when the periods are longer (exports)
+*/
+static void player_track_prefetch(Player *player, PlayerTrack *track)
+{
+	size_t window = wave_get_sample_rate(track->wave);
+	if (window < 4 * player->period_size)
+		window = 4 * player->period_size;
+	if (track->frame_index + window > track->prefetched) {
+		wave_prefetch(track->wave, track->prefetched, window);
+		track->prefetched += window;
+	}
+}
+
+/**
+* Render the next period of a track and write it to the output of an export
+* @returns 0 or a negative error code of the output
+*/
+static int player_export_period(Player *player, PlayerTrack *track)
+{
+	PlayerSlot slot;
+	memset(&slot, 0, sizeof(PlayerSlot));
+	if (track->direct) {
+		if (player_render_view(player, track, &slot) == 0)
+			return 0;
+	} else {
+		const int16_t *frames;
+		slot.frame_count = player_render(player, track, &frames);
+		slot.frames = (int16_t *)frames;
+	}
+
+	AudioOutput *output = player->output;
+	for (size_t written = 0; written < slot.frame_count;)
+	{
+		int16_t *buffer;
+		size_t frame_count = slot.frame_count - written;
+		int result = output->begin(output, &buffer, &frame_count);
+		if (result < 0)
+			return result;
+		if (frame_count == 0) {
+			// Only outputs with a device buffer ever get full
+			result = output_wait(output, -1);
+			if (result < 0)
+				return result;
+			continue;
+		}
+		player_slot_copy(player, &slot, written, frame_count, buffer);
+		result = output_commit(output, frame_count);
+		if (result < 0)
+			return result;
+		written += frame_count;
+	}
+	return 0;
+}
+
+/**
+* Copy frames of a slot to [dst] in the device format, converting them if they come from a direct track
+* @param first Index of the first frame of the slot to copy
+*/
+static void player_slot_copy(Player *player, PlayerSlot *slot, size_t first, size_t frame_count, int16_t *dst)
+{
+	if (slot->source == NULL)
+		memcpy(dst, slot->frames + first * player->channels, frame_count * player->channels * sizeof(int16_t));
+	else if (slot->convert == NULL)
+		memcpy(dst, slot->source + first * slot->source_frame_size, frame_count * slot->source_frame_size);
+	else
+		slot->convert(slot->source + first * slot->source_frame_size, dst, frame_count * player->channels);
+}
+
+/**
+* Remix frames to another number of channels ([src] and [dst] may be the same buffer).
+* Mono is copied to every channel, otherwise the first [dst_channels] channels are kept
+* and missing channels are silent
+*/
+static void player_remix(const int16_t *src, int src_channels, int16_t *dst, int dst_channels, size_t frame_count)
+{
+	if (dst_channels > src_channels) {
+		// Widening, back to front
+		for (size_t i = frame_count; i-- > 0;)
+			for (int c = dst_channels; c-- > 0;)
+				dst[i * dst_channels + c] = src_channels == 1 ? src[i] : c < src_channels ? src[i * src_channels + c] : 0;
+	} else {
+		for (size_t i = 0; i < frame_count; i++)
+			for (int c = 0; c < dst_channels; c++)
+				dst[i * dst_channels + c] = src[i * src_channels + c];
+	}
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "wavelib.h"
+
+#include "output.h"
+
+#include "player.h"
+
+// Same pipeline as the playlist
+#define BENCH_CHANNELS 2
+#define BENCH_RATE 48000
+#define BENCH_PERIOD 64
+
+// Queue of the waves passed on the command line
+typedef struct bench_queue {
+	Wave **waves;
+	size_t count;
+	size_t first;
+} BenchQueue;
+
+static Wave *bench_peek(void *context, size_t index) {
+	BenchQueue *queue = (BenchQueue *)context;
+	return queue->first + index < queue->count ? queue->waves[queue->first + index] : NULL;
+}
+
+static void bench_pop(void *context) {
+	BenchQueue *queue = (BenchQueue *)context;
+	queue->first++;
+}
+
+static void bench_track_started(void *context, Wave *wave) {
+	fprintf(stderr, "Playing \"%s\"\n", wave->filepath);
+}
+
+static void bench_track_progress(void *context, Wave *wave, uint64_t frame_index) {
+}
+
+static int bench_poll_command(void *context) {
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <null | null:realtime | file:path | alsa[:device]> file.wav...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	AudioOutput *output = output_create(argv[1]);
+	if (output == NULL) {
+		fprintf(stderr, "Unknown output \"%s\"\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	BenchQueue queue = { (Wave **)calloc(argc - 2, sizeof(Wave *)), 0, 0 };
+	for (int i = 2; i < argc; i++) {
+		Wave *wave = wave_load_mapped(argv[i]);
+		if (wave == NULL)
+			fprintf(stderr, "Could not load \"%s\"\n", argv[i]);
+		else
+			queue.waves[queue.count++] = wave;
+	}
+
+	Player *player = player_create(output, BENCH_CHANNELS, BENCH_RATE, BENCH_PERIOD, 0);
+	if (player == NULL) {
+		output_destroy(output);
+		return EXIT_FAILURE;
+	}
+
+	PlayerSession session = { &queue, -1, bench_peek, bench_pop, bench_track_started, bench_track_progress, bench_poll_command };
+	int result = player_play(player, &session);
+	output_stats_print(output, stdout);
+
+	player_destroy(player);
+	for (size_t i = 0; i < queue.count; i++)
+		wave_destroy(queue.waves[i]);
+	free(queue.waves);
+	return result < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
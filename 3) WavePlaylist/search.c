@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "catalog.h"
+
+#include "search.h"
+
+/*
+* Every name of the listing is cut into its trigrams (lower case), and each trigram keeps the positions of the
+* names holding it. A query intersects the lists of the trigrams of its text, starting from the shortest one,
+* and checks the names left really hold the text (their trigrams may be apart). A text of 3 characters is
+* answered by its list alone, shorter texts are matched against every name.
+*/
+
+/* -- Private Functions -- */
+static int catalog_search_build(CatalogSearch *search);
+static void catalog_search_clear(CatalogSearch *search);
+static void radix_sort_trigrams(uint64_t *pairs, uint64_t *buffer, size_t count);
+static uint32_t trigram_at(const char *text);
+static size_t trigram_find(const CatalogSearch *search, uint32_t trigram);
+static size_t gallop(const uint32_t *positions, size_t first, size_t last, uint32_t position);
+
+/**
+* Catalog Search Create
+* @param catalog Catalog whose listing is searched
+* @returns pointer to a new search (its index is built by the first query) or NULL if there was no memory
+*/
+CatalogSearch *catalog_search_create(Catalog *catalog)
+{
+	CatalogSearch *search = (CatalogSearch *)calloc(1, sizeof(CatalogSearch));
+	if (search == NULL)
+		return NULL;
+	search->catalog = catalog;
+	return search;
+}
+
+/**
+* Catalog Search Find
+* Finds the files of the listing whose name holds [text], case aside. The catalog must be locked by the caller,
+* and stay locked while the results are used (they are positions in the listing)
+* @param text Part of the name to look for
+* @param results Filled with the positions of the first [max_results] files found, in the order of the listing
+* @param max_results Size of [results]
+* @returns number of files found (even the ones past [max_results])
+*/
+size_t catalog_search_find(CatalogSearch *search, const char *text, size_t *results, size_t max_results)
+{
+	Catalog *catalog = search->catalog;
+	if (!search->built || search->generation != catalog->generation) {
+		catalog_search_clear(search);
+		// Without memory for the index every name is checked
+		search->built = catalog_search_build(search) == 0;
+		search->generation = catalog->generation;
+	}
+
+	size_t text_length = strlen(text);
+	char lower[text_length + 1];
+	for (size_t i = 0; i <= text_length; i++)
+		lower[i] = tolower((unsigned char)text[i]);
+	size_t found = 0;
+	if (!search->built || text_length < 3) {
+		for (size_t i = 0; i < catalog_size(catalog); i++)
+		{
+			const char *name = strrchr(catalog_get(catalog, i)->path, '/') + 1;
+			if (!strcasestr(name, lower))
+				continue;
+			if (found < max_results)
+				results[found] = i;
+			found++;
+		}
+		return found;
+	}
+
+	// Lists of the trigrams of the text, the shortest one first
+	size_t list_count = text_length - 2;
+	size_t firsts[list_count], lasts[list_count];
+	for (size_t i = 0; i < list_count; i++)
+	{
+		size_t index = trigram_find(search, trigram_at(lower + i));
+		if (index == SIZE_MAX)
+			return 0;
+		firsts[i] = search->offsets[index];
+		lasts[i] = search->offsets[index + 1];
+		if (lasts[i] - firsts[i] < lasts[0] - firsts[0]) {
+			size_t first = firsts[0], last = lasts[0];
+			firsts[0] = firsts[i], lasts[0] = lasts[i];
+			firsts[i] = first, lasts[i] = last;
+		}
+	}
+	for (size_t i = firsts[0]; i < lasts[0]; i++)
+	{
+		// Every list is walked forward once, skipping ahead to the candidate
+		uint32_t position = search->positions[i];
+		int in_all = 1;
+		for (size_t j = 1; j < list_count && in_all; j++) {
+			firsts[j] = gallop(search->positions, firsts[j], lasts[j], position);
+			in_all = firsts[j] < lasts[j] && search->positions[firsts[j]] == position;
+		}
+		if (!in_all || (text_length > 3 && strstr(search->names[position], lower) == NULL))
+			continue;
+		if (found < max_results)
+			results[found] = position;
+		found++;
+	}
+	return found;
+}
+
+/**
+* Catalog Search Destroy
+* @param search Pointer to the search object to free
+*/
+void catalog_search_destroy(CatalogSearch *search)
+{
+	if (search == NULL)
+		return;
+	catalog_search_clear(search);
+	free(search);
+}
+
+/* ----------------------------------- AUXILIARY FUNCTIONS ----------------------------------- */
+
+/**
+* Index the names of the listing (catalog locked)
+* @returns 0 or -1 if there was no memory
+*/
+static int catalog_search_build(CatalogSearch *search)
+{
+	Catalog *catalog = search->catalog;
+	size_t name_count = catalog_size(catalog);
+	if (name_count > UINT32_MAX)
+		return -1;
+	search->names = (const char **)malloc((name_count + 1) * sizeof(char *));
+	if (search->names == NULL)
+		return -1;
+	size_t pair_count = 0, names_size = 0;
+	for (size_t i = 0; i < name_count; i++)
+	{
+		size_t length = strlen(strrchr(catalog_get(catalog, i)->path, '/') + 1);
+		pair_count += length >= 3 ? length - 2 : 0;
+		names_size += length + 1;
+	}
+	// Lower case once, the names checked by a query are compared as they are
+	search->lower_names = (char *)malloc(names_size + 1);
+	if (search->lower_names == NULL)
+		return -1;
+	char *lower = search->lower_names;
+	for (size_t i = 0; i < name_count; i++)
+	{
+		search->names[i] = lower;
+		for (const char *c = strrchr(catalog_get(catalog, i)->path, '/') + 1; *c != '\0'; c++)
+			*lower++ = tolower((unsigned char)*c);
+		*lower++ = '\0';
+	}
+	search->name_count = name_count;
+	if (pair_count > UINT32_MAX)
+		return -1;
+
+	// Trigram in the high half, position in the low one: sorted by trigram, the positions stay in order
+	uint64_t *pairs = (uint64_t *)malloc((pair_count + 1) * sizeof(uint64_t));
+	uint64_t *buffer = (uint64_t *)malloc((pair_count + 1) * sizeof(uint64_t));
+	search->positions = (uint32_t *)malloc((pair_count + 1) * sizeof(uint32_t));
+	if (pairs == NULL || buffer == NULL || search->positions == NULL) {
+		free(pairs);
+		free(buffer);
+		return -1;
+	}
+	size_t k = 0;
+	for (size_t i = 0; i < name_count; i++)
+		for (const char *c = search->names[i]; c[0] != '\0' && c[1] != '\0' && c[2] != '\0'; c++)
+			pairs[k++] = (uint64_t)trigram_at(c) << 32 | i;
+	radix_sort_trigrams(pairs, buffer, pair_count);
+	free(buffer);
+
+	// Compressed lists: a name holding a trigram twice is listed once
+	size_t trigram_count = 0;
+	for (size_t i = 0; i < pair_count; i++)
+		trigram_count += i == 0 || pairs[i] >> 32 != pairs[i - 1] >> 32;
+	search->trigrams = (uint32_t *)malloc((trigram_count + 1) * sizeof(uint32_t));
+	search->offsets = (uint32_t *)malloc((trigram_count + 1) * sizeof(uint32_t));
+	if (search->trigrams == NULL || search->offsets == NULL) {
+		free(pairs);
+		return -1;
+	}
+	size_t position_count = 0;
+	for (size_t i = 0; i < pair_count; i++)
+	{
+		if (i > 0 && pairs[i] == pairs[i - 1])
+			continue;
+		if (i == 0 || pairs[i] >> 32 != pairs[i - 1] >> 32) {
+			search->trigrams[search->trigram_count] = pairs[i] >> 32;
+			search->offsets[search->trigram_count++] = position_count;
+		}
+		search->positions[position_count++] = (uint32_t)pairs[i];
+	}
+	search->offsets[search->trigram_count] = position_count;
+	free(pairs);
+	return 0;
+}
+
+/**
+* Free the index (the catalog is left alone)
+*/
+static void catalog_search_clear(CatalogSearch *search)
+{
+	free(search->names);
+	free(search->lower_names);
+	free(search->trigrams);
+	free(search->offsets);
+	free(search->positions);
+	search->names = NULL;
+	search->name_count = 0;
+	search->lower_names = NULL;
+	search->trigrams = NULL;
+	search->trigram_count = 0;
+	search->offsets = NULL;
+	search->positions = NULL;
+	search->built = 0;
+}
+
+/**
+* Sort (trigram, position) pairs by trigram with one stable counting pass per byte of the trigram
+* @param buffer Room for [count] pairs
+*/
+static void radix_sort_trigrams(uint64_t *pairs, uint64_t *buffer, size_t count)
+{
+	for (int shift = 32; shift < 56; shift += 8)
+	{
+		size_t counts[257] = { 0 };
+		for (size_t i = 0; i < count; i++)
+			counts[((pairs[i] >> shift) & 0xFF) + 1]++;
+		for (int i = 0; i < 256; i++)
+			counts[i + 1] += counts[i];
+		for (size_t i = 0; i < count; i++)
+			buffer[counts[(pairs[i] >> shift) & 0xFF]++] = pairs[i];
+		memcpy(pairs, buffer, count * sizeof(uint64_t));
+	}
+}
+
+/**
+* @returns the 3 characters at [text] in lower case, packed in an integer
+*/
+static uint32_t trigram_at(const char *text)
+{
+	return (uint32_t)tolower((unsigned char)text[0]) << 16 | (uint32_t)tolower((unsigned char)text[1]) << 8 |
+		(uint32_t)tolower((unsigned char)text[2]);
+}
+
+/**
+* @returns index of [trigram] in the sorted [trigrams] of the index or SIZE_MAX if no name holds it
+*/
+static size_t trigram_find(const CatalogSearch *search, uint32_t trigram)
+{
+	size_t low = 0, high = search->trigram_count;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (search->trigrams[middle] < trigram)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low < search->trigram_count && search->trigrams[low] == trigram ? low : SIZE_MAX;
+}
+
+/**
+* Skip ahead in a sorted list: steps doubling from [first], then a binary search in the last step
+* @returns index of the first position from [first] not below [position] ([last] if there is none)
+*/
+static size_t gallop(const uint32_t *positions, size_t first, size_t last, uint32_t position)
+{
+	size_t step = 1, low = first, high = first;
+	while (high < last && positions[high] < position) {
+		low = high + 1;
+		high += step;
+		step *= 2;
+	}
+	if (high > last)
+		high = last;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (positions[middle] < position)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#include "file_tree_foreach.h"
+
+#include "catalog.h"
+
+#include "watcher.h"
+
+/*
+* Events only say which directory changed: each batch of events read is reduced to the set of directories
+* it touched, and the catalog lists those again. A directory deleted or moved away is dropped with its whole
+* subtree (and its watches), a directory created or moved in is walked as part of its parent.
+* When the kernel queue overflows, events were lost: the catalog is refreshed (one stat per directory).
+*/
+
+#define WATCHER_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+// Directories touched by a batch of events
+typedef struct watcher_batch {
+	char **dirpaths;
+	size_t count, capacity;
+	int overflow;
+} WatcherBatch;
+
+/* -- Private Functions -- */
+static void *watcher_run(void *arg);
+static void watcher_apply(CatalogWatcher *watcher, WatcherBatch *batch);
+static void watcher_watch_from(CatalogWatcher *watcher, size_t first);
+static void watcher_directory_opened(void *context, const char *dirpath);
+static void watcher_prune(CatalogWatcher *watcher);
+static int watcher_add(CatalogWatcher *watcher, const char *dirpath);
+static void watcher_remove(CatalogWatcher *watcher, int wd);
+static void watcher_forget(CatalogWatcher *watcher, int wd);
+static void watcher_unwatch_tree(CatalogWatcher *watcher, const char *dirpath);
+static void batch_add(WatcherBatch *batch, const char *dirpath, const char *name);
+static int compare_paths(const void *a, const void *b);
+
+/**
+* Catalog Watcher Start
+* Watches every directory of [catalog] and starts the thread applying the changes to it.
+* From then on [catalog->lock] must be held to use the catalog
+* @param catalog Catalog to keep up to date
+* @returns pointer to the watcher or NULL if inotify is not available
+*/
+CatalogWatcher *catalog_watcher_start(Catalog *catalog)
+{
+	CatalogWatcher *watcher = (CatalogWatcher *)calloc(1, sizeof(CatalogWatcher));
+	if (watcher == NULL)
+		return NULL;
+	watcher->catalog = catalog;
+	watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	watcher->stop_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (watcher->inotify_fd == -1 || watcher->stop_event == -1) {
+		perror("inotify");
+		catalog_watcher_stop(watcher);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&catalog->lock);
+	watcher_watch_from(watcher, 0);
+	catalog->directory_opened = watcher_directory_opened;
+	catalog->directory_context = watcher;
+	pthread_mutex_unlock(&catalog->lock);
+
+	if (pthread_create(&watcher->thread, NULL, watcher_run, watcher) != 0) {
+		catalog_watcher_stop(watcher);
+		return NULL;
+	}
+	return watcher;
+}
+
+/**
+* Catalog Watcher Stop
+* Stops the thread (the catalog keeps the changes applied so far) and frees the watcher
+* @param watcher Pointer to the watcher object (may be NULL)
+*/
+void catalog_watcher_stop(CatalogWatcher *watcher)
+{
+	if (watcher == NULL)
+		return;
+	if (watcher->thread) {
+		uint64_t one = 1;
+		if (write(watcher->stop_event, &one, sizeof(one)) != sizeof(one))
+			perror("eventfd write");
+		pthread_join(watcher->thread, NULL);
+	}
+	pthread_mutex_lock(&watcher->catalog->lock);
+	if (watcher->catalog->directory_context == watcher)
+		watcher->catalog->directory_opened = NULL;
+	pthread_mutex_unlock(&watcher->catalog->lock);
+	if (watcher->inotify_fd != -1)
+		close(watcher->inotify_fd);
+	if (watcher->stop_event != -1)
+		close(watcher->stop_event);
+	for (size_t i = 0; i < watcher->watch_capacity; i++)
+		free(watcher->watches[i]);
+	free(watcher->watches);
+	free(watcher);
+}
+
+/* ----------------------------------- AUXILIARY FUNCTIONS ----------------------------------- */
+
+/**
+* Watcher thread: read the pending events, reduce them to the directories they touched and apply them
+*/
+static void *watcher_run(void *arg)
+{
+	CatalogWatcher *watcher = (CatalogWatcher *)arg;
+	uint8_t *buffer = (uint8_t *)malloc(WATCHER_EVENTS_SIZE);
+	if (buffer == NULL)
+		return NULL;
+	WatcherBatch batch = { NULL, 0, 0, 0 };
+
+	struct pollfd fds[2] = { { watcher->inotify_fd, POLLIN, 0 }, { watcher->stop_event, POLLIN, 0 } };
+	while (1)
+	{
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents & POLLIN)
+			break;
+
+		// Everything queued goes into one batch, a copy of a whole album is applied at once
+		ssize_t length;
+		while ((length = read(watcher->inotify_fd, buffer, WATCHER_EVENTS_SIZE)) > 0)
+		{
+			for (ssize_t offset = 0; offset < length;)
+			{
+				const struct inotify_event *event = (const struct inotify_event *)(buffer + offset);
+				offset += sizeof(struct inotify_event) + event->len;
+
+				if (event->mask & IN_Q_OVERFLOW) {
+					batch.overflow = 1;
+					continue;
+				}
+				if (event->mask & IN_IGNORED) {
+					watcher_forget(watcher, event->wd);
+					continue;
+				}
+				if (event->wd < 0 || (size_t)event->wd >= watcher->watch_capacity || watcher->watches[event->wd] == NULL || event->len == 0)
+					continue;
+
+				const char *dirpath = watcher->watches[event->wd];
+				if (event->mask & IN_ISDIR) {
+					// A directory gone is dropped with its subtree, a new one is walked with its parent
+					if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+						batch_add(&batch, dirpath, event->name);
+					else if (event->mask & (IN_CREATE | IN_MOVED_TO))
+						batch_add(&batch, dirpath, NULL);
+				}
+				else if (file_tree_pattern_match(watcher->catalog->pattern, event->name, strlen(event->name))) {
+					batch_add(&batch, dirpath, NULL);
+				}
+			}
+		}
+		if (length == -1 && errno != EAGAIN && errno != EINTR) {
+			perror("inotify read");
+			break;
+		}
+
+		if (batch.count > 0 || batch.overflow)
+			watcher_apply(watcher, &batch);
+		for (size_t i = 0; i < batch.count; i++)
+			free(batch.dirpaths[i]);
+		batch.count = 0;
+		batch.overflow = 0;
+	}
+
+	free(batch.dirpaths);
+	free(buffer);
+	return NULL;
+}
+
+/**
+* Apply a batch of changes to the catalog and watch the directories it found
+*/
+static void watcher_apply(CatalogWatcher *watcher, WatcherBatch *batch)
+{
+	// Watches of directories that went away are removed first, so moving a directory inside the tree
+	// gets it a fresh watch at its new place
+	for (size_t i = 0; i < batch->count; i++)
+	{
+		struct stat statbuf;
+		if (lstat(batch->dirpaths[i], &statbuf) == -1 || !S_ISDIR(statbuf.st_mode))
+			watcher_unwatch_tree(watcher, batch->dirpaths[i]);
+	}
+
+	// The catalog takes its lock to change, only the walks of the watches need it here
+	Catalog *catalog = watcher->catalog;
+	if (batch->overflow) {
+		watcher->overflows++;
+		catalog_refresh(catalog);
+		pthread_mutex_lock(&catalog->lock);
+		watcher_prune(watcher);
+		// Adding a watch again only returns the descriptor it already has
+		watcher_watch_from(watcher, 0);
+		pthread_mutex_unlock(&catalog->lock);
+	}
+	else {
+		// The directories listed are watched as they are opened (see watcher_directory_opened)
+		size_t first_read;
+		catalog_update_directories(catalog, (const char **)batch->dirpaths, batch->count, &first_read);
+	}
+}
+
+/**
+* Watch the directories of the catalog from index [first] on (catalog locked)
+*/
+static void watcher_watch_from(CatalogWatcher *watcher, size_t first)
+{
+	Catalog *catalog = watcher->catalog;
+	for (size_t i = first; i < catalog->directory_count; i++)
+		watcher_add(watcher, catalog->directories[i].path);
+}
+
+/**
+* Catalog hook: watch a directory before it is listed, so no change made while it is read is missed
+*/
+static void watcher_directory_opened(void *context, const char *dirpath)
+{
+	watcher_add((CatalogWatcher *)context, dirpath);
+}
+
+/**
+* Remove the watches of the directories the catalog no longer has (catalog locked)
+*/
+static void watcher_prune(CatalogWatcher *watcher)
+{
+	Catalog *catalog = watcher->catalog;
+	const char **paths = (const char **)malloc((catalog->directory_count + 1) * sizeof(char *));
+	if (paths == NULL)
+		return;
+	for (size_t i = 0; i < catalog->directory_count; i++)
+		paths[i] = catalog->directories[i].path;
+	qsort(paths, catalog->directory_count, sizeof(char *), compare_paths);
+
+	for (size_t wd = 0; wd < watcher->watch_capacity; wd++)
+		if (watcher->watches[wd] != NULL &&
+			bsearch(&watcher->watches[wd], paths, catalog->directory_count, sizeof(char *), compare_paths) == NULL)
+			watcher_remove(watcher, wd);
+	free(paths);
+}
+
+/**
+* Watch a directory and remember its path for the events of the descriptor
+* @returns the watch descriptor or -1 if the directory could not be watched
+*/
+static int watcher_add(CatalogWatcher *watcher, const char *dirpath)
+{
+	int wd = inotify_add_watch(watcher->inotify_fd, dirpath, WATCHER_MASK);
+	if (wd == -1) {
+		if (errno == ENOSPC)
+			watcher->unwatched++;
+		return -1;
+	}
+
+	if ((size_t)wd >= watcher->watch_capacity) {
+		size_t capacity = watcher->watch_capacity == 0 ? 256 : watcher->watch_capacity;
+		while (capacity <= (size_t)wd)
+			capacity *= 2;
+		char **watches = (char **)realloc(watcher->watches, capacity * sizeof(char *));
+		if (watches == NULL) {
+			inotify_rm_watch(watcher->inotify_fd, wd);
+			return -1;
+		}
+		memset(watches + watcher->watch_capacity, 0, (capacity - watcher->watch_capacity) * sizeof(char *));
+		watcher->watches = watches;
+		watcher->watch_capacity = capacity;
+	}
+
+	// The same directory watched again (moved back, or refreshed) keeps its descriptor
+	char *path = strdup(dirpath);
+	if (path == NULL) {
+		inotify_rm_watch(watcher->inotify_fd, wd);
+		return -1;
+	}
+	if (watcher->watches[wd] == NULL)
+		watcher->watch_count++;
+	free(watcher->watches[wd]);
+	watcher->watches[wd] = path;
+	return wd;
+}
+
+/**
+* Remove a watch (forgotten once the kernel confirms it, or now if the kernel had already removed it)
+*/
+static void watcher_remove(CatalogWatcher *watcher, int wd)
+{
+	// The confirmation of a directory deleted may have been lost in an overflow
+	if (inotify_rm_watch(watcher->inotify_fd, wd) == -1)
+		watcher_forget(watcher, wd);
+}
+
+/**
+* Forget a watch descriptor the kernel removed
+*/
+static void watcher_forget(CatalogWatcher *watcher, int wd)
+{
+	if (wd < 0 || (size_t)wd >= watcher->watch_capacity || watcher->watches[wd] == NULL)
+		return;
+	free(watcher->watches[wd]);
+	watcher->watches[wd] = NULL;
+	watcher->watch_count--;
+}
+
+/**
+* Remove the watches of a directory and of everything under it
+*/
+static void watcher_unwatch_tree(CatalogWatcher *watcher, const char *dirpath)
+{
+	size_t length = strlen(dirpath);
+	for (size_t wd = 0; wd < watcher->watch_capacity; wd++)
+	{
+		const char *path = watcher->watches[wd];
+		if (path != NULL && strncmp(path, dirpath, length) == 0 && (path[length] == '\0' || path[length] == '/'))
+			watcher_remove(watcher, wd);
+	}
+}
+
+/**
+* Add a directory to a batch ([dirpath] itself, or its entry [name] if not NULL)
+*/
+static void batch_add(WatcherBatch *batch, const char *dirpath, const char *name)
+{
+	size_t dirpath_length = strlen(dirpath);
+	// "/" is not followed by a second separator
+	size_t separator = name != NULL && dirpath_length > 0 && dirpath[dirpath_length - 1] != '/';
+	size_t name_length = name != NULL ? strlen(name) : 0;
+	for (size_t i = 0; i < batch->count; i++)
+		if (strncmp(batch->dirpaths[i], dirpath, dirpath_length) == 0 &&
+			(name == NULL ? batch->dirpaths[i][dirpath_length] == '\0' :
+				(!separator || batch->dirpaths[i][dirpath_length] == '/') &&
+				strcmp(batch->dirpaths[i] + dirpath_length + separator, name) == 0))
+			return;
+
+	if (batch->count == batch->capacity) {
+		size_t capacity = batch->capacity == 0 ? 16 : batch->capacity * 2;
+		char **dirpaths = (char **)realloc(batch->dirpaths, capacity * sizeof(char *));
+		if (dirpaths == NULL) {
+			// Nothing lost: an overflow refreshes the whole catalog
+			batch->overflow = 1;
+			return;
+		}
+		batch->dirpaths = dirpaths;
+		batch->capacity = capacity;
+	}
+	char *path = malloc(dirpath_length + separator + name_length + 1);
+	if (path == NULL) {
+		batch->overflow = 1;
+		return;
+	}
+	memcpy(path, dirpath, dirpath_length);
+	path[dirpath_length] = '\0';
+	if (name != NULL) {
+		path[dirpath_length] = '/';
+		memcpy(path + dirpath_length + separator, name, name_length + 1);
+	}
+	batch->dirpaths[batch->count++] = path;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
@@ -4,18 +4,28 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <errno.h>
-#include <sys/stat.h>
-#include <dirent.h>
 #include <sys/select.h>
+#include <unistd.h>
+#include <time.h>
 
 #include <termios.h>
 
-#include <alsa/asoundlib.h>
-
 #include "wavelib.h"
 
 #include "console.h"
 
+#include "output.h"
+
+#include "player.h"
+
+#include "file_tree_foreach.h"
+
+#include "catalog.h"
+
+#include "watcher.h"
+
+#include "search.h"
+
 #include "wave_playlist.h"
 
 /* -- ERROR TRY/CATCH SYSTEM BASE ON SETJMP -- */
@@ -35,6 +45,13 @@ jmp_buf ex_buf__;
 
 int main(int argc, char *argv[])
 {
+	// Output the waves are played on
+	AudioOutput *output = output_create(argc > 1 ? argv[1] : SOUND_OUTPUT);
+	if (output == NULL) {
+		fprintf(stderr, "Usage: %s [alsa[:device] | null | null:realtime | file:path]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
 	// Initialize console object
 	console_init();
 	
@@ -43,13 +60,39 @@ int main(int argc, char *argv[])
 
 	console->clear();
 
-	// Do initial wave file search starting at the /home folder
-	file_tree_find_wavs("/home");
+	// Bring the catalog of the last run up to date (only its changed directories are read again),
+	// or do the initial wave file search starting at the /home folder. Both run in the background:
+	// the files already known are listed right away and the commands work during the scan
+	catalog = catalog_create();
+	search = catalog != NULL ? catalog_search_create(catalog) : NULL;
+	if (catalog == NULL || search == NULL) {
+		console->printString("Out of memory!\n");
+		output_destroy(output);
+		exit(-1);
+	}
+	// An index scanned with other rules than the default ones is not loaded
+	CatalogRules rules = { CATALOG_EXCLUDE, CATALOG_RULE_FLAGS, CATALOG_MAX_DEPTH, CATALOG_MIN_SIZE, CATALOG_MAX_SIZE };
+	catalog_set_rules(catalog, &rules);
+	char index_path[CATALOG_INDEX_PATH_SIZE];
+	if (catalog_index_path(index_path, sizeof(index_path)) && catalog_load(catalog, index_path) == 0)
+		file_tree_find_wavs(catalog->root, &rules);
+	else
+		file_tree_find_wavs("/home", &rules);
+	watch_wanted = CATALOG_WATCH;
 	file_show_search_results();
 
 	// Initialize the playlist
 	Playlist *playlist = playlist_init();
 
+	// Initialize the player (the output is opened by the first play)
+	player = player_create(output, PLAYBACK_CHANNELS, PLAYBACK_RATE, PLAYBACK_PERIOD, PLAYBACK_REALTIME_PRIORITY);
+	if (player == NULL) {
+		console->printString("Out of memory!\n");
+		output_destroy(output);
+		playlist_destroy(playlist);
+		exit(-1);
+	}
+
 	TRY 
 	{
 		// Commands Cycle
@@ -60,10 +103,23 @@ int main(int argc, char *argv[])
 
 			console->clear();
 
+			// Save the results of a scan that ended while waiting
+			file_tree_scan_collect(0);
+
 			// Handle Command
 			if (command != NULL) {
+				// The arguments are the rest of the line (paths may hold spaces, scan takes options)
 				char *instruction = strtok((char *)command, " ");
-				char *args = strtok(NULL, " ");
+				char *args = strtok(NULL, "");
+				while (args != NULL && *args == ' ')
+					args++;
+				if (args != NULL) {
+					size_t length = strlen(args);
+					while (length > 0 && args[length - 1] == ' ')
+						args[--length] = '\0';
+					if (length == 0)
+						args = NULL;
+				}
 				execute_command(instruction, playlist, args);
 			}
 		}
@@ -76,6 +132,7 @@ int main(int argc, char *argv[])
 		commands_history_free();
 		console->printString("Releasing Memory Allocated for the Playlist...\n");
 		playlist_destroy(playlist);
+		player_destroy(player);
 		exit(-1);
 	}
 	ENDTRY;
@@ -108,11 +165,14 @@ void insert_command(const char *name, const char *description, void (*execute)(P
 void build_commands() {
 	insert_command("clear", "Clear console", command_clear_console);
 	insert_command("play", "Play the files on the playlist by order of insertion. Typing 'p' while playing will pause and typing 'n' will skip to the next file", command_play);
+	insert_command("export", "Ex: export <path>. Render the playlist, in the format it is played in, to the WAV file <path> (the playlist is kept)", command_export);
 	insert_command("rm", "Ex: rm <playlist_id>. Remove a file(<playlist_id> from list displayed when the command playlist is executed) from the playlist. 'rm *' removes all", command_remove);
 	insert_command("add", "Ex: add <file_id>. Add a file(<file_id> from list displayed when the command files is executed) to the playlist", command_add);
 	insert_command("list", "Show all the files in the playlist", command_playlist_print);
-	insert_command("files", "Show all the files found in the previous scan", command_print_files);
-	insert_command("scan", "Ex: <startdir?>. scan Scan the filesystem(starting at <startdir> or '/home' by default) looking for Wave files and show results", command_scan);	
+	insert_command("files", "Show all the files found by the scans (with the progress of a running scan)", command_print_files);
+	insert_command("find", "Ex: find <text>. Show the files found by the scans whose name holds <text> (case aside), with the IDs to add them by", command_find);
+	insert_command("watch", "Ex: watch <on|off>. Keep the files found up to date with the filesystem, without scanning again", command_watch);
+	insert_command("scan", "Ex: <startdir?|cancel> [-exclude <globs|->] [-depth <levels>] [-min <bytes>] [-max <bytes>] [-hidden] [-mounts] [-noprobe]. scan Scan the filesystem(starting at <startdir> or '/home' by default) looking for Wave files in the background and show results as they are found. The options change what the scan leaves out (caches, hidden directories, other filesystems and files that are not wave files by default)", command_scan);	
 	insert_command("exit", "Safely shutdown the application", command_exit);
 	insert_command("help", "Show this helper", command_print_commands);
 }
@@ -222,25 +282,163 @@ void command_exit(Playlist *playlist, const char *args)
 	commands_history_free();
 	console->printString("Releasing Memory Allocated for the Playlist...\n");
 	playlist_destroy(playlist);
+	console->printString("Closing the sound device...\n");
+	player_destroy(player);
+	console->printString("Saving the catalog...\n");
+	if (scan != NULL) {
+		catalog_scan_cancel(scan);
+		file_tree_scan_collect(1);
+	}
+	catalog_watch(0);
+	char index_path[CATALOG_INDEX_PATH_SIZE];
+	if (catalog_index_path(index_path, sizeof(index_path)))
+		catalog_save(catalog, index_path);
+	catalog_search_destroy(search);
+	catalog_destroy(catalog);
 	console->printString("Exiting...\n");
 	exit(0);
 }
 
 /**
-* Scan the filesystem for wave files
+* Scan the filesystem for wave files in the background
 * @param playlist Pointer to playlist object
-* @param args Starting directory for the scan. If not passed it will scan the default directory (/home)
+* @param args Starting directory for the scan (the default directory is /home) followed by the options changing the
+* default rules, or 'cancel' to stop the running scan. Options: '-exclude <globs>' directories never walked ('-' for
+* none), '-depth <levels>' levels walked at most, '-min <bytes>' and '-max <bytes>' bounds of the size of the files,
+* '-hidden' walk hidden directories too, '-mounts' walk into other filesystems, '-noprobe' keep every file named
+* like a wave file without reading its header
 */
 void command_scan(Playlist *playlist, const char *args)
 {
-	// Reset the array with the filepaths of the wave files found
-	memset(filepaths, 0, MAX_FILES * sizeof(filepaths[0]));
+	if (args != NULL && strcmp(args, "cancel") == 0) {
+		if (scan == NULL) {
+			console->printString("No scan is running");
+			console->cursorYPos = 4;
+			return;
+		}
+		catalog_scan_cancel(scan);
+		file_tree_scan_collect(1);
+		printf("Scan cancelled, %zu wave files were found\n", catalog_size(catalog));
+		console->cursorYPos = 4;
+		return;
+	}
+
+	// Each scan starts from the default rules, its options change them
+	CatalogRules rules = { CATALOG_EXCLUDE, CATALOG_RULE_FLAGS, CATALOG_MAX_DEPTH, CATALOG_MIN_SIZE, CATALOG_MAX_SIZE };
+	char *line = args != NULL ? strdup(args) : NULL;
+	if (args != NULL && line == NULL)
+		THROW(NO_HEAP_SPACE);
+	const char *startDir = NULL;
+	const char *invalid = NULL;
+	char *token = line != NULL ? strtok(line, " ") : NULL;
+	for (; token != NULL && invalid == NULL; token = strtok(NULL, " "))
+	{
+		if (token[0] != '-') {
+			if (startDir != NULL)
+				invalid = token;
+			startDir = token;
+			continue;
+		}
+		if (strcmp(token, "-hidden") == 0) {
+			rules.flags &= ~FILE_TREE_SKIP_HIDDEN;
+			continue;
+		}
+		if (strcmp(token, "-mounts") == 0) {
+			rules.flags &= ~FILE_TREE_ONE_FILE_SYSTEM;
+			continue;
+		}
+		if (strcmp(token, "-noprobe") == 0) {
+			rules.flags &= ~CATALOG_PROBE;
+			continue;
+		}
+		// The other options take a value
+		char *value = strtok(NULL, " ");
+		char *end = NULL;
+		unsigned long long number = value != NULL ? strtoull(value, &end, 10) : 0;
+		int is_number = value != NULL && value[0] != '-' && *end == '\0';
+		if (strcmp(token, "-exclude") == 0 && value != NULL)
+			rules.exclude = strcmp(value, "-") == 0 ? NULL : value;
+		else if (strcmp(token, "-depth") == 0 && is_number)
+			rules.max_depth = number;
+		else if (strcmp(token, "-min") == 0 && is_number)
+			rules.min_size = number;
+		else if (strcmp(token, "-max") == 0 && is_number)
+			rules.max_size = number;
+		else
+			invalid = token;
+	}
+	if (invalid != NULL) {
+		printf("Invalid scan option '%s' (see 'help')\n", invalid);
+		free(line);
+		console->cursorYPos = 4;
+		return;
+	}
+
+	// Scanning the root of the catalog again with the same rules only rescans the directories that changed
 	// First one is the home folder to be faster
-	const char *startDir = args == NULL ? "/home/" : args;
-	file_tree_find_wavs(startDir);
+	file_tree_find_wavs(startDir == NULL ? "/home/" : startDir, &rules);
+	free(line);
 	file_show_search_results();
 }
 
+/**
+* Find the files of the listing by a part of their name
+* @param playlist Pointer to playlist object
+* @param args Text the names must hold
+*/
+void command_find(Playlist *playlist, const char *args)
+{
+	if (args == NULL) {
+		console->printString("You need to specify the text to look for. Ex: find drums");
+		console->cursorYPos = 4;
+		return;
+	}
+	file_tree_scan_collect(0);
+	size_t results[FIND_MAX_RESULTS];
+	pthread_mutex_lock(&catalog->lock);
+	size_t found = catalog_search_find(search, args, results, FIND_MAX_RESULTS);
+	size_t shown = found < FIND_MAX_RESULTS ? found : FIND_MAX_RESULTS;
+	printf("| -- FIND \"%s\" -- |\n\n-Results no: %zu\n\n", args, found);
+	// Numbered as in the listing, so they can be added right away
+	for (size_t i = 0; i < shown; i++)
+		printf("%zu) %s\n", results[i] + 1, strrchr(catalog_get(catalog, results[i])->path, '/') + 1);
+	if (found > shown)
+		printf("... %zu more (type more of the name)\n", found - shown);
+	pthread_mutex_unlock(&catalog->lock);
+	console->cursorYPos = shown + 6 + (found > shown);
+}
+
+/**
+* Turn the watcher keeping the catalog in step with the filesystem on or off
+* @param playlist Pointer to playlist object
+* @param args 'on' or 'off'. If not passed it shows whether the catalog is watched
+*/
+void command_watch(Playlist *playlist, const char *args)
+{
+	if (args != NULL && strcmp(args, "on") == 0) {
+		watch_wanted = 1;
+		if (scan == NULL)
+			catalog_watch(1);
+	}
+	else if (args != NULL && strcmp(args, "off") == 0) {
+		watch_wanted = 0;
+		catalog_watch(0);
+	}
+
+	if (watcher == NULL && watch_wanted && scan != NULL) {
+		console->printString("The catalog will be watched once the scan ends");
+		console->cursorYPos = 4;
+		return;
+	}
+	if (watcher == NULL) {
+		console->printString("The catalog is not watched, use 'scan' to see the changes");
+		console->cursorYPos = 4;
+		return;
+	}
+	printf("Watching %zu directories (%llu event overflows)\n", watcher->watch_count, (unsigned long long)watcher->overflows);
+	console->cursorYPos = 4;
+}
+
 /**
 * Display the wave files found during last scan
 * @param playlist Pointer to playlist object
@@ -266,7 +464,7 @@ void command_playlist_print(Playlist *playlist, const char *args)
 	QueueItem *current = playlist->head;
 	for (int i = 0; i < current_playlist_size; i++, current = current->next)
 	{
-		printf("%d) %s\n", i + 1, strrchr(current->wave->filename, '/') + 1);
+		printf("%d) %s\n", i + 1, strrchr(current->wave->filepath, '/') + 1);
 	}
 	console->cursorYPos = (current_playlist_size < 2 ? 0 : current_playlist_size - 1) + 6;
 }
@@ -285,21 +483,25 @@ void command_add(Playlist *playlist, const char *args)
 		return;
 	}
 	size_t index = atoi(args) - 1;
-	if (index >= files_found_num())
+	pthread_mutex_lock(&catalog->lock);
+	const CatalogFile *file = catalog_get(catalog, index);
+	if (file == NULL)
 	{
+		pthread_mutex_unlock(&catalog->lock);
 		console->printString("Invalid ID\nUse the command 'files' to see all the possible IDs");
 		console->cursorYPos = 5;
 		return;
 	}
-	const char *filepath = filepaths[index];
-	// Allocate space for new Wave file memory representation
-	Wave *loadedWave = (Wave *)malloc(sizeof(Wave));
+	const char *filepath = file->path;
+	// Map the file instead of copying it, samples are only paged in while playing
+	Wave *loadedWave = wave_load_mapped(filepath);
+	pthread_mutex_unlock(&catalog->lock);
 	if (loadedWave == NULL) {
-		THROW(NO_HEAP_SPACE);
+		console->printString("Could not load the wave file!");
+		console->cursorYPos = 4;
+		return;
 	}
 
-	loadedWave = wave_load(filepath);
-
 	if (playlist_add(playlist, loadedWave))
 		console->printString("Successfuly added to playlist");
 	else
@@ -322,7 +524,8 @@ void command_remove(Playlist *playlist, const char *args)
 	}
 	else if (strcmp(args, "*") == 0)
 	{
-		// Remove all
+		// Remove all (the paused wave goes with them)
+		player_forget(player, NULL);
 		if (playlist_wipe(playlist))
 		{
 			console->printString("All removed from playlist");
@@ -343,8 +546,14 @@ void command_remove(Playlist *playlist, const char *args)
 			console->cursorYPos = 5;
 			return;
 		}
+		Wave *wave = playlist_get(playlist, index);
 		if (playlist_remove(playlist, index))
+		{
+			// The wave was allocated when added to the playlist
+			player_forget(player, wave);
+			wave_destroy(wave);
 			console->printString("Successfuly removed from playlist");
+		}
 		else
 			console->printString("Could not remove from playlist");
 		console->cursorYPos = 4;
@@ -369,30 +578,27 @@ void command_play(Playlist *playlist, const char *args)
 		return;
 	}
 
-	// While there are songs in the playlist
-	while (playlist_size(playlist) > 0)
-	{
-		// Play the first in Queue
-		Wave *firstInPlaylist = playlist_first(playlist);
+	// Setup in order to allow async keyboard interruptions
+	set_conio_terminal_mode();
 
-		printf("Currently playing \"%s\"\n", strrchr(firstInPlaylist->filename, '/') + 1);
+	// The player keeps the device open and goes from one wave to the next without a gap
+	PlayerSession session = { playlist, STDIN_FILENO, session_peek, session_pop, session_track_started, session_track_progress, session_poll_command };
+	int result = player_play(player, &session);
 
-		int result = play(firstInPlaylist); // UNCOMMENT WHEN ALSA LIB IS WORKING
-		if (result == WAVE_PAUSE) {
-			console->clear();
+	// Reset terminal
+	reset_terminal_mode();
 
-			console->printString("Paused");
-			console->cursorYPos = 4;
-			return;
-		}
-		if (result == WAVE_NEXT) {
-			console->clear();
-			console->printString("Skipping...");
-			console->cursorYPos = 4;
-		}
-		// if (result == NEXT) is not needed because it will remove current from playlist and play next one by default
-		// Remove from queue after playing
-		playlist_remove(playlist, 0);
+	if (result == WAVE_PAUSE) {
+		console->clear();
+
+		console->printString("Paused");
+		console->cursorYPos = 4;
+		return;
+	}
+	if (result < 0) {
+		console->printString("Could not play on the output");
+		console->cursorYPos = 5;
+		return;
 	}
 	// Playlist ended
 	console->clear();
@@ -400,6 +606,53 @@ void command_play(Playlist *playlist, const char *args)
 	console->cursorYPos = 4;
 }
 
+/**
+* Render the full playlist to a WAV file as fast as the disk allows, the playlist is left untouched
+* @param playlist Pointer to playlist object
+* @param args Path of the WAV file to create
+*/
+void command_export(Playlist *playlist, const char *args)
+{
+	if (args == NULL)
+	{
+		console->printString("You need to specify the output file. Ex: export /tmp/playlist.wav");
+		console->cursorYPos = 4;
+		return;
+	}
+	if (playlist_size(playlist) == 0) {
+		console->printString("Playlist is empty!");
+		console->cursorYPos = 4;
+		return;
+	}
+
+	// Written around the page cache, a long render would otherwise evict everything else
+	AudioOutput *output = output_file_create(args, 1);
+	if (output == NULL) {
+		console->printString("Out of memory!");
+		console->cursorYPos = 4;
+		return;
+	}
+
+	// Same stages as playing, without a device to wait for
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	PlayerSession session = { playlist, -1, session_peek, NULL, session_track_exported, NULL, NULL };
+	int result = player_export(&session, output, PLAYBACK_CHANNELS, PLAYBACK_RATE, EXPORT_PERIOD);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	uint64_t frames = output->stats.frames;
+	output_destroy(output);
+	if (result < 0) {
+		console->printString("Could not export the playlist");
+		console->cursorYPos = 4 + playlist_size(playlist);
+		return;
+	}
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Exported %02d:%02d to \"%s\" in %.2f seconds\n",
+			(int)(frames / PLAYBACK_RATE / 60), (int)(frames / PLAYBACK_RATE % 60), args, seconds);
+	console->cursorYPos = 5 + playlist_size(playlist);
+}
+
 /**
 * Clear console
 * @param playlist Pointer to playlist object
@@ -626,7 +879,7 @@ int playlist_add(Playlist *playlist, Wave *wave)
 		playlist->size++;
 	}
 	// Confirm if it was added
-	if (playlist_has_file(playlist, strrchr(wave->filename, '/') + 1) != -1)
+	if (playlist_has_file(playlist, strrchr(wave->filepath, '/') + 1) != -1)
 		return 1;
 	else
 		return 0;
@@ -673,6 +926,22 @@ Wave *playlist_first(Playlist *playlist)
 	return playlist->head->wave;
 }
 
+/**
+ * Get a wave from the playlist
+ * @param playlist pointer to the playlist object
+ * @param index position of the wave
+ * @returns the wave object at [index] or NULL if [index] is out of bounds
+ */
+Wave *playlist_get(Playlist *playlist, size_t index)
+{
+	if (index >= playlist_size(playlist))
+		return NULL;
+	QueueItem *current = playlist->head;
+	for (size_t i = 0; i < index; i++)
+		current = current->next;
+	return current->wave;
+}
+
 /**
  * Check if playlist has wave file
  * @param playlist pointer to the playlist object
@@ -684,7 +953,7 @@ int playlist_has_file(Playlist *playlist, const char *filename)
 	QueueItem *current = playlist->head;
 	for (int i = 0; i < playlist_size(playlist); i++, current = current->next)
 	{
-		if (strcmp(strrchr(current->wave->filename, '/') + 1, filename) == 0)
+		if (strcmp(strrchr(current->wave->filepath, '/') + 1, filename) == 0)
 		{
 			// Found it (return index)
 			return i;
@@ -707,7 +976,7 @@ int playlist_wipe(Playlist *playlist)
 	{
 		next = p->next;
 		// Free the wave first since we had to allocate space for it before adding it to playlist
-		free(p->wave);
+		wave_destroy(p->wave);
 		free(p);
 	}
 	// If head is not set to NULL data could still be accessible after the free since the nested structures are not erased
@@ -731,237 +1000,185 @@ void playlist_destroy(Playlist *playlist)
 /* ------------- WAV FILE SEARCH ------------- */
 
 /**
-* String Match
-* @param pattern Pattern to match
-* @param candidate String where the [pattern] will be verified
-* @returns '1' if [candidate] string matches a certain [pattern] or '0' if not
+* Catalog Index Path
+* @param buffer Where to write the path of the index (kept in the home directory)
+* @param size Size of [buffer]
+* @returns '1' if the path was written or '0' if there is no home directory
 */
-static int string_match(const char *pattern, const char *candidate)
+static int catalog_index_path(char *buffer, size_t size)
 {
-	if (*pattern == '\0')
-	{
-		return *candidate == '\0';
-	}
-	else if (*pattern == '*')
-	{
-		for (const char *c = candidate; *c != '\0'; c++)
-		{
-			if (string_match(pattern + 1, c))
-				return 1;
-		}
-		return string_match(pattern + 1, candidate);
-	}
-	else if (*pattern != '?' && *pattern != *candidate)
-	{
+	const char *home = getenv("HOME");
+	if (home == NULL || *home == '\0')
 		return 0;
-	}
-	else
-	{
-		return string_match(pattern + 1, candidate + 1);
-	}
+	return snprintf(buffer, size, "%s/%s", home, CATALOG_INDEX_NAME) < size;
 }
 
 /**
-* Files Found
-* @returns the number of files found in the last search
+* Tree File Search
+* Starts bringing the catalog up to date with the wave files under [dirpath] on a background thread
+* (a scan already running is cancelled). A new root, or a root scanned with other rules, is walked completely,
+* the root of the catalog only has its changed directories read again. The files found are listed while the scan goes on
+* @param dirpath Path where the search will begin
+* @param rules What the scan leaves out
 */
-static size_t files_found_num()
+void file_tree_find_wavs(const char *dirpath, const CatalogRules *rules)
 {
-	size_t items_num = 0;
-	for (; items_num < MAX_FILES; items_num++)
-		if (*(filepaths + items_num) == 0)
-			return items_num;
-	return items_num;
+	if (scan != NULL) {
+		catalog_scan_cancel(scan);
+		file_tree_scan_collect(1);
+	}
+	// The directories watched change with the root, the watcher starts again with the scan collected
+	catalog_watch(0);
+	// [dirpath] may be the root of the catalog, which new rules free
+	char *root = strdup(dirpath);
+	if (root == NULL || catalog_set_rules(catalog, rules) < 0) {
+		free(root);
+		console->printString("Out of memory!\n");
+		if (watch_wanted)
+			catalog_watch(1);
+		return;
+	}
+	scan = catalog_scan_start(catalog, root);
+	free(root);
+	if (scan == NULL) {
+		console->printString("Could not start the scan\n");
+		if (watch_wanted)
+			catalog_watch(1);
+	}
 }
 
 /**
-* Tree File Search
-* Recursively searches through the file system starting at [dirpath] searching for files
-* which match the pattern "*.wav". If they do, their paths are saved to an array called filepaths
-* @param dirpath Path where the depth search will begin
+* Tree File Scan Collect
+* Ends the background scan once it is over: its index is saved for the next run and the watcher started again
+* @param wait '1' to wait for the scan to end or '0' to leave a running scan alone
 */
-void file_tree_find_wavs(const char *dirpath)
+static void file_tree_scan_collect(int wait)
 {
-	DIR *dir;
-	dir = opendir(dirpath);
-	if (dir == NULL)
-	{
+	if (scan == NULL || (!wait && !catalog_scan_finished(scan)))
 		return;
+	int result = catalog_scan_wait(scan);
+	scan = NULL;
+	// A cancelled scan is not saved, its root is walked completely next time
+	if (result == 0) {
+		char index_path[CATALOG_INDEX_PATH_SIZE];
+		if (catalog_index_path(index_path, sizeof(index_path)))
+			catalog_save(catalog, index_path);
 	}
-	else
-	{
-		struct dirent *entry;
-		while ((entry = readdir(dir)) != NULL)
-		{
-			struct stat statbuf;
-			char filepath[strlen(dirpath) + 1 + strlen(entry->d_name) + 1];
-			strcpy(filepath, dirpath);
-			strcat(filepath, "/");
-			strcat(filepath, entry->d_name);
-
-			// Check if filename matches pattern
-			if (string_match("*.wav", strrchr(filepath, '/') + 1))
-			{
-				size_t next_index = files_found_num();
-				char *string = malloc(strlen(filepath) + 1);
-				if (string == NULL) {
-					THROW(NO_HEAP_SPACE);
-				}
-
-				strcpy(string, filepath);
-				filepaths[next_index] = string;
-			}
-
-			int result = stat(filepath, &statbuf);
-			if (result == -1)
-			{
-				continue;
-			}
-			if (S_ISDIR(statbuf.st_mode) &&
-				strcmp(entry->d_name, ".") != 0 &&
-				strcmp(entry->d_name, "..") != 0)
-			{
-				file_tree_find_wavs(filepath);
-			}
-		}
-		closedir(dir);
-	}
+	if (watch_wanted)
+		catalog_watch(1);
 }
 
-/*
-* Sort the files from the filepaths array alphabetically by filename
+/**
+* Catalog Watch
+* Start or stop the watcher keeping the catalog in step with the filesystem
+* @param enable '1' to start watching or '0' to stop
 */
-void sort_file_search_results()
+static void catalog_watch(int enable)
 {
-	size_t files_number = files_found_num();
-
-	// Sort the filepaths using bubble sort
-	for (int i = 0; i < files_number; i++)
-	{
-		for (int j = i + 1; j < files_number; j++)
-		{
-			// char *filename = strrchr(filepath, '/') + 1;
-			if (strcmp(strrchr(filepaths[i], '/') + 1, strrchr(filepaths[j], '/') + 1) > 0)
-			{
-				char *temp = filepaths[i];
-				filepaths[i] = filepaths[j];
-				filepaths[j] = temp;
-			}
-		}
+	if (!enable) {
+		catalog_watcher_stop(watcher);
+		watcher = NULL;
+		return;
 	}
+	// A catalog without a root was cut short by a cancelled scan, there is nothing complete to keep in step
+	if (watcher != NULL || catalog->root == NULL)
+		return;
+	watcher = catalog_watcher_start(catalog);
+	if (watcher != NULL && watcher->unwatched > 0)
+		printf("%zu directories are not watched (fs.inotify.max_user_watches reached)\n", watcher->unwatched);
 }
 
 /**
-* Display file search results to console
+* Display file search results to console (the catalog keeps its files sorted by name)
 */
 void file_show_search_results()
 {
-	// Sort the filepaths
-	sort_file_search_results();
-	size_t files_number = files_found_num();
-	printf("| -- SEARCH RESULTS -- |\n\n-Results no: %ld\n-Sorted: alphabetically\n-Pattern: \"%s\"\n\n", files_number, "*.wav");
+	file_tree_scan_collect(0);
+	pthread_mutex_lock(&catalog->lock);
+	size_t files_number = catalog_size(catalog);
+	printf("| -- SEARCH RESULTS -- |\n\n-Results no: %ld\n-Sorted: alphabetically\n-Pattern: \"%s\"\n", files_number, CATALOG_PATTERN);
+	// Partial results while a scan runs, the files found since the last batch are listed with the next one
+	if (scan != NULL)
+		printf("-Scanning: %zu directories read, %zu wave files found so far (use 'files' again to see more)\n", catalog->directory_count, catalog->file_count);
+	printf("\n");
 	for (int i = 0; i < files_number; i++)
 	{
-		printf("%d) %s\n", i + 1, strrchr(filepaths[i], '/') + 1);
+		// The format was read by the scan, listing it takes no I/O (unknown if the scan did not probe)
+		const CatalogFile *file = catalog_get(catalog, i);
+		const CatalogFormat *format = &file->format;
+		if (format->sample_rate == 0) {
+			printf("%d) %s\n", i + 1, strrchr(file->path, '/') + 1);
+			continue;
+		}
+		uint64_t seconds = format->frame_count / format->sample_rate;
+		printf("%d) %s (%u Hz, %u ch, %u bit, %d:%02d)\n", i + 1, strrchr(file->path, '/') + 1, format->sample_rate,
+			format->channels, format->bits_per_sample, (int)(seconds / 60), (int)(seconds % 60));
 	}
-	console->cursorYPos = files_number + 9;
+	pthread_mutex_unlock(&catalog->lock);
+	console->cursorYPos = files_number + 9 + (scan != NULL);
 }
 
 /* ------------- WAV PLAY MANIPULATIONS ------------- */
 
-#define	SOUND_DEVICE "default"
-
 /**
-* @returns 0 -> File reached end; -1 -> UNKNOWN COMMAND; 1 -> WAVE_PAUSE; 2 -> WAVE.NEXT; 
+* Player session callback: wave at position [index] of the playlist
 */
-int play(Wave *wave) {
-
-	snd_pcm_t *handle = NULL;
-	int result = snd_pcm_open(&handle, SOUND_DEVICE, SND_PCM_STREAM_PLAYBACK, 0);
-	if (result < 0) {
-		printf("snd_pcm_open(&handle, %s, SND_PCM_STREAM_PLAYBACK, 0): %s\n",
-				SOUND_DEVICE, snd_strerror(result));
-		exit(EXIT_FAILURE);
-	}
-
-	snd_config_update_free_global();
-
-	result = snd_pcm_set_params(handle,
-					  SND_PCM_FORMAT_S16_LE,
-					  SND_PCM_ACCESS_RW_INTERLEAVED,
-					  wave_get_number_of_channels(wave),
-					  wave_get_sample_rate(wave),
-					  1,
-					  500000);
-	if (result < 0) {
-		fprintf(stderr, "Playback open error: %s\n", snd_strerror(result));
-		exit(EXIT_FAILURE);
-	}
-
-	const snd_pcm_sframes_t period_size = 64;
-	int frame_size = snd_pcm_frames_to_bytes(handle, 1);
-
-	uint8_t buffer[period_size * frame_size];
-	size_t frame_index = 0;
+static Wave *session_peek(void *context, size_t index)
+{
+	return playlist_get((Playlist *)context, index);
+}
 
-	size_t read_frames = wave_get_samples(wave, frame_index, buffer, period_size);
+/**
+* Player session callback: the first wave finished, remove it from the playlist
+*/
+static void session_pop(void *context)
+{
+	Playlist *playlist = (Playlist *)context;
+	Wave *wave = playlist_first(playlist);
+	playlist_remove(playlist, 0);
+	wave_destroy(wave);
+}
 
-	// Setup in order to allow async keyboard interruptions
-	set_conio_terminal_mode();
+/**
+* Player session callback: announce the wave that started playing (the terminal is in raw mode)
+*/
+static void session_track_started(void *context, Wave *wave)
+{
+	printf("\rCurrently playing \"%s\"\r\n", strrchr(wave->filepath, '/') + 1);
+}
 
-	while (read_frames > 0) {
-		// If user presses key while playing...
-		if (kbhit()) {
-			int key_pressed = termius_get_char();
-
-			int return_value = -1;
-			switch(key_pressed) {
-				case 'p':
-					// Save the current frame in order to play it from there next time
-					last_frame_index = frame_index;
-					return_value = WAVE_PAUSE;
-					break;
-				case 'n':
-					return_value = WAVE_NEXT;
-					break;
-			}
-			// Reset terminal
-			reset_terminal_mode();
-			return return_value;
-		}
-		if (last_frame_index == 0) {
-			snd_pcm_sframes_t wrote_frames = snd_pcm_writei(handle, buffer, read_frames);
-			if (wrote_frames < 0)
-				wrote_frames = snd_pcm_recover(handle, wrote_frames, 0);
-			if (wrote_frames < 0) {
-				printf("snd_pcm_writei failed: %s\n", snd_strerror(wrote_frames));
-				break;
-			}
+/**
+* Player session callback: announce the wave being exported
+*/
+static void session_track_exported(void *context, Wave *wave)
+{
+	printf("Exporting \"%s\"\n", strrchr(wave->filepath, '/') + 1);
+}
 
-			if (wrote_frames < read_frames)
-				fprintf(stderr, "Short write (expected %li, wrote %li)\n",
-						read_frames, wrote_frames);
-		} else {
-			frame_index = last_frame_index;
-			last_frame_index = 0;
-		}
+/**
+* Player session callback: show how far the device got in the wave (overwrites the same line)
+*/
+static void session_track_progress(void *context, Wave *wave, uint64_t frame_index)
+{
+	uint64_t position = frame_index / wave_get_sample_rate(wave);
+	uint64_t duration = wave_get_frame_count(wave) / wave_get_sample_rate(wave);
+	printf("\r%02d:%02d / %02d:%02d", (int)(position / 60), (int)(position % 60), (int)(duration / 60), (int)(duration % 60));
+	fflush(stdout);
+}
 
-		frame_index += period_size;
-		read_frames = wave_get_samples(wave, frame_index, buffer, period_size);
+/**
+* Player session callback: read the key pressed while playing, if any
+* @returns WAVE_PAUSE, WAVE_NEXT or 0
+*/
+static int session_poll_command(void *context)
+{
+	if (!kbhit())
+		return 0;
+	switch (termius_get_char()) {
+		case 'p':
+			return WAVE_PAUSE;
+		case 'n':
+			return WAVE_NEXT;
 	}
-
-	/* pass the remaining samples, otherwise they're dropped in close */
-	result = snd_pcm_drain(handle);
-	if (result < 0)
-		printf("snd_pcm_drain failed: %s\n", snd_strerror(result));
-
-	snd_pcm_close(handle);
-	snd_config_update_free_global();
-	
-	// Reset terminal
-	reset_terminal_mode();
-
-	last_frame_index = 0;
-
 	return 0;
 }